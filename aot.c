@@ -0,0 +1,500 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+
+// How an instruction continues
+typedef enum {
+    K_UNKNOWN,   // Unknown opcode, the interpreter stops there
+    K_NEXT,      // With the next instruction
+    K_JUMP,      // At nnn (1nnn)
+    K_CALL,      // At nnn, and at the next instruction once it returns
+    K_SKIP,      // With the next instruction or the one after it
+    K_INDIRECT,  // At nnn + a register (Bnnn)
+    K_RETURN,    // Wherever the stack says (00EE), or nowhere (00FD)
+    K_BREAK,     // With the next instruction, after the caller checks
+                 // what it did (writes to memory and waits)
+    K_LONG,      // After its operand, read at run time (F000 nnnn)
+} Kind;
+
+// The ROM as loaded in RAM, and the code found in it
+typedef struct {
+    uint8_t RAM[RAM_SIZE];
+    int end;  // Address right after the ROM
+    unsigned quirks;
+
+    bool leader[RAM_SIZE];    // Does a block start here?
+    bool walked[RAM_SIZE];    // Is there an instruction here?
+    uint16_t work[RAM_SIZE];  // Leaders left to walk
+    int pending;
+} Program;
+
+static uint16_t
+fetch(const Program *prog, int addr)
+{
+    return prog->RAM[addr] << 8 | prog->RAM[addr + 1];
+}
+
+// Same decoding as decode_and_execute() in chip8.c
+static Kind
+kind(uint16_t opcode, unsigned quirks)
+{
+    uint8_t x = (opcode & 0x0F00) >> 8;
+    uint8_t n = opcode & 0x000F;
+    uint8_t kk = opcode & 0x00FF;
+    bool xo = quirks & C8_QUIRK_XO;
+
+    switch (opcode >> 12) {
+    case 0x0:
+        if (opcode == 0x00EE || opcode == 0x00FD) return K_RETURN;
+        return K_NEXT;
+    case 0x1:
+        return K_JUMP;
+    case 0x2:
+        return K_CALL;
+    case 0x5:
+        if (xo && n == 0x2) return K_BREAK;
+        if (xo && n == 0x3) return K_NEXT;
+        return K_SKIP;
+    case 0x3:
+    case 0x4:
+    case 0x9:
+        return K_SKIP;
+    case 0x8:
+        if ((opcode & 0xF) <= 0x7 || (opcode & 0xF) == 0xE) return K_NEXT;
+        return K_UNKNOWN;
+    case 0xB:
+        return K_INDIRECT;
+    case 0xD:
+        return (quirks & C8_QUIRK_DISPLAY_WAIT) ? K_BREAK : K_NEXT;
+    case 0xE:
+        return (kk == 0x9E || kk == 0xA1) ? K_SKIP : K_UNKNOWN;
+    case 0xF:
+        switch (kk) {
+        case 0x00:
+            return xo && x == 0 ? K_LONG : K_UNKNOWN;
+        case 0x01:
+        case 0x3A:
+            return xo ? K_NEXT : K_UNKNOWN;
+        case 0x02:
+            return xo && x == 0 ? K_NEXT : K_UNKNOWN;
+        case 0x0A:
+        case 0x33:
+        case 0x55:
+            return K_BREAK;
+        case 0x07:
+        case 0x15:
+        case 0x18:
+        case 0x1E:
+        case 0x29:
+        case 0x30:
+        case 0x65:
+        case 0x75:
+        case 0x85:
+            return K_NEXT;
+        }
+        return K_UNKNOWN;
+    default:
+        return K_NEXT;
+    }
+}
+
+// Does a whole instruction fit at addr?
+static bool
+in_rom(const Program *prog, int addr)
+{
+    return addr >= PC_OFFSET && addr + 1 < prog->end;
+}
+
+static void
+add_leader(Program *prog, int addr)
+{
+    if (!in_rom(prog, addr) || prog->leader[addr]) return;
+    prog->leader[addr] = true;
+    prog->work[prog->pending++] = addr;
+}
+
+// Keeps track of the registers set to constants, V[x] = -1 if unknown
+static void
+track(int V[16], uint16_t opcode, unsigned quirks)
+{
+    uint8_t x = (opcode & 0x0F00) >> 8;
+    uint8_t y = (opcode & 0x00F0) >> 4;
+    uint8_t kk = opcode & 0x00FF;
+
+    switch (opcode >> 12) {
+    case 0x5:
+        if ((quirks & C8_QUIRK_XO) && (opcode & 0xF) == 0x3)
+            for (int i = x < y ? x : y; i <= (x < y ? y : x); i++)
+                V[i] = -1;
+        break;
+    case 0x6:
+        V[x] = kk;
+        break;
+    case 0x7:
+        if (V[x] >= 0) V[x] = (V[x] + kk) & 0xFF;
+        break;
+    case 0x8:
+        V[x] = (opcode & 0xF) == 0 ? V[y] : -1;
+        if ((opcode & 0xF) != 0) V[0xF] = -1;
+        break;
+    case 0xC:
+        V[x] = -1;
+        break;
+    case 0xF:
+        if (kk == 0x07 || kk == 0x0A) V[x] = -1;
+        if (kk == 0x65 || kk == 0x85)
+            for (int i = 0; i <= x; i++)
+                V[i] = -1;
+        break;
+    }
+}
+
+// Jumps through Bnnn go to nnn + V0 (or to xnn + Vx with the jump quirk).
+// The target is known if the register was set on the way there, otherwise
+// nnn is assumed to be a table of jumps, the interpreter takes care of
+// anything else.
+static void
+add_indirect(Program *prog, uint16_t opcode, const int V[16])
+{
+    uint16_t nnn = opcode & 0x0FFF;
+    int reg = (prog->quirks & C8_QUIRK_JUMP) ? (opcode & 0x0F00) >> 8 : 0;
+    if (V[reg] >= 0) {
+        add_leader(prog, nnn + V[reg]);
+        return;
+    }
+
+    for (int i = 0; i < 256 && in_rom(prog, nnn + i); i += 2) {
+        if (i > 0 && kind(fetch(prog, nnn + i), prog->quirks) != K_JUMP)
+            break;
+        add_leader(prog, nnn + i);
+    }
+}
+
+// Follows the instructions from a leader until it branches, adding the
+// targets as leaders
+static void
+walk(Program *prog, int start)
+{
+    int V[16];
+    for (int i = 0; i < 16; i++)
+        V[i] = -1;
+
+    for (int addr = start; in_rom(prog, addr); addr += 2) {
+        // Code found from another leader, which starts a block here
+        if (prog->walked[addr]) {
+            if (addr != start) add_leader(prog, addr);
+            return;
+        }
+
+        uint16_t opcode = fetch(prog, addr);
+        uint16_t nnn = opcode & 0x0FFF;
+        Kind k = kind(opcode, prog->quirks);
+        if (k == K_UNKNOWN) return;
+        prog->walked[addr] = true;
+
+        switch (k) {
+        case K_NEXT:
+            track(V, opcode, prog->quirks);
+            continue;
+        case K_JUMP:
+            add_leader(prog, nnn);
+            return;
+        case K_CALL:
+            add_leader(prog, nnn);
+            add_leader(prog, addr + 2);
+            return;
+        case K_SKIP:
+            // Skips step over the whole F000 nnnn (XO-CHIP)
+            add_leader(prog, addr + 2);
+            if ((prog->quirks & C8_QUIRK_XO) && in_rom(prog, addr + 2) &&
+                fetch(prog, addr + 2) == 0xF000)
+                add_leader(prog, addr + 6);
+            else
+                add_leader(prog, addr + 4);
+            return;
+        case K_INDIRECT:
+            add_indirect(prog, opcode, V);
+            return;
+        case K_BREAK:
+            add_leader(prog, addr + 2);
+            return;
+        case K_LONG:
+            add_leader(prog, addr + 4);
+            return;
+        default:
+            return;
+        }
+    }
+}
+
+// Returns the no. instructions of the block starting at addr. Blocks end
+// where the code branches, at the next leader, or at C8_AOT_MAX_LENGTH
+// instructions, in which case the next instruction becomes a leader.
+static int
+block_length(Program *prog, int start)
+{
+    int len = 0;
+    int addr = start;
+    while (in_rom(prog, addr) && prog->walked[addr]) {
+        if (len == C8_AOT_MAX_LENGTH) {
+            prog->leader[addr] = true;
+            break;
+        }
+        if (addr != start && prog->leader[addr]) break;
+
+        len++;
+        if (kind(fetch(prog, addr), prog->quirks) != K_NEXT) break;
+        addr += 2;
+    }
+    return len;
+}
+
+// Writes the statement executing an instruction, which returns the same as
+// execute() in chip8.c if it's the last one of the block
+static void
+emit_instr(FILE *out, const Program *prog, int addr, bool last)
+{
+    uint16_t opcode = fetch(prog, addr);
+    uint8_t x = (opcode & 0x0F00) >> 8;
+    uint8_t y = (opcode & 0x00F0) >> 4;
+    uint8_t n = opcode & 0x000F;
+    uint8_t kk = opcode & 0x00FF;
+    uint16_t nnn = opcode & 0x0FFF;
+    unsigned quirks = prog->quirks;
+
+    // Only jumps, skips, F000 and idle loops look at PC and opcode, and those
+    // always end a block
+    if (last) {
+        fprintf(out, "    vm->PC = 0x%03X;\n", addr + 2);
+        fprintf(out, "    vm->opcode = 0x%04X;\n", opcode);
+    }
+
+    const char *ret = last ? "return " : "";
+    bool screen = false;
+    switch (opcode >> 12) {
+    case 0x0:
+        if ((opcode & 0xFFF0) == 0x00C0 ||
+            ((quirks & C8_QUIRK_XO) && (opcode & 0xFFF0) == 0x00D0)) {
+            fprintf(out, "    op_00%Xn(vm, %d, 0x%02X);\n", kk >> 4, n,
+                    quirks);
+            screen = true;
+        } else if (opcode == 0x00E0) {
+            fprintf(out, "    op_00E0(vm);\n");
+            screen = true;
+        } else if (opcode == 0x00FB || opcode == 0x00FC) {
+            fprintf(out, "    op_%04X(vm, 0x%02X);\n", opcode, quirks);
+            screen = true;
+        } else if (opcode == 0x00EE || opcode == 0x00FD) {
+            fprintf(out, "    op_%04X(vm);\n", opcode);
+        } else if (opcode == 0x00FE || opcode == 0x00FF) {
+            fprintf(out, "    op_%04X(vm, 0x%02X);\n", opcode, quirks);
+        }
+        break;
+    case 0x1:
+        fprintf(out, "    %sop_1nnn(vm, 0x%03X);\n", ret, nnn);
+        return;
+    case 0x2:
+        fprintf(out, "    op_2nnn(vm, 0x%03X);\n", nnn);
+        break;
+    case 0x3:
+    case 0x4:
+        fprintf(out, "    op_%Xxkk(vm, %d, 0x%02X, 0x%02X);\n", opcode >> 12,
+                x, kk, quirks);
+        break;
+    case 0x6:
+    case 0x7:
+    case 0xC:
+        fprintf(out, "    op_%Xxkk(vm, %d, 0x%02X);\n", opcode >> 12, x, kk);
+        break;
+    case 0x5:
+        if ((quirks & C8_QUIRK_XO) && (n == 2 || n == 3))
+            fprintf(out, "    op_5xy%d(vm, %d, %d);\n", n, x, y);
+        else
+            fprintf(out, "    op_5xy0(vm, %d, %d, 0x%02X);\n", x, y, quirks);
+        break;
+    case 0x9:
+        fprintf(out, "    op_9xy0(vm, %d, %d, 0x%02X);\n", x, y, quirks);
+        break;
+    case 0x8:
+        if (n == 1 || n == 2 || n == 3 || n == 6 || n == 0xE)
+            fprintf(out, "    op_8xy%X(vm, %d, %d, 0x%02X);\n", n, x, y,
+                    quirks);
+        else
+            fprintf(out, "    op_8xy%X(vm, %d, %d);\n", n, x, y);
+        break;
+    case 0xA:
+        fprintf(out, "    op_Annn(vm, 0x%03X);\n", nnn);
+        break;
+    case 0xB:
+        fprintf(out, "    op_Bnnn(vm, %d, 0x%03X, 0x%02X);\n", x, nnn, quirks);
+        break;
+    case 0xD:
+        fprintf(out, "    %sdraw(vm, %d, %d, %d, 0x%02X);\n", ret, x, y, n,
+                quirks);
+        if (last) return;
+        break;
+    case 0xE:
+        fprintf(out, "    op_Ex%02X(vm, %d, 0x%02X);\n", kk, x, quirks);
+        break;
+    case 0xF:
+        if (kk == 0x0A) {
+            fprintf(out, "    %sop_Fx0A(vm, %d);\n", ret, x);
+            return;
+        }
+        if (kk == 0x00 || kk == 0x02)
+            fprintf(out, "    op_F%03X(vm);\n", kk);
+        else if (kk == 0x01)
+            fprintf(out, "    op_Fn01(vm, %d);\n", x);
+        else if (kk == 0x3A)
+            fprintf(out, "    op_Fx3A(vm, %d);\n", x);
+        else if (kk == 0x33 || kk == 0x55 || kk == 0x65)
+            fprintf(out, "    op_Fx%02X(vm, %d, 0x%02X);\n", kk, x, quirks);
+        else
+            fprintf(out, "    op_Fx%02X(vm, %d);\n", kk, x);
+        break;
+    }
+
+    if (screen) fprintf(out, "    vm->screen_updated = true;\n");
+    if (last) fprintf(out, "    return 0;\n");
+}
+
+// Writes a C file that builds in place of chip8.c, with a function per block
+// and the tables c8_attach_aot() looks up. Returns the no. blocks.
+static int
+emit_program(FILE *out, Program *prog, const char *rom_name,
+             const char *platform)
+{
+    fprintf(out,
+            "// %s (%s) recompiled by chip8-aot, do not edit.\n"
+            "// Build this file in place of chip8.c, see c8_attach_aot().\n"
+            "#define C8_AOT\n"
+            "#include \"chip8.c\"\n"
+            "\n"
+            "static const uint8_t aot_rom[] = {",
+            rom_name, platform);
+    for (int addr = PC_OFFSET; addr < prog->end; addr++) {
+        int i = addr - PC_OFFSET;
+        fprintf(out, "%s0x%02X,", i % 12 == 0 ? "\n    " : " ",
+                prog->RAM[addr]);
+    }
+    fprintf(out, "\n};\n");
+
+    static int start[RAM_SIZE], length[RAM_SIZE];
+    int blocks = 0;
+    for (int addr = PC_OFFSET; addr < prog->end; addr++) {
+        if (!prog->leader[addr]) continue;
+        int len = block_length(prog, addr);
+        if (len == 0) continue;
+
+        fprintf(out, "\nstatic int\naot_%03X(Chip8 *vm)\n{\n", addr);
+        for (int i = 0; i < len; i++)
+            emit_instr(out, prog, addr + 2 * i, i == len - 1);
+        fprintf(out, "}\n");
+
+        start[blocks] = addr;
+        length[blocks++] = len;
+    }
+
+    fprintf(out, "\nstatic const AotBlock aot_blocks[] = {\n");
+    for (int b = 0; b < blocks; b++) {
+        int end = start[b] + 2 * length[b];
+        fprintf(out, "    {0x%03X, 0x%03X, %d, aot_%03X},\n", start[b], end,
+                length[b], start[b]);
+    }
+    fprintf(out,
+            "};\n"
+            "\n"
+            "static const AotProgram aot_program = {\n"
+            "    aot_rom,\n"
+            "    sizeof(aot_rom),\n"
+            "    0x%02X,\n"
+            "    aot_blocks,\n"
+            "    sizeof(aot_blocks) / sizeof(aot_blocks[0]),\n"
+            "};\n",
+            prog->quirks);
+    return blocks;
+}
+
+static void
+usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [options] <rom-file> <c-file>\n"
+            "  -p <platform>  chip8, schip1.0, schip1.1 or xochip (default:\n"
+            "                 chip8), followed by extra quirks as in\n"
+            "                 chip8-headless\n"
+            "Recompiles the ROM for the quirks of the platform into a C file\n"
+            "to build in place of chip8.c, e.g. with\n"
+            "  make chip8-headless-aot AOT=<c-file>\n",
+            argv0);
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *platform = "chip8";
+    int i = 1;
+    if (i + 1 < argc && strcmp(argv[i], "-p") == 0) {
+        platform = argv[i + 1];
+        i += 2;
+    }
+
+    Platform plt;
+    uint8_t quirks;
+    if (argc - i != 2 || !c8_parse_platform(platform, &plt, &quirks)) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char *rom_path = argv[i];
+    const char *out_path = argv[i + 1];
+
+    // The platform's quirks come from the emulator
+    static Chip8 vm;
+    c8_init(&vm, 0, plt, 0);
+    c8_set_quirks(&vm, vm.quirks | quirks);
+
+    static Program prog;
+    prog.quirks = vm.quirks;
+    FILE *file = fopen(rom_path, "rb");
+    if (!file) {
+        fprintf(stderr, "Error: couldn't open ROM file\n");
+        return 1;
+    }
+    prog.end = PC_OFFSET + (int) fread(&prog.RAM[PC_OFFSET], 1, MAX_ROM_SIZE,
+                                       file);
+    fclose(file);
+    if (prog.end > c8_memory_size(&vm)) {
+        fprintf(stderr, "Error: the ROM doesn't fit in %d bytes of memory\n",
+                c8_memory_size(&vm));
+        return 1;
+    }
+
+    add_leader(&prog, PC_OFFSET);
+    while (prog.pending > 0)
+        walk(&prog, prog.work[--prog.pending]);
+
+    FILE *out = fopen(out_path, "w");
+    if (!out) {
+        fprintf(stderr, "Error: couldn't write %s\n", out_path);
+        return 1;
+    }
+    const char *slash = strrchr(rom_path, '/');
+    int blocks = emit_program(out, &prog, slash ? slash + 1 : rom_path,
+                              platform);
+    if (fclose(out) != 0 || blocks == 0) {
+        fprintf(stderr, "Error: no code found in the ROM\n");
+        remove(out_path);
+        return 1;
+    }
+
+    int instructions = 0;
+    for (int addr = PC_OFFSET; addr < prog.end; addr++)
+        instructions += prog.walked[addr];
+    printf("%s: %d blocks, %d instructions (%d%% of the ROM)\n", out_path,
+           blocks, instructions,
+           200 * instructions / (prog.end > PC_OFFSET ? prog.end - PC_OFFSET
+                                                       : 1));
+    return 0;
+}
@@ -1,3 +1,9 @@
+#include <stddef.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "chip8.h"
 
 // Source: skeeto/handmade hero
@@ -10,6 +16,14 @@
 #define ASSERT(expr)
 #endif
 
+// Inlined even without optimizations, so that constant arguments can be
+// folded into the caller (see INTERPRETERS)
+#ifdef __GNUC__
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
 // Source: libgcc
 static void *
 memset_(void *dest, int val, uint64_t len)
@@ -39,6 +53,38 @@ rand_byte(uint64_t *s)
     return *s >> 56;
 }
 
+#define ALL_ROWS UINT64_MAX
+
+static void invalidate_code(Chip8 *vm, int addr, int len);
+static void invalidate_cache(Chip8 *vm, int addr, int len);
+static void invalidate_jit(Chip8 *vm, int addr, int len);
+static void validate_aot(Chip8 *vm);
+static uint8_t select_interpreter(uint8_t quirks);
+static void screen_row(Chip8 *vm, int plane, int row, uint64_t out[2]);
+static bool lo_plane(Chip8 *vm);
+static void settle_lo_res(Chip8 *vm);
+
+// Profiler hooks (see c8_attach_profile()), which vanish without C8_PROFILE
+#ifdef C8_PROFILE
+static void profile_count(Chip8 *vm, int op, uint16_t addr);
+static void profile_opcode(Chip8 *vm);
+static void profile_skip(Chip8 *vm, int n);
+static uint64_t profile_clock(Chip8 *vm);
+static void profile_time(Chip8 *vm, C8TimedOp op, uint64_t start);
+
+#define PROFILE_INSTR(vm, op) profile_count(vm, op, (vm)->PC - 2)
+#define PROFILE_OPCODE(vm) profile_opcode(vm)
+#define PROFILE_SKIP(vm, n) profile_skip(vm, n)
+#define PROFILE_START(vm) uint64_t profile_start = profile_clock(vm)
+#define PROFILE_STOP(vm, op) profile_time(vm, op, profile_start)
+#else
+#define PROFILE_INSTR(vm, op)
+#define PROFILE_OPCODE(vm)
+#define PROFILE_SKIP(vm, n)
+#define PROFILE_START(vm)
+#define PROFILE_STOP(vm, op)
+#endif
+
 static const uint8_t font[] = {
     // Standard 8x5 font
     0xF0, 0x90, 0x90, 0x90, 0xF0,  // 0
@@ -77,6 +123,8 @@ c8_reset(Chip8 *vm)
     memset_(vm, 0, sizeof(Chip8));
     memcpy_(&vm->RAM[FONT_OFFSET], font, sizeof(font));
     vm->PC = PC_OFFSET;
+    vm->planes = 1;
+    vm->pitch = 64;
 }
 
 void
@@ -84,7 +132,10 @@ c8_soft_reset(Chip8 *vm)
 {
     *vm = (Chip8){
         .PC = PC_OFFSET,
+        .planes = 1,
+        .pitch = 64,
         .screen_updated = true,
+        .dirty_rows = ALL_ROWS,
     };
 }
 
@@ -93,15 +144,46 @@ c8_init(Chip8 *vm, int emu_freq, Platform plt, uint64_t seed)
 {
     c8_reset(vm);
     vm->IPF = (int) ((double) emu_freq / GAME_LOOP_FREQ + 0.5);
-    vm->platform = plt;
+    c8_set_platform(vm, plt);
     vm->rng = seed;
 }
 
+void
+c8_attach_xo_ram(Chip8 *vm, uint8_t *ram)
+{
+    // Memory past 4 KB reads as zeros until it's written
+    vm->xo_ram = ram;
+    if (ram) memset_(ram, 0, XO_RAM_SIZE);
+    invalidate_code(vm, CHIP8_RAM_SIZE, XO_RAM_SIZE);
+}
+
+// FNV-1a, 32-bit version
+static uint32_t
+hash32(const unsigned char *data, int size)
+{
+    uint32_t hash = 0x811c9dc5;
+    for (int i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 0x01000193;
+    }
+    return hash;
+}
+
 void
 c8_load_rom(Chip8 *vm, unsigned char *rom, int size)
 {
-    ASSERT(size <= MAX_ROM_SIZE);
-    memcpy_(&vm->RAM[PC_OFFSET], rom, size);
+    ASSERT(size <= c8_memory_size(vm) - PC_OFFSET);
+    ASSERT(vm->xo_ram || !(vm->quirks & C8_QUIRK_XO));
+    int low = size < CHIP8_MAX_ROM_SIZE ? size : CHIP8_MAX_ROM_SIZE;
+    memcpy_(&vm->RAM[PC_OFFSET], rom, low);
+    if (size > low) memcpy_(vm->xo_ram, rom + low, size - low);
+    invalidate_code(vm, PC_OFFSET, size);
+    validate_aot(vm);
+
+    // Save states store RAM as a diff against this image
+    vm->rom = rom;
+    vm->rom_size = size;
+    vm->rom_hash = hash32(rom, size);
 }
 
 void
@@ -117,12 +199,45 @@ c8_sound(Chip8 *vm)
     return vm->ST > 0;
 }
 
+bool
+c8_audio_pattern(Chip8 *vm, uint8_t pattern[16], int *pitch)
+{
+    if (!vm->has_pattern) return false;
+    memcpy_(pattern, vm->pattern, sizeof(vm->pattern));
+    *pitch = vm->pitch;
+    return true;
+}
+
 bool
 c8_screen_updated(Chip8 *vm)
 {
     return vm->screen_updated;
 }
 
+uint64_t
+c8_dirty_rows(Chip8 *vm)
+{
+    return vm->dirty_rows;
+}
+
+bool
+c8_idle(Chip8 *vm)
+{
+    return vm->idle;
+}
+
+int
+c8_skipped(Chip8 *vm)
+{
+    return vm->skipped;
+}
+
+void
+c8_set_idle_skip(Chip8 *vm, bool on)
+{
+    vm->run_idle = !on;
+}
+
 bool
 c8_ended(Chip8 *vm)
 {
@@ -133,30 +248,67 @@ int
 c8_get_pixel(Chip8 *vm, int row, int col)
 {
     ASSERT(row >= 0 && row <= 63 && col >= 0 && col <= 127);
-    int byte = 128 * row + col;            // Row major order
-    byte /= 8;                             // Convert 128x64 to 16x64
-    uint8_t bitmask = 1 << (7 - col % 8);  // Bitmask to get pixel
-    return (vm->screen[byte] & bitmask) != 0;
+    int color = 0;
+    for (int p = 0; p < C8_PLANES; p++) {
+        uint64_t word;
+        if (!vm->hi_res && !vm->upscaled)
+            word = vm->lo_screen[p][row / 2] << (col / 2);
+        else  // Each row is 2 words long, MSB is the leftmost pixel
+            word = vm->screen[p][row][col / 64] << (col % 64);
+        color |= (int) (word >> 63) << p;
+    }
+    return color;
 }
 
 void
-set_pixel(Chip8 *vm, int row, int col)
+c8_export_screen(Chip8 *vm, uint64_t out[SCREEN_HEIGHT][2])
 {
-    ASSERT(row >= 0 && row <= 63 && col >= 0 && col <= 127);
-    int byte = 128 * row + col;            // Row major order
-    byte /= 8;                             // Convert 128x64 to 16x64
-    uint8_t bitmask = 1 << (7 - col % 8);  // Bitmask to set pixel
-    vm->screen[byte] |= bitmask;
+    c8_export_plane(vm, 0, out);
 }
 
 void
-clear_pixel(Chip8 *vm, int row, int col)
+c8_export_plane(Chip8 *vm, int plane, uint64_t out[SCREEN_HEIGHT][2])
 {
-    ASSERT(row >= 0 && row <= 63 && col >= 0 && col <= 127);
-    int byte = 128 * row + col;            // Row major order
-    byte /= 8;                             // Convert 128x64 to 16x64
-    uint8_t bitmask = 1 << (7 - col % 8);  // Bitmask to clear pixel
-    vm->screen[byte] &= ~bitmask;
+    ASSERT(plane >= 0 && plane < C8_PLANES);
+    for (int row = 0; row < SCREEN_HEIGHT; row++)
+        screen_row(vm, plane, row, out[row]);
+}
+
+// Is anything drawn on the plane?
+static bool
+plane_used(Chip8 *vm, int plane)
+{
+    uint64_t used = 0;
+    if (!vm->hi_res && !vm->upscaled) {
+        for (int row = 0; row < SCREEN_HEIGHT / 2; row++)
+            used |= vm->lo_screen[plane][row];
+    } else {
+        for (int row = 0; row < SCREEN_HEIGHT; row++)
+            used |= vm->screen[plane][row][0] | vm->screen[plane][row][1];
+    }
+    return used != 0;
+}
+
+uint64_t
+c8_screen_hash(Chip8 *vm)
+{
+    // Source: http://www.isthe.com/chongo/tech/comp/fnv/
+    // Hashes the screen a byte at a time, from left to right, then the second
+    // plane the same way. Screens drawn on a single plane hash as they did
+    // before XO-CHIP.
+    uint64_t hash = 0xcbf29ce484222325;
+    for (int p = 0; p < C8_PLANES; p++) {
+        if (p > 0 && !plane_used(vm, p)) continue;
+        for (int row = 0; row < SCREEN_HEIGHT; row++) {
+            uint64_t line[2];
+            screen_row(vm, p, row, line);
+            for (int i = 0; i < SCREEN_WIDTH / 8; i++) {
+                hash ^= (line[i / 8] >> (56 - 8 * (i % 8))) & 0xFF;
+                hash *= 0x100000001b3;
+            }
+        }
+    }
+    return hash;
 }
 
 int
@@ -185,497 +337,4442 @@ c8_set_freq(Chip8 *vm, int emu_freq)
     vm->IPF = (int) ((double) emu_freq / GAME_LOOP_FREQ + 0.5);
 }
 
+static const uint8_t platform_quirks[] = {
+    [P_CHIP8] = C8_QUIRKS_CHIP8,
+    [P_SCHIP_1_0] = C8_QUIRKS_SCHIP_1_0,
+    [P_SCHIP_1_1] = C8_QUIRKS_SCHIP_1_1,
+    [P_XOCHIP] = C8_QUIRKS_XOCHIP,
+};
+
 void
 c8_set_platform(Chip8 *vm, Platform plt)
 {
     vm->platform = plt;
+    c8_set_quirks(vm, platform_quirks[plt]);
 }
 
-// Display n-byte sprite starting at memory location I at (Vx, Vy),
-// set VF = collision
-static void
-op_Dxyn(Chip8 *vm, uint8_t x, uint8_t y, uint8_t n)
+void
+c8_set_quirks(Chip8 *vm, uint8_t quirks)
 {
-    vm->V[0xF] = 0;
-    int screen_width = vm->hi_res ? 128 : 64;
-    int screen_height = vm->hi_res ? 64 : 32;
+    // Which opcodes are XO-CHIP instructions, and how 8xy1-8xy3, 8xy6 and
+    // 8xyE are translated, depend on the quirks. Code is dropped before the
+    // memory in use changes, so that all of it goes.
+    invalidate_cache(vm, 0, RAM_SIZE);
+    invalidate_jit(vm, 0, RAM_SIZE);
 
-    // Top-left coordinate of the sprite (origin)
-    int xo = vm->V[x] % screen_width;   // X origin (column)
-    int yo = vm->V[y] % screen_height;  // Y origin (row)
+    // Memory past 4 KB reads as zeros if it comes back
+    if ((vm->quirks & ~quirks & C8_QUIRK_XO) && vm->xo_ram)
+        memset_(vm->xo_ram, 0, XO_RAM_SIZE);
+
+    vm->quirks = quirks;
+    vm->interpreter = select_interpreter(quirks);
+}
 
-    // Draw an n pixels tall sprite
-    for (int row = 0; row < n; row++) {
-        if (yo + row >= screen_height) break;
-        uint8_t sprite_row = vm->RAM[vm->I + row];
+const char *
+c8_quirk_name(int n)
+{
+    static const char *const names[C8_QUIRKS] = {
+        "shift", "jump", "load-store-x", "load-store-0", "vf-reset",
+        "display-wait", "wrap", "xo-chip",
+    };
+    return (n >= 0 && n < C8_QUIRKS) ? names[n] : NULL;
+}
 
-        // Sprites are guaranteed to be 8 pixels wide
-        // (where each pixel is represented by a single bit)
-        for (int col = 0; col < 8; col++) {
-            if (xo + col >= screen_width) break;
-            int xc = xo + col;  // X origin + X offset
-            int yc = yo + row;  // Y origin + Y offset
+const char *
+c8_platform_name(Platform plt)
+{
+    static const char *const names[] = {"chip8", "schip1.0", "schip1.1",
+                                        "xochip"};
+    return (plt >= P_CHIP8 && plt <= P_XOCHIP) ? names[plt] : NULL;
+}
 
-            uint8_t sprite_pixel = (sprite_row & (1 << (7 - col))) != 0;
+// Length of the name at s, which ends at a '+' or at the end of s
+static int
+name_length(const char *s)
+{
+    int len = 0;
+    while (s[len] != '\0' && s[len] != '+')
+        len++;
+    return len;
+}
 
-            if (vm->hi_res) {
-                int screen_pixel = c8_get_pixel(vm, yc, xc);
-                vm->V[0xF] |= screen_pixel & sprite_pixel;
+// Returns true if s[0, len) is the whole name
+static bool
+matches(const char *s, int len, const char *name)
+{
+    int i = 0;
+    while (i < len && name[i] == s[i])
+        i++;
+    return i == len && name[len] == '\0';
+}
 
-                if (screen_pixel ^ sprite_pixel)
-                    set_pixel(vm, yc, xc);
-                else
-                    clear_pixel(vm, yc, xc);
-            } else {
-                // Scale coordinates
-                xc *= 2;
-                yc *= 2;
-
-                int screen_pixel = c8_get_pixel(vm, yc, xc);
-                vm->V[0xF] |= screen_pixel & sprite_pixel;
-
-                // Scale 64x32 up to 128x64
-                if (screen_pixel ^ sprite_pixel) {
-                    set_pixel(vm, yc, xc);
-                    set_pixel(vm, yc, xc + 1);
-                    set_pixel(vm, yc + 1, xc);
-                    set_pixel(vm, yc + 1, xc + 1);
-                } else {
-                    clear_pixel(vm, yc, xc);
-                    clear_pixel(vm, yc, xc + 1);
-                    clear_pixel(vm, yc + 1, xc);
-                    clear_pixel(vm, yc + 1, xc + 1);
-                }
+bool
+c8_parse_platform(const char *s, Platform *plt, uint8_t *quirks)
+{
+    int len = name_length(s);
+    bool found = false;
+    for (Platform p = P_CHIP8; p <= P_XOCHIP && !found; p++) {
+        if (matches(s, len, c8_platform_name(p))) {
+            *plt = p;
+            found = true;
+        }
+    }
+
+    *quirks = 0;
+    for (s += len; found && *s == '+'; s += len) {
+        len = name_length(++s);
+        found = false;
+        for (int q = 0; q < C8_QUIRKS && !found; q++) {
+            if (matches(s, len, c8_quirk_name(q))) {
+                *quirks |= 1 << q;
+                found = true;
             }
         }
     }
+    return found;
 }
 
-// If n=0 and extended mode, show 16x16 sprite (S-CHIP)
-static void
-op_Dxy0(Chip8 *vm, uint8_t x, uint8_t y, uint8_t n)
+// Addresses are masked with this, the memory in use being a power of 2
+static ALWAYS_INLINE unsigned
+ram_mask(unsigned quirks)
 {
-    ASSERT(n == 0 && vm->hi_res);
+    return (quirks & C8_QUIRK_XO) ? RAM_SIZE - 1 : CHIP8_RAM_SIZE - 1;
+}
 
-    vm->V[0xF] = 0;
-    int screen_width = 128;
-    int screen_height = 64;
+// The byte at addr in the memory in use: the first 4 KB are part of the
+// emulator, the rest is attached by the host (see c8_attach_xo_ram())
+static ALWAYS_INLINE uint8_t *
+ram_at(Chip8 *vm, unsigned addr)
+{
+    return addr < CHIP8_RAM_SIZE ? &vm->RAM[addr]
+                                 : &vm->xo_ram[addr - CHIP8_RAM_SIZE];
+}
 
-    // Top-left coordinate of the sprite (origin)
-    int xo = vm->V[x] % screen_width;   // X origin (column)
-    int yo = vm->V[y] % screen_height;  // Y origin (row)
+int
+c8_memory_size(const Chip8 *vm)
+{
+    return (int) ram_mask(vm->quirks) + 1;
+}
 
-    // Draw a 16 pixels tall hi-res sprite
-    for (int row = 0; row < 16; row++) {
-        if (yo + row >= screen_height) break;
-        uint16_t sprite_row = vm->RAM[vm->I + 2 * row] << 8 |
-                              vm->RAM[vm->I + 2 * row + 1];
-
-        // Hi-res sprites are guaranteed to be 16 pixels wide
-        // (where each pixel is represented by a single bit)
-        for (int col = 0; col < 16; col++) {
-            if (xo + col >= screen_width) break;
-            int xc = xo + col;  // X origin + X offset
-            int yc = yo + row;  // Y origin + Y offset
-
-            uint8_t sprite_pixel = (sprite_row & (1 << (15 - col))) != 0;
-            int screen_pixel = c8_get_pixel(vm, yc, xc);
-            vm->V[0xF] |= screen_pixel & sprite_pixel;
-
-            if (screen_pixel ^ sprite_pixel)
-                set_pixel(vm, yc, xc);
-            else
-                clear_pixel(vm, yc, xc);
-        }
-    }
+uint8_t
+c8_read_ram(Chip8 *vm, uint16_t addr)
+{
+    return *ram_at(vm, addr & ram_mask(vm->quirks));
 }
 
-// Scroll display n lines down (S-CHIP)
+// Part of the memory in use right after c8_load_rom(), before the ROM
+// modified anything: data, or zeros if NULL
+typedef struct {
+    int start;
+    int size;
+    const uint8_t *data;
+} Region;
+
+#define IMAGE_REGIONS 7
+
+// Start of the memory past 4 KB, or of the end, whichever comes first
+static int
+below_xo(int addr)
+{
+    return addr < CHIP8_RAM_SIZE ? addr : CHIP8_RAM_SIZE;
+}
+
+// Splits the memory in use into the font, the ROM and the zeros around them.
+// The memory past 4 KB is a separate buffer, so the ROM and the zeros after
+// it are split there, leaving empty regions if they don't cross it.
 static void
-op_00Cn(Chip8 *vm, uint8_t n)
+rom_image(Chip8 *vm, Region image[IMAGE_REGIONS])
 {
-    int rows = vm->hi_res ? 64 : 32;
-    int cols = vm->hi_res ? (128 / 8) : (64 / 8);
-    rows--;
-    while (rows >= n) {
-        memcpy_(&vm->screen[rows * cols], &vm->screen[(rows - n) * cols], cols);
-        rows--;
-    }
-    memset_(vm->screen, 0, n * cols);
+    int size = c8_memory_size(vm);
+    int font_end = FONT_OFFSET + (int) sizeof(font);
+    int rom_end = PC_OFFSET + (vm->rom ? vm->rom_size : 0);
+    if (rom_end > size) rom_end = size;
+    int xo_rom_end = rom_end > CHIP8_RAM_SIZE ? rom_end : CHIP8_RAM_SIZE;
+    const uint8_t *xo_rom =
+        rom_end > CHIP8_RAM_SIZE ? vm->rom + CHIP8_MAX_ROM_SIZE : NULL;
+
+    image[0] = (Region){0, FONT_OFFSET, NULL};
+    image[1] = (Region){FONT_OFFSET, sizeof(font), font};
+    image[2] = (Region){font_end, PC_OFFSET - font_end, NULL};
+    image[3] = (Region){PC_OFFSET, below_xo(rom_end) - PC_OFFSET, vm->rom};
+    image[4] = (Region){below_xo(rom_end),
+                        below_xo(size) - below_xo(rom_end), NULL};
+    image[5] = (Region){CHIP8_RAM_SIZE, xo_rom_end - CHIP8_RAM_SIZE, xo_rom};
+    image[6] = (Region){xo_rom_end, size - xo_rom_end, NULL};
 }
 
-// Scroll display 4 pixels right (S-CHIP)
+// A plane of the screen as bytes, from left to right (same order as
+// c8_screen_hash())
 static void
-op_00FB(Chip8 *vm)
+screen_to_bytes(Chip8 *vm, int plane, uint8_t *bytes)
 {
-    int rows = vm->hi_res ? 64 : 32;
-    int cols = vm->hi_res ? (128 / 8) : (64 / 8);
-    for (int y = 0; y < rows; y++) {
-        for (int x = cols - 1; x > 0; x--) {
-            vm->screen[y * cols + x] = vm->screen[y * cols + x] >> 4 |
-                                       vm->screen[y * cols + x - 1] << 4;
-        }
-        vm->screen[y * cols] >>= 4;
+    for (int row = 0; row < SCREEN_HEIGHT; row++) {
+        uint64_t line[2];
+        screen_row(vm, plane, row, line);
+        for (int i = 0; i < SCREEN_WIDTH / 8; i++)
+            *bytes++ = line[i / 8] >> (56 - 8 * (i % 8));
     }
 }
 
-// Scroll display 4 pixels left
 static void
-op_00FC(Chip8 *vm)
+screen_from_bytes(Chip8 *vm, int plane, const uint8_t *bytes)
 {
-    int rows = vm->hi_res ? 64 : 32;
-    int cols = vm->hi_res ? (128 / 8) : (64 / 8);
-    for (int y = 0; y < rows; y++) {
-        for (int x = 0; x < cols - 1; x++) {
-            vm->screen[y * cols + x] = vm->screen[y * cols + x] << 4 |
-                                       vm->screen[y * cols + x + 1] >> 4;
-        }
-        vm->screen[y * cols + (cols - 1)] <<= 4;
+    for (int row = 0; row < SCREEN_HEIGHT; row++) {
+        uint64_t *line = vm->screen[plane][row];
+        line[0] = line[1] = 0;
+        for (int i = 0; i < SCREEN_WIDTH / 8; i++)
+            line[i / 8] |= (uint64_t) *bytes++ << (56 - 8 * (i % 8));
     }
 }
 
-// Wait for a key press, store the value of the key in Vx
+// Unaligned load, compiles to a single instruction
+static uint64_t
+load64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy_(&v, p, sizeof(v));
+    return v;
+}
+
+static uint8_t *
+put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+    return p + 2;
+}
+
+static uint16_t
+get16(const uint8_t *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+// Diff being written by diff_range()
+typedef struct {
+    uint8_t *out;
+    int last;  // End of the previous chunk
+} DiffWriter;
+
+// Stores the bytes of data that differ from base (zeros if NULL) as chunks
+// of [skip: 2 bytes][length: 2 bytes][length bytes]. data is at pos in the
+// whole diff, the ranges of which must come in order. Needs at most
+// 2 * size bytes.
 static void
-op_Fx0A(Chip8 *vm, uint8_t x)
+diff_range(DiffWriter *w, int pos, const uint8_t *data, const uint8_t *base,
+           int size)
 {
-    // On the original COSMAC VIP, the key was only registered when it was
-    // pressed and then *released*
-    switch (vm->wait_for_key) {
-    case 0:
-        vm->PC -= 2;
-        for (int i = 0; i < KEYPAD_SIZE; i++)
-            if (vm->keypad[i]) return;
-        vm->wait_for_key = 1;
-        break;
-    case 1:
-        vm->PC -= 2;
-        for (int i = 0; i < KEYPAD_SIZE; i++) {
-            if (vm->keypad[i]) {
-                vm->V[x] = i;
-                vm->wait_for_key = 2;
-                return;
-            }
+    int i = 0;
+    while (i < size) {
+        // Most of RAM is unchanged, skip it 8 bytes at a time
+        if (i + 8 <= size &&
+            load64(&data[i]) == (base ? load64(&base[i]) : 0)) {
+            i += 8;
+            continue;
         }
-        break;
-    case 2:
-        for (int i = 0; i < KEYPAD_SIZE; i++) {
-            if (vm->keypad[i]) {
-                vm->PC -= 2;
-                return;
+        if (data[i] == (base ? base[i] : 0)) {
+            i++;
+            continue;
+        }
+
+        // Runs of less than 4 unchanged bytes cost less than a new chunk,
+        // which can't be longer than its 2-byte length allows
+        int start = i, end = i + 1, same = 0;
+        for (i++; i < size && same < 4 && i - start < 0xFFFF; i++) {
+            if (data[i] == (base ? base[i] : 0)) {
+                same++;
+            } else {
+                same = 0;
+                end = i + 1;
             }
         }
-        vm->wait_for_key = 0;
-        break;
+
+        w->out = put16(w->out, pos + start - w->last);
+        w->out = put16(w->out, end - start);
+        memcpy_(w->out, &data[start], end - start);
+        w->out += end - start;
+        w->last = pos + end;
+        i = end;
     }
 }
 
-static int
-decode_and_execute(Chip8 *vm)
+// Ends the diff with an empty chunk, returns the end of the output
+static uint8_t *
+diff_end(DiffWriter *w)
 {
-    // Decode
-    uint8_t x = (vm->opcode & 0x0F00) >> 8;
-    uint8_t y = (vm->opcode & 0x00F0) >> 4;
-    uint8_t n = vm->opcode & 0x000F;
-    uint8_t kk = vm->opcode & 0x00FF;
-    uint16_t nnn = vm->opcode & 0x0FFF;
+    w->out = put16(w->out, 0);
+    return put16(w->out, 0);
+}
 
-    // Execute
-    switch (vm->opcode & 0xF000) {
-    case 0x0000:
-        if ((vm->opcode & 0xFFF0) == 0x00C0) {
-            // SCD nibble (00Cn) - S-CHIP
-            op_00Cn(vm, n);
-            vm->screen_updated = true;
-        } else if (vm->opcode == 0x00E0) {
-            // CLS (00E0)
-            memset_(vm->screen, 0, SCREEN_SIZE);
-            vm->screen_updated = true;
-        } else if (vm->opcode == 0x00EE) {
-            // RET (00EE)
-            ASSERT(vm->SP > 0);
-            vm->PC = vm->stack[vm->SP--];
-        } else if (vm->opcode == 0x00FB) {
-            // SCR (00FB) - S-CHIP
-            op_00FB(vm);
-            vm->screen_updated = true;
-        } else if (vm->opcode == 0x00FC) {
-            // SCL (00FC) - S-CHIP
-            op_00FC(vm);
-            vm->screen_updated = true;
-        } else if (vm->opcode == 0x00FD) {
-            // EXIT (00FD) - S-CHIP
-            // Subsequent calls will encounter 00FD again,
-            // and c8_ended() will return true
-            vm->PC -= 2;
-        } else if (vm->opcode == 0x00FE) {
-            // LOW (00FE) - S-CHIP
-            if (vm->hi_res) vm->screen_updated = true;
-            vm->hi_res = false;
-        } else if (vm->opcode == 0x00FF) {
-            // HIGH (00FF) - S-CHIP
-            if (!vm->hi_res) vm->screen_updated = true;
-            vm->hi_res = true;
-        } else {
-            // SYS addr (0nnn) - Not implemented
-        }
-        break;
+// Same as diff_range() for a whole diff, which needs at most 2 * size + 4
+// bytes
+static uint8_t *
+encode_diff(uint8_t *out, const uint8_t *data, const uint8_t *base, int size)
+{
+    DiffWriter w = {out, 0};
+    diff_range(&w, 0, data, base, size);
+    return diff_end(&w);
+}
 
-    case 0x1000:
-        // JP addr (1nnn)
-        vm->PC = nnn;
-        break;
+// Applies chunks stored by encode_diff() to data, which holds the base, or
+// only checks them if data is NULL.
+// Returns the end of the chunks, NULL if they are corrupt.
+static const uint8_t *
+decode_diff(const uint8_t *in, const uint8_t *end, uint8_t *data, int size)
+{
+    int pos = 0;
+    while (end - in >= 4) {
+        int skip = get16(in);
+        int len = get16(in + 2);
+        in += 4;
+        if (skip == 0 && len == 0) return in;
 
-    case 0x2000:
-        // CALL addr (2nnn)
-        ASSERT(vm->SP < 15);
-        vm->stack[++vm->SP] = vm->PC;
-        vm->PC = nnn;
-        break;
+        pos += skip;
+        if (pos + len > size || end - in < len) return NULL;
+        if (data) memcpy_(&data[pos], in, len);
+        in += len;
+        pos += len;
+    }
+    return NULL;
+}
 
-    case 0x3000:
-        // SE Vx, byte (3xkk)
-        if (vm->V[x] == kk) vm->PC += 2;
-        break;
+// Overwrites RAM[addr, addr + size) with src (zeros if NULL), only dropping
+// the cached code that actually changes, so that runs forked from a state
+// keep their cache warm
+static void
+replace_ram(Chip8 *vm, int addr, const uint8_t *src, int size)
+{
+    // The memory past 4 KB is a separate buffer
+    if (addr < CHIP8_RAM_SIZE && addr + size > CHIP8_RAM_SIZE) {
+        int low = CHIP8_RAM_SIZE - addr;
+        replace_ram(vm, addr, src, low);
+        replace_ram(vm, CHIP8_RAM_SIZE, src ? src + low : NULL, size - low);
+        return;
+    }
 
-    case 0x4000:
-        // SNE Vx, byte (4xkk)
-        if (vm->V[x] != kk) vm->PC += 2;
-        break;
+    uint8_t *ram = ram_at(vm, addr);
+    for (int i = 0; i < size;) {
+        if (i + 8 <= size && load64(&ram[i]) == (src ? load64(&src[i]) : 0)) {
+            i += 8;
+            continue;
+        }
+        int start = i;
+        while (i < size && ram[i] != (src ? src[i] : 0))
+            i++;
+        if (i > start)
+            invalidate_code(vm, addr + start, i - start);
+        else
+            i++;
+    }
+    if (src)
+        memcpy_(ram, src, size);
+    else
+        memset_(ram, 0, size);
+}
 
-    case 0x5000:
-        // SE Vx, Vy (5xy0)
-        if (vm->V[x] == vm->V[y]) vm->PC += 2;
-        break;
+// Overwrites RAM[start, end) with the RAM right after c8_load_rom()
+static void
+restore_image(Chip8 *vm, int start, int end)
+{
+    Region image[IMAGE_REGIONS];
+    rom_image(vm, image);
+    for (int r = 0; r < IMAGE_REGIONS; r++) {
+        int lo = image[r].start > start ? image[r].start : start;
+        int hi = image[r].start + image[r].size;
+        if (hi > end) hi = end;
+        if (lo >= hi) continue;
 
-    case 0x6000:
-        // LD Vx, byte (6xkk)
-        vm->V[x] = kk;
-        break;
+        const uint8_t *data = image[r].data;
+        replace_ram(vm, lo, data ? &data[lo - image[r].start] : NULL,
+                    hi - lo);
+    }
+}
 
-    case 0x7000:
-        // ADD Vx, byte (7xkk)
-        vm->V[x] += kk;
-        break;
+// Applies the RAM diff of a save state, checked by decode_diff(), on top of
+// the RAM right after c8_load_rom()
+static void
+restore_ram(Chip8 *vm, const uint8_t *in)
+{
+    int pos = 0;
+    for (;;) {
+        int skip = get16(in);
+        int len = get16(in + 2);
+        in += 4;
+        if (skip == 0 && len == 0) break;
 
-    case 0x8000:
-        switch (vm->opcode & 0x000F) {
-        case 0x0000:
-            // LD Vx, Vy (8xy0)
-            vm->V[x] = vm->V[y];
-            break;
+        restore_image(vm, pos, pos + skip);
+        pos += skip;
+        replace_ram(vm, pos, in, len);
+        in += len;
+        pos += len;
+    }
+    restore_image(vm, pos, c8_memory_size(vm));
+}
 
-        case 0x0001:
-            // OR Vx, Vy (8xy1)
-            vm->V[x] |= vm->V[y];
-            break;
+int
+c8_save_state(Chip8 *vm, uint8_t *buf, int size)
+{
+    if (size < C8_STATE_MAX_SIZE) return -1;
 
-        case 0x0002:
-            // AND Vx, Vy (8xy2)
-            vm->V[x] &= vm->V[y];
-            break;
+    uint8_t *p = buf;
+    *p++ = 'C';
+    *p++ = '8';
+    *p++ = 'S';
+    *p++ = C8_STATE_VERSION;
+    *p++ = vm->platform | vm->hi_res << 2 | vm->wait_for_key << 3;
+    *p++ = vm->SP;
+    *p++ = vm->DT;
+    *p++ = vm->ST;
+    p = put16(p, vm->PC);
+    p = put16(p, vm->I);
+    p = put16(p, vm->opcode);
 
-        case 0x0003:
-            // XOR Vx, Vy (8xy3)
-            vm->V[x] ^= vm->V[y];
-            break;
+    uint16_t keys = 0;
+    for (int i = 0; i < KEYPAD_SIZE; i++)
+        keys |= (vm->keypad[i] != 0) << i;
+    p = put16(p, keys);
 
-        case 0x0004: {
-            // ADD Vx, Vy (8xy4)
-            bool carry = (vm->V[x] + vm->V[y]) > 255;
-            vm->V[x] += vm->V[y];
-            vm->V[0xF] = carry;
-            break;
-        }
+    uint32_t ipf = vm->IPF, rom_hash = vm->rom_hash;
+    for (int i = 0; i < 4; i++)
+        *p++ = ipf >> (8 * i);
+    for (int i = 0; i < 4; i++)
+        *p++ = rom_hash >> (8 * i);
+    for (int i = 0; i < 8; i++)
+        *p++ = vm->rng >> (8 * i);
 
-        case 0x0005: {
-            // SUB Vx, Vy (8xy5)
-            bool not_borrow = vm->V[x] > vm->V[y];
-            vm->V[x] -= vm->V[y];
-            vm->V[0xF] = not_borrow;
-            break;
-        }
+    memcpy_(p, vm->V, 16);
+    p += 16;
+    memcpy_(p, vm->hp48_flags, 8);
+    p += 8;
+    for (int i = 0; i < 16; i++)
+        p = put16(p, vm->stack[i]);
+    *p++ = vm->quirks;
 
-        case 0x0006: {
-            // SHR Vx {, Vy} (8xy6) - Ambiguous instruction
-            if (vm->platform == P_CHIP8) vm->V[x] = vm->V[y];
-            uint8_t vf = vm->V[x] & 0x01;
-            vm->V[x] >>= 1;
-            vm->V[0xF] = vf;
-            break;
-        }
+    // Added by version 3 (XO-CHIP)
+    *p++ = vm->planes;
+    *p++ = vm->has_pattern;
+    *p++ = vm->pitch;
+    memcpy_(p, vm->pattern, 16);
+    p += 16;
+    memcpy_(p, vm->hp48_flags + 8, 8);
+    p += 8;
 
-        case 0x0007: {
-            // SUBN Vx, Vy (8xy7)
-            bool not_borrow = vm->V[y] > vm->V[x];
-            vm->V[x] = vm->V[y] - vm->V[x];
-            vm->V[0xF] = not_borrow;
-            break;
-        }
+    // Only the memory in use, region by region of the image
+    Region image[IMAGE_REGIONS];
+    rom_image(vm, image);
+    DiffWriter w = {p, 0};
+    for (int r = 0; r < IMAGE_REGIONS; r++)
+        diff_range(&w, image[r].start, ram_at(vm, image[r].start),
+                   image[r].data, image[r].size);
+    p = diff_end(&w);
 
-        case 0x000E: {
-            // SHL Vx {, Vy} (8xyE) - Ambiguous instruction
-            if (vm->platform == P_CHIP8) vm->V[x] = vm->V[y];
-            uint8_t vf = vm->V[x] >> 7;
-            vm->V[x] <<= 1;
-            vm->V[0xF] = vf;
-            break;
-        }
+    // One diff per plane, the second one is usually empty
+    uint8_t screen[SCREEN_SIZE];
+    for (int plane = 0; plane < C8_PLANES; plane++) {
+        screen_to_bytes(vm, plane, screen);
+        p = encode_diff(p, screen, NULL, SCREEN_SIZE);
+    }
 
-        default:
+    return (int) (p - buf);
+}
+
+int
+c8_load_state(Chip8 *vm, const uint8_t *buf, int size)
+{
+    const uint8_t *p = buf, *end = buf + size;
+    if (size < C8_STATE_HEADER_SIZE || p[0] != 'C' || p[1] != '8' ||
+        p[2] != 'S' || p[3] != C8_STATE_VERSION)
+        return -1;
+
+    uint32_t ipf = 0, rom_hash = 0;
+    for (int i = 0; i < 4; i++) {
+        ipf |= (uint32_t) p[16 + i] << (8 * i);
+        rom_hash |= (uint32_t) p[20 + i] << (8 * i);
+    }
+    // Flags: platform, hi-res, then wait_for_key (0-2), nothing above
+    if (rom_hash != vm->rom_hash || (p[4] & 3) > P_XOCHIP ||
+        ((p[4] >> 3) & 3) > 2 || p[4] >> 5 != 0 || p[89] >> C8_PLANES != 0)
+        return -1;
+    if (p[5] > 15 || (int32_t) ipf <= 0) return -1;
+
+    // Check the diffs first, so that vm is untouched if the state is corrupt.
+    // The planes are small enough to decode into a copy.
+    uint8_t screen[C8_PLANES][SCREEN_SIZE];
+    memset_(screen, 0, sizeof(screen));
+    const uint8_t *ram = p + C8_STATE_HEADER_SIZE;
+    const uint8_t *q = decode_diff(ram, end, NULL, ram_mask(p[88]) + 1);
+    for (int plane = 0; plane < C8_PLANES && q; plane++)
+        q = decode_diff(q, end, screen[plane], SCREEN_SIZE);
+    if (!q) return -1;
+
+    if ((p[88] & C8_QUIRK_XO) && !vm->xo_ram) return -1;
+
+    if (vm->quirks != p[88]) c8_set_quirks(vm, p[88]);
+    restore_ram(vm, ram);
+    for (int plane = 0; plane < C8_PLANES; plane++)
+        screen_from_bytes(vm, plane, screen[plane]);
+
+    vm->platform = p[4] & 3;
+    vm->hi_res = (p[4] >> 2) & 1;
+    vm->wait_for_key = (p[4] >> 3) & 3;
+    vm->SP = p[5];
+    vm->DT = p[6];
+    vm->ST = p[7];
+    vm->PC = get16(p + 8);
+    vm->I = get16(p + 10);
+    vm->opcode = get16(p + 12);
+    for (int i = 0; i < KEYPAD_SIZE; i++)
+        vm->keypad[i] = (get16(p + 14) >> i) & 1;
+    vm->IPF = (int) ipf;
+    vm->rng = 0;
+    for (int i = 0; i < 8; i++)
+        vm->rng |= (uint64_t) p[24 + i] << (8 * i);
+    memcpy_(vm->V, p + 32, 16);
+    memcpy_(vm->hp48_flags, p + 48, 8);
+    for (int i = 0; i < 16; i++)
+        vm->stack[i] = get16(p + 56 + 2 * i);
+    vm->planes = p[89];
+    vm->has_pattern = p[90] & 1;
+    vm->pitch = p[91];
+    memcpy_(vm->pattern, p + 92, 16);
+    memcpy_(vm->hp48_flags + 8, p + 108, 8);
+    settle_lo_res(vm);
+
+    vm->screen_updated = true;
+    vm->dirty_rows = ALL_ROWS;
+    return 0;
+}
+
+// No. planes in use, only XO-CHIP draws on the second one
+static int
+planes_in_use(Chip8 *vm)
+{
+    return (vm->quirks & C8_QUIRK_XO) ? C8_PLANES : 1;
+}
+
+// Size of a snapshot of the memory and planes in use
+static uint32_t
+snapshot_size(Chip8 *vm)
+{
+    return c8_memory_size(vm) + planes_in_use(vm) * SCREEN_SIZE + 112;
+}
+
+// Copies everything that rewinding restores: the keypad and the settings
+// (IPF, platform) belong to the host, and aren't part of a snapshot
+static void
+take_snapshot(Chip8 *vm, uint8_t *s)
+{
+    memcpy_(s, vm->RAM, below_xo(c8_memory_size(vm)));
+    if (c8_memory_size(vm) > CHIP8_RAM_SIZE)
+        memcpy_(s + CHIP8_RAM_SIZE, vm->xo_ram, XO_RAM_SIZE);
+    s += c8_memory_size(vm);
+    for (int plane = 0; plane < planes_in_use(vm); plane++) {
+        uint64_t screen[SCREEN_HEIGHT][2];
+        c8_export_plane(vm, plane, screen);
+        memcpy_(s, screen, SCREEN_SIZE);
+        s += SCREEN_SIZE;
+    }
+    memcpy_(s, vm->V, 16);
+    s += 16;
+    memcpy_(s, vm->hp48_flags, 16);
+    s += 16;
+    memcpy_(s, vm->pattern, 16);
+    s += 16;
+    memcpy_(s, vm->stack, sizeof(vm->stack));
+    s += sizeof(vm->stack);
+    memcpy_(s, &vm->rng, 8);
+    s += 8;
+    memcpy_(s, &vm->I, 2);
+    memcpy_(s + 2, &vm->PC, 2);
+    memcpy_(s + 4, &vm->opcode, 2);
+    s[6] = vm->SP;
+    s[7] = vm->DT;
+    s[8] = vm->ST;
+    s[9] = vm->wait_for_key;
+    s[10] = vm->hi_res;
+    s[11] = vm->planes;
+    s[12] = vm->has_pattern;
+    s[13] = vm->pitch;
+}
+
+static void
+restore_snapshot(Chip8 *vm, const uint8_t *s)
+{
+    replace_ram(vm, 0, s, c8_memory_size(vm));
+    s += c8_memory_size(vm);
+    memset_(vm->screen, 0, sizeof(vm->screen));
+    memcpy_(vm->screen, s, planes_in_use(vm) * SCREEN_SIZE);
+    s += planes_in_use(vm) * SCREEN_SIZE;
+    memcpy_(vm->V, s, 16);
+    s += 16;
+    memcpy_(vm->hp48_flags, s, 16);
+    s += 16;
+    memcpy_(vm->pattern, s, 16);
+    s += 16;
+    memcpy_(vm->stack, s, sizeof(vm->stack));
+    s += sizeof(vm->stack);
+    memcpy_(&vm->rng, s, 8);
+    s += 8;
+    memcpy_(&vm->I, s, 2);
+    memcpy_(&vm->PC, s + 2, 2);
+    memcpy_(&vm->opcode, s + 4, 2);
+    vm->SP = s[6];
+    vm->DT = s[7];
+    vm->ST = s[8];
+    vm->wait_for_key = s[9];
+    vm->hi_res = s[10];
+    vm->planes = s[11];
+    vm->has_pattern = s[12];
+    vm->pitch = s[13];
+    settle_lo_res(vm);
+
+    vm->screen_updated = true;
+    vm->dirty_rows = ALL_ROWS;
+}
+
+static uint8_t *
+put_varint(uint8_t *p, uint32_t v)
+{
+    for (; v >= 0x80; v >>= 7)
+        *p++ = (v & 0x7F) | 0x80;
+    *p++ = v;
+    return p;
+}
+
+static const uint8_t *
+get_varint(const uint8_t *p, uint32_t *v)
+{
+    *v = 0;
+    for (int shift = 0;; shift += 7) {
+        *v |= (uint32_t) (*p & 0x7F) << shift;
+        if (!(*p++ & 0x80)) return p;
+    }
+}
+
+// Run-length encodes data XOR base (or data alone if base is NULL) as
+// [no. zero bytes][no. literal bytes][literal bytes], repeated.
+// Returns the size of the output.
+static uint32_t
+encode_xor_rle(uint8_t *out, const uint8_t *data, const uint8_t *base,
+               int size)
+{
+    uint8_t *p = out;
+    int i = 0, last = 0;  // Current byte, end of the previous literals
+
+    while (i < size) {
+        // Skip unchanged bytes, 8 at a time when possible
+        if (i + 8 <= size &&
+            load64(&data[i]) == (base ? load64(&base[i]) : 0)) {
+            i += 8;
+            continue;
+        }
+        if (data[i] == (base ? base[i] : 0)) {
+            i++;
+            continue;
+        }
+
+        // Literals extend over runs of less than 3 unchanged bytes
+        int start = i, end = i + 1;
+        for (i++; i < size && i - end < 3; i++)
+            if (data[i] != (base ? base[i] : 0)) end = i + 1;
+
+        p = put_varint(p, start - last);
+        p = put_varint(p, end - start);
+        for (int j = start; j < end; j++)
+            *p++ = data[j] ^ (base ? base[j] : 0);
+        last = i = end;
+    }
+
+    return (uint32_t) (p - out);
+}
+
+// XORs the output of encode_xor_rle() into data
+static void
+apply_xor_rle(uint8_t *data, const uint8_t *in, uint32_t len)
+{
+    const uint8_t *end = in + len;
+    while (in < end) {
+        uint32_t zeros, literals;
+        in = get_varint(in, &zeros);
+        in = get_varint(in, &literals);
+        data += zeros;
+        for (uint32_t i = 0; i < literals; i++)
+            *data++ ^= *in++;
+    }
+}
+
+static uint32_t
+ring_pos(C8Rewind *rw, int64_t pos)
+{
+    pos %= rw->size;
+    return (uint32_t) (pos < 0 ? pos + rw->size : pos);
+}
+
+static void
+ring_write(C8Rewind *rw, uint32_t pos, const void *src, uint32_t n)
+{
+    uint32_t first = rw->size - pos < n ? rw->size - pos : n;
+    memcpy_(&rw->buf[pos], src, first);
+    memcpy_(rw->buf, (const uint8_t *) src + first, n - first);
+}
+
+static void
+ring_read(C8Rewind *rw, uint32_t pos, void *dest, uint32_t n)
+{
+    uint32_t first = rw->size - pos < n ? rw->size - pos : n;
+    memcpy_(dest, &rw->buf[pos], first);
+    memcpy_((uint8_t *) dest + first, rw->buf, n - first);
+}
+
+// Frames are stored as [header][encoded frame][header], where the header
+// holds the size of the encoded frame and, in bit 31, whether it's a
+// keyframe. The copy at the end lets the ring be walked backwards.
+#define KEYFRAME 0x80000000
+
+static uint32_t
+frame_header(C8Rewind *rw, uint32_t pos)
+{
+    uint32_t header;
+    ring_read(rw, pos, &header, sizeof(header));
+    return header;
+}
+
+// Drops the oldest keyframe and the frames that depend on it
+static void
+drop_oldest(C8Rewind *rw)
+{
+    do {
+        uint32_t header = frame_header(rw, rw->tail);
+        uint32_t size = (header & ~KEYFRAME) + 8;
+        rw->tail = ring_pos(rw, (int64_t) rw->tail + size);
+        rw->used -= size;
+        rw->frames--;
+        if (header & KEYFRAME) rw->keyframes--;
+    } while (rw->frames > 0 && !(frame_header(rw, rw->tail) & KEYFRAME));
+}
+
+void
+c8_rewind_init(C8Rewind *rw, uint8_t *buf, uint32_t size, int interval)
+{
+    ASSERT(interval > 0);
+    memset_(rw, 0, sizeof(*rw));
+    rw->buf = buf;
+    rw->size = size;
+    rw->interval = interval;
+}
+
+int
+c8_rewind_push(C8Rewind *rw, Chip8 *vm)
+{
+    // Frames of another size can't be XOR-ed together, start over
+    if (snapshot_size(vm) != rw->frame_size) {
+        rw->head = rw->tail = rw->used = 0;
+        rw->frames = rw->keyframes = rw->since_key = 0;
+        rw->frame_size = snapshot_size(vm);
+    }
+
+    uint8_t *cur = rw->snapshot[rw->cur];
+    uint8_t *next = rw->snapshot[!rw->cur];
+    take_snapshot(vm, next);
+
+    bool key = rw->frames == 0 || rw->since_key >= (uint32_t) rw->interval;
+    uint32_t len = encode_xor_rle(rw->scratch, next, key ? NULL : cur,
+                                  rw->frame_size);
+
+    while (rw->size - rw->used < len + 8) {
+        if (rw->frames == 0) return -1;
+
+        // Dropping the frames the new one depends on: store it whole
+        if (!key && rw->frames == rw->since_key) {
+            key = true;
+            len = encode_xor_rle(rw->scratch, next, NULL, rw->frame_size);
+        }
+        drop_oldest(rw);
+    }
+
+    uint32_t header = len | (key ? KEYFRAME : 0);
+    ring_write(rw, rw->head, &header, 4);
+    ring_write(rw, ring_pos(rw, (int64_t) rw->head + 4), rw->scratch, len);
+    ring_write(rw, ring_pos(rw, (int64_t) rw->head + 4 + len), &header, 4);
+    rw->head = ring_pos(rw, (int64_t) rw->head + len + 8);
+    rw->used += len + 8;
+
+    rw->frames++;
+    rw->keyframes += key;
+    rw->since_key = key ? 1 : rw->since_key + 1;
+    if (len + 8 > rw->max_frame) rw->max_frame = len + 8;
+    rw->cur = !rw->cur;
+    return 0;
+}
+
+int
+c8_rewind_pop(C8Rewind *rw, Chip8 *vm)
+{
+    if (rw->frames < 2 || snapshot_size(vm) != rw->frame_size) return -1;
+
+    uint8_t *cur = rw->snapshot[rw->cur];
+    uint32_t header = frame_header(rw, ring_pos(rw, (int64_t) rw->head - 4));
+    uint32_t len = header & ~KEYFRAME;
+    uint32_t start = ring_pos(rw, (int64_t) rw->head - len - 8);
+
+    if (!(header & KEYFRAME)) {
+        // XOR-ing a delta again gives the previous frame back
+        ring_read(rw, ring_pos(rw, (int64_t) start + 4), rw->scratch, len);
+        apply_xor_rle(cur, rw->scratch, len);
+        rw->since_key--;
+    } else {
+        // Decode the previous keyframe, then the deltas after it
+        uint32_t pos = start, n = 0, h;
+        do {
+            h = frame_header(rw, ring_pos(rw, (int64_t) pos - 4));
+            pos = ring_pos(rw, (int64_t) pos - (h & ~KEYFRAME) - 8);
+            n++;
+        } while (!(h & KEYFRAME));
+
+        memset_(cur, 0, rw->frame_size);
+        for (uint32_t i = 0; i < n; i++) {
+            h = frame_header(rw, pos);
+            uint32_t l = h & ~KEYFRAME;
+            ring_read(rw, ring_pos(rw, (int64_t) pos + 4), rw->scratch, l);
+            apply_xor_rle(cur, rw->scratch, l);
+            pos = ring_pos(rw, (int64_t) pos + l + 8);
+        }
+        rw->since_key = n;
+        rw->keyframes--;
+    }
+
+    rw->head = start;
+    rw->used -= len + 8;
+    rw->frames--;
+    restore_snapshot(vm, cur);
+    return 0;
+}
+
+// Run-length encoder with the output format of encode_xor_rle(), fed the
+// XOR of two frames a word at a time so unchanged words cost a compare
+typedef struct {
+    uint8_t *out;       // Next byte of output
+    uint8_t *literals;  // Of the current run
+    uint32_t pos;       // Screen byte of the next word
+    uint32_t last;      // End of the previous run
+    uint32_t start;     // Current run, [start, end), empty if start == end
+    uint32_t end;
+} RleWriter;
+
+static void
+rle_flush(RleWriter *w)
+{
+    if (w->start == w->end) return;
+    w->out = put_varint(w->out, w->start - w->last);
+    w->out = put_varint(w->out, w->end - w->start);
+    memcpy_(w->out, w->literals, w->end - w->start);
+    w->out += w->end - w->start;
+    w->last = w->start = w->end;
+}
+
+// Adds the next 8 bytes, most significant byte first
+static void
+rle_word(RleWriter *w, uint64_t delta)
+{
+    for (int i = 0; delta != 0 && i < 8; i++) {
+        uint8_t byte = delta >> (56 - 8 * i);
+        if (byte == 0) continue;
+
+        // Literals extend over runs of less than 3 unchanged bytes
+        uint32_t at = w->pos + i;
+        if (w->start != w->end && at - w->end >= 3) rle_flush(w);
+        if (w->start == w->end) w->start = w->end = at;
+        for (; w->end < at; w->end++)
+            w->literals[w->end - w->start] = 0;
+        w->literals[w->end++ - w->start] = byte;
+        delta &= ~((uint64_t) 0xFF << (56 - 8 * i));
+    }
+    w->pos += 8;
+}
+
+int
+c8_capture_start(C8Capture *cap, Chip8 *vm, uint8_t *out)
+{
+    memset_(cap, 0, sizeof(*cap));
+    cap->planes = (vm->quirks & C8_QUIRK_XO) ? C8_PLANES : 1;
+
+    const uint8_t header[C8_CAPTURE_HEADER_SIZE] = {
+        'C', '8', 'F', 'C', C8_CAPTURE_VERSION, (uint8_t) cap->planes,
+    };
+    memcpy_(out, header, sizeof(header));
+    return C8_CAPTURE_HEADER_SIZE;
+}
+
+int
+c8_capture_frame(C8Capture *cap, Chip8 *vm, uint8_t *out)
+{
+    RleWriter w = {.out = cap->scratch, .literals = cap->delta};
+
+    // Lo-res planes are compared at 64x32 while they stay lo-res, so only
+    // the rows that changed are scaled up
+    bool lo = lo_plane(vm);
+    for (int p = 0; p < cap->planes; p++) {
+        for (int row = 0; row < SCREEN_HEIGHT; row++) {
+            uint64_t grown[2], *prev = cap->screen[p][row];
+            const uint64_t *line = vm->screen[p][row];
+            if (lo) {
+                uint64_t *pixels = &cap->lo_screen[p][row / 2];
+                if (cap->lo && row % 2 == 0 &&
+                    *pixels == vm->lo_screen[p][row / 2]) {
+                    w.pos += 32;
+                    row++;
+                    continue;
+                }
+                *pixels = vm->lo_screen[p][row / 2];
+                screen_row(vm, p, row, grown);
+                line = grown;
+            }
+            if (line[0] == prev[0] && line[1] == prev[1]) {
+                w.pos += 16;
+                continue;
+            }
+            rle_word(&w, line[0] ^ prev[0]);
+            rle_word(&w, line[1] ^ prev[1]);
+            prev[0] = line[0];
+            prev[1] = line[1];
+        }
+    }
+    cap->lo = lo;
+    rle_flush(&w);
+
+    uint32_t len = (uint32_t) (w.out - cap->scratch);
+    uint8_t *p = put_varint(out, len);
+    memcpy_(p, cap->scratch, len);
+    cap->frames++;
+    return (int) (p - out) + (int) len;
+}
+
+int
+c8_capture_open(C8Capture *cap, const uint8_t *in, int size)
+{
+    if (size < C8_CAPTURE_HEADER_SIZE || in[0] != 'C' || in[1] != '8' ||
+        in[2] != 'F' || in[3] != 'C' || in[4] != C8_CAPTURE_VERSION ||
+        in[5] < 1 || in[5] > C8_PLANES)
+        return -1;
+
+    memset_(cap, 0, sizeof(*cap));
+    cap->planes = in[5];
+    return 0;
+}
+
+// Reads a varint that must end before end. Returns NULL if it doesn't.
+static const uint8_t *
+get_varint_checked(const uint8_t *p, const uint8_t *end, uint32_t *v)
+{
+    *v = 0;
+    for (int shift = 0; p < end && shift < 32; shift += 7) {
+        *v |= (uint32_t) (*p & 0x7F) << shift;
+        if (!(*p++ & 0x80)) return p;
+    }
+    return NULL;
+}
+
+int
+c8_capture_next(C8Capture *cap, const uint8_t *in, int size)
+{
+    uint32_t len;
+    const uint8_t *p = get_varint_checked(in, in + size, &len);
+    if (!p || len > (uint32_t) (in + size - p)) return 0;
+
+    // Same as apply_xor_rle(), checking every run against the screen
+    const uint32_t total = cap->planes * SCREEN_SIZE;
+    const uint8_t *end = p + len;
+    uint32_t pos = 0;
+    memset_(cap->delta, 0, total);
+    while (p < end) {
+        uint32_t zeros, literals;
+        p = get_varint_checked(p, end, &zeros);
+        if (p) p = get_varint_checked(p, end, &literals);
+        if (!p || zeros > total - pos || literals > total - pos - zeros ||
+            literals > (uint32_t) (end - p))
+            return -1;
+        memcpy_(&cap->delta[pos + zeros], p, literals);
+        pos += zeros + literals;
+        p += literals;
+    }
+
+    const uint8_t *bytes = cap->delta;
+    for (int plane = 0; plane < cap->planes; plane++) {
+        for (int row = 0; row < SCREEN_HEIGHT; row++) {
+            uint64_t *line = cap->screen[plane][row];
+            for (int i = 0; i < SCREEN_WIDTH / 8; i++)
+                line[i / 8] ^= (uint64_t) *bytes++ << (56 - 8 * (i % 8));
+        }
+    }
+    cap->frames++;
+    return (int) (end - in);
+}
+
+// Doubles every bit of a byte, used to scale lo-res sprites up to 128x64
+#define D2(n) n, n + 0x0003, n + 0x000C, n + 0x000F
+#define D4(n) D2(n), D2(n + 0x0030), D2(n + 0x00C0), D2(n + 0x00F0)
+#define D6(n) D4(n), D4(n + 0x0300), D4(n + 0x0C00), D4(n + 0x0F00)
+#define D8(n) D6(n), D6(n + 0x3000), D6(n + 0xC000), D6(n + 0xF000)
+static const uint16_t spread[256] = {D8(0)};
+#undef D2
+#undef D4
+#undef D6
+#undef D8
+
+// Inverse of spread[]: keeps every other bit of a 16-bit value,
+// starting from the most significant one
+static uint8_t
+unspread(uint16_t bits)
+{
+    bits = (bits >> 1) & 0x5555;
+    bits = (bits | bits >> 1) & 0x3333;
+    bits = (bits | bits >> 2) & 0x0F0F;
+    bits = (bits | bits >> 4) & 0x00FF;
+    return bits;
+}
+
+// Shifts pixels (left-aligned in a word) right by col, into the two words
+// of a screen row. Pixels past the right edge of the screen are clipped.
+static void
+place(uint64_t pixels, int col, uint64_t out[2])
+{
+    if (col == 0) {
+        out[0] = pixels;
+        out[1] = 0;
+    } else if (col < 64) {
+        out[0] = pixels >> col;
+        out[1] = pixels << (64 - col);
+    } else {
+        out[0] = 0;
+        out[1] = pixels >> (col - 64);
+    }
+}
+
+// Is the screen held in vm->lo_screen? Lo-res screens are kept at 64x32,
+// unless they hold half pixels (left by hi-res mode or by scrolling) that
+// only vm->screen can show.
+static bool
+lo_plane(Chip8 *vm)
+{
+    return !vm->hi_res && !vm->upscaled;
+}
+
+// Each lo-res pixel of a row doubled, into a 128x64 row
+static void
+grow_row(uint64_t pixels, uint64_t out[2])
+{
+    out[0] = out[1] = 0;
+    for (int i = 0; i < 8; i++) {
+        uint64_t wide = spread[(pixels >> (56 - 8 * i)) & 0xFF];
+        out[i / 4] |= wide << (48 - 16 * (i % 4));
+    }
+}
+
+// Inverse of grow_row(): the left pixel of each pair of a 128x64 row
+static uint64_t
+shrink_row(const uint64_t row[2])
+{
+    uint64_t pixels = 0;
+    for (int i = 0; i < 8; i++)
+        pixels |= (uint64_t) unspread(row[i / 4] >> (48 - 16 * (i % 4)))
+                  << (56 - 8 * i);
+    return pixels;
+}
+
+// A row of a plane of the screen at 128x64
+static void
+screen_row(Chip8 *vm, int plane, int row, uint64_t out[2])
+{
+    if (!lo_plane(vm)) {
+        out[0] = vm->screen[plane][row][0];
+        out[1] = vm->screen[plane][row][1];
+        return;
+    }
+    grow_row(vm->lo_screen[plane][row / 2], out);
+}
+
+// Moves the lo-res planes to vm->screen, scaled up to 128x64
+static void
+upscale(Chip8 *vm)
+{
+    if (!lo_plane(vm)) return;
+    for (int p = 0; p < C8_PLANES; p++)
+        for (int row = 0; row < SCREEN_HEIGHT; row++)
+            screen_row(vm, p, row, vm->screen[p][row]);
+    vm->upscaled = true;
+}
+
+// Moves a lo-res screen held in vm->screen to the lo-res planes if it's
+// made of whole 2x2 pixels, so that the next frames draw at 64x32
+static void
+settle_lo_res(Chip8 *vm)
+{
+    vm->upscaled = false;
+    if (vm->hi_res) return;
+
+    uint64_t lo[C8_PLANES][SCREEN_HEIGHT / 2];
+    for (int p = 0; p < C8_PLANES; p++) {
+        for (int row = 0; row < SCREEN_HEIGHT / 2; row++) {
+            const uint64_t *top = vm->screen[p][2 * row];
+            const uint64_t *bottom = vm->screen[p][2 * row + 1];
+            for (int i = 0; i < 2; i++) {
+                // Both pixels of each pair in both rows must be the same
+                uint64_t w = top[i];
+                if (w != bottom[i] || ((w ^ w >> 1) & 0x5555555555555555)) {
+                    vm->upscaled = true;
+                    return;
+                }
+            }
+            lo[p][row] = shrink_row(top);
+        }
+    }
+    memcpy_(vm->lo_screen, lo, sizeof(lo));
+}
+
+// Shifts a sprite row (left-aligned in a word) right by col, into a 64-pixel
+// lo-res row. Pixels past the right edge wrap around to the left edge with
+// the wrap quirk, and are clipped otherwise.
+static uint64_t
+place_lo(uint64_t sprite, int col, bool wrap)
+{
+    uint64_t pixels = sprite >> col;
+    if (wrap && col > 0) pixels |= sprite << (64 - col);
+    return pixels;
+}
+
+// XORs a sprite row (up to 64 pixels wide, left-aligned in a word) into a
+// row of a 128x64 plane at col, returns 1 if a set pixel was cleared
+static int
+blit_row(uint64_t line[2], int col, uint64_t sprite, bool wrap)
+{
+    uint64_t window[2];
+    place(sprite, col, window);
+
+    // Pixels past the right edge, back to the left edge
+    if (wrap && col > 64) window[0] |= sprite << (128 - col);
+
+    uint64_t collision = (line[0] & window[0]) | (line[1] & window[1]);
+    line[0] ^= window[0];
+    line[1] ^= window[1];
+    return collision != 0;
+}
+
+// XORs a sprite row into a row of a plane, in any mode, returns 1 if a set
+// pixel was cleared. The sprite is left-aligned in a word and as wide as the
+// set bits of span.
+static int
+draw_row(Chip8 *vm, int plane, int row, int col, uint64_t sprite,
+         uint64_t span, bool wrap)
+{
+    if (vm->hi_res) {
+        vm->dirty_rows |= (uint64_t) 1 << row;
+        return blit_row(vm->screen[plane][row], col, sprite, wrap);
+    }
+
+    // A lo-res row is a single word
+    uint64_t pixels = place_lo(sprite, col, wrap);
+    vm->dirty_rows |= (uint64_t) 3 << 2 * row;
+    if (!vm->upscaled) {
+        uint64_t *line = &vm->lo_screen[plane][row];
+        int collision = (*line & pixels) != 0;
+        *line ^= pixels;
+        return collision;
+    }
+
+    // Every 2x2 block under the sprite takes the value of its top-left
+    // pixel XOR the sprite pixel, so that it stays a single lo-res pixel
+    uint64_t *top = vm->screen[plane][2 * row];
+    uint64_t *bottom = vm->screen[plane][2 * row + 1];
+    uint64_t lo = shrink_row(top);
+    uint64_t under = place_lo(span, col, wrap);
+
+    // Scale 64x32 up to 128x64
+    uint64_t value[2], mask[2];
+    grow_row((lo ^ pixels) & under, value);
+    grow_row(under, mask);
+    for (int i = 0; i < 2; i++) {
+        top[i] = (top[i] & ~mask[i]) | value[i];
+        bottom[i] = (bottom[i] & ~mask[i]) | value[i];
+    }
+    return (lo & pixels) != 0;
+}
+
+// Draws the sprite of op_Dxyn(), n rows of 8 pixels or 16x16 if big
+static void
+draw_sprite(Chip8 *vm, uint8_t x, uint8_t y, uint8_t n, bool big, bool wrap)
+{
+    PROFILE_START(vm);
+    vm->V[0xF] = 0;
+    int screen_width = vm->hi_res ? 128 : 64;
+    int screen_height = vm->hi_res ? 64 : 32;
+
+    // Top-left coordinate of the sprite (origin)
+    int xo = vm->V[x] % screen_width;   // X origin (column)
+    int yo = vm->V[y] % screen_height;  // Y origin (row)
+
+    int height = big ? 16 : n;
+    int width = big ? 16 : 8;
+    uint64_t span = ~(uint64_t) 0 << (64 - width);
+    uint16_t addr = vm->I;
+    unsigned mask = ram_mask(vm->quirks);
+
+    for (int p = 0; p < C8_PLANES; p++) {
+        if (!(vm->planes >> p & 1)) continue;
+
+        // Draw the sprite a whole row at a time
+        for (int row = 0; row < height; row++) {
+            int yr = yo + row;
+            if (yr >= screen_height) {
+                if (!wrap) break;
+                yr -= screen_height;
+            }
+
+            // Addresses past the end of the memory in use wrap around
+            uint64_t sprite = *ram_at(vm, (addr + row * width / 8) & mask);
+            if (big)
+                sprite = sprite << 8 | *ram_at(vm, (addr + 2 * row + 1) & mask);
+            sprite <<= 64 - width;
+            vm->V[0xF] |= draw_row(vm, p, yr, xo, sprite, span, wrap);
+        }
+        addr += height * width / 8;
+    }
+    PROFILE_STOP(vm, big ? C8_TIME_DXY0 : C8_TIME_DXYN);
+}
+
+// Display n-byte sprite starting at memory location I at (Vx, Vy),
+// set VF = collision. If n=0 in hi-res mode (or in any mode on XO-CHIP),
+// show a 16x16 sprite (S-CHIP).
+// The sprite is drawn on each selected plane (XO-CHIP), the data for the
+// second plane following the data for the first one.
+static ALWAYS_INLINE void
+op_Dxyn(Chip8 *vm, uint8_t x, uint8_t y, uint8_t n, unsigned quirks)
+{
+    bool big = n == 0 && (vm->hi_res || (quirks & C8_QUIRK_XO));
+    draw_sprite(vm, x, y, n, big, quirks & C8_QUIRK_WRAP);
+}
+
+// Moves the rows of a plane dy rows down (up if negative), clearing the rows
+// left behind. A row is words long.
+static void
+shift_rows(uint64_t *plane, int height, int words, int dy)
+{
+    if (dy >= 0) {
+        for (int row = height - 1; row >= dy; row--)
+            for (int i = 0; i < words; i++)
+                plane[row * words + i] = plane[(row - dy) * words + i];
+        memset_(plane, 0, dy * words * sizeof(*plane));
+    } else {
+        dy = -dy;
+        for (int row = 0; row < height - dy; row++)
+            for (int i = 0; i < words; i++)
+                plane[row * words + i] = plane[(row + dy) * words + i];
+        memset_(&plane[(height - dy) * words], 0, dy * words * sizeof(*plane));
+    }
+}
+
+// Scrolls the selected planes dy lines down (up if negative), by whole
+// pixels of the current mode on XO-CHIP (see op_00Cn())
+static void
+scroll_vertical(Chip8 *vm, int dy, bool xo)
+{
+    PROFILE_START(vm);
+    if (lo_plane(vm) && (xo || dy % 2 == 0)) {
+        for (int p = 0; p < C8_PLANES; p++)
+            if (vm->planes >> p & 1)
+                shift_rows(vm->lo_screen[p], SCREEN_HEIGHT / 2, 1,
+                           xo ? dy : dy / 2);
+    } else {
+        upscale(vm);
+        for (int p = 0; p < C8_PLANES; p++)
+            if (vm->planes >> p & 1)
+                shift_rows(vm->screen[p][0], SCREEN_HEIGHT, 2,
+                           xo && !vm->hi_res ? 2 * dy : dy);
+    }
+    vm->dirty_rows = ALL_ROWS;
+    PROFILE_STOP(vm, C8_TIME_SCROLL);
+}
+
+// Scroll display n lines down (S-CHIP)
+// Scrolling works on the 128x64 screen in both modes, so in lo-res mode
+// the display moves by half pixels like on S-CHIP 1.1. Only even values
+// of n can scroll the lo-res plane. XO-CHIP scrolls by whole pixels of the
+// current mode instead.
+static ALWAYS_INLINE void
+op_00Cn(Chip8 *vm, uint8_t n, unsigned quirks)
+{
+    scroll_vertical(vm, n, quirks & C8_QUIRK_XO);
+}
+
+// Scroll display n lines up (XO-CHIP), same as op_00Cn() otherwise
+static ALWAYS_INLINE void
+op_00Dn(Chip8 *vm, uint8_t n, unsigned quirks)
+{
+    scroll_vertical(vm, -n, quirks & C8_QUIRK_XO);
+}
+
+#ifdef __SSE2__
+
+// Scrolls a 128x64 plane 4 pixels right
+static void
+scroll_right(uint64_t plane[SCREEN_HEIGHT][2])
+{
+    // A row fits in one register: the left word in the low lane
+    for (int row = 0; row < SCREEN_HEIGHT; row++) {
+        __m128i *line = (__m128i *) plane[row];
+        __m128i pixels = _mm_loadu_si128(line);
+        __m128i carry = _mm_slli_si128(_mm_slli_epi64(pixels, 60), 8);
+        _mm_storeu_si128(line, _mm_or_si128(_mm_srli_epi64(pixels, 4), carry));
+    }
+}
+
+// Scrolls a 128x64 plane 4 pixels left
+static void
+scroll_left(uint64_t plane[SCREEN_HEIGHT][2])
+{
+    for (int row = 0; row < SCREEN_HEIGHT; row++) {
+        __m128i *line = (__m128i *) plane[row];
+        __m128i pixels = _mm_loadu_si128(line);
+        __m128i carry = _mm_srli_si128(_mm_srli_epi64(pixels, 60), 8);
+        _mm_storeu_si128(line, _mm_or_si128(_mm_slli_epi64(pixels, 4), carry));
+    }
+}
+
+#else
+
+// Scrolls a 128x64 plane 4 pixels right
+static void
+scroll_right(uint64_t plane[SCREEN_HEIGHT][2])
+{
+    for (int row = 0; row < SCREEN_HEIGHT; row++) {
+        uint64_t *line = plane[row];
+        line[1] = line[1] >> 4 | line[0] << 60;
+        line[0] >>= 4;
+    }
+}
+
+// Scrolls a 128x64 plane 4 pixels left
+static void
+scroll_left(uint64_t plane[SCREEN_HEIGHT][2])
+{
+    for (int row = 0; row < SCREEN_HEIGHT; row++) {
+        uint64_t *line = plane[row];
+        line[0] = line[0] << 4 | line[1] >> 60;
+        line[1] <<= 4;
+    }
+}
+
+#endif
+
+// Scrolls the selected planes 4 pixels, right or left. Like op_00Cn(), that's
+// 4 pixels of the 128x64 screen in both modes, except on XO-CHIP (xo).
+static void
+scroll_horizontal(Chip8 *vm, bool right, bool xo)
+{
+    PROFILE_START(vm);
+    for (int p = 0; p < C8_PLANES; p++) {
+        if (!(vm->planes >> p & 1)) continue;
+        if (lo_plane(vm)) {
+            int n = xo ? 4 : 2;
+            for (int row = 0; row < SCREEN_HEIGHT / 2; row++) {
+                uint64_t *line = &vm->lo_screen[p][row];
+                *line = right ? *line >> n : *line << n;
+            }
+            continue;
+        }
+
+        // XO-CHIP's lo-res pixels are 2 pixels wide here
+        for (int i = 0; i < (xo && !vm->hi_res ? 2 : 1); i++) {
+            if (right)
+                scroll_right(vm->screen[p]);
+            else
+                scroll_left(vm->screen[p]);
+        }
+    }
+    vm->dirty_rows = ALL_ROWS;
+    PROFILE_STOP(vm, C8_TIME_SCROLL);
+}
+
+// Scroll display 4 pixels right (S-CHIP)
+static ALWAYS_INLINE void
+op_00FB(Chip8 *vm, unsigned quirks)
+{
+    scroll_horizontal(vm, true, quirks & C8_QUIRK_XO);
+}
+
+// Scroll display 4 pixels left (S-CHIP)
+static ALWAYS_INLINE void
+op_00FC(Chip8 *vm, unsigned quirks)
+{
+    scroll_horizontal(vm, false, quirks & C8_QUIRK_XO);
+}
+
+// Is the instruction at addr F000 nnnn, which is 4 bytes long? (XO-CHIP)
+static ALWAYS_INLINE bool
+long_instr(Chip8 *vm, unsigned quirks, uint16_t addr)
+{
+    return (quirks & C8_QUIRK_XO) && *ram_at(vm, addr) == 0xF0 &&
+           *ram_at(vm, (uint16_t) (addr + 1)) == 0x00;
+}
+
+// Skips the next instruction, whatever its length
+static ALWAYS_INLINE void
+skip(Chip8 *vm, unsigned quirks)
+{
+    vm->PC += long_instr(vm, quirks, vm->PC) ? 4 : 2;
+}
+
+#define IDLE_MAX_LENGTH 16  // Longest loop checked by idle_loop()
+#define IDLE_BACKOFF 16     // Jumps to a busy loop before checking it again
+
+// Checks if the code at PC, which was just jumped back to, is an idle loop:
+// a run of instructions that only read registers, DT and the keypad, and
+// that comes back to PC with the registers unchanged. DT and the keypad
+// only change between frames, so every iteration until the end of the
+// frame does exactly the same thing.
+// Returns the no. instructions per iteration, 0 if it isn't an idle loop
+// or if idle loops run (see c8_set_idle_skip()).
+static int
+idle_loop(Chip8 *vm)
+{
+    if (vm->run_idle) return 0;
+
+    uint16_t start = vm->PC;
+    if (start == vm->idle_pc && vm->idle_wait > 0) {
+        vm->idle_wait--;
+        return 0;
+    }
+
+    // Same semantics as the op_* functions, on a copy of the registers
+    uint8_t V[16];
+    memcpy_(V, vm->V, sizeof(V));
+    uint16_t I = vm->I;
+    uint16_t pc = start;
+    int size = c8_memory_size(vm);
+
+    for (int len = 1; len <= IDLE_MAX_LENGTH && pc < size - 1; len++) {
+        uint16_t opcode = *ram_at(vm, pc) << 8 | *ram_at(vm, pc + 1);
+        uint8_t x = (opcode & 0x0F00) >> 8;
+        uint8_t y = (opcode & 0x00F0) >> 4;
+        uint8_t kk = opcode & 0x00FF;
+        bool pure = true;
+        pc += 2;
+
+        // Skips go over F000 nnnn whole
+        int skip_size = long_instr(vm, vm->quirks, pc) ? 4 : 2;
+
+        switch (opcode >> 12) {
+        case 0x1:
+            pc = opcode & 0x0FFF;
+            break;
+        case 0x3:
+            if (V[x] == kk) pc += skip_size;
+            break;
+        case 0x4:
+            if (V[x] != kk) pc += skip_size;
+            break;
+        case 0x5:
+            if ((vm->quirks & C8_QUIRK_XO) &&
+                ((opcode & 0xF) == 0x2 || (opcode & 0xF) == 0x3))
+                pure = false;
+            else if (V[x] == V[y])
+                pc += skip_size;
+            break;
+        case 0x6:
+            V[x] = kk;
+            break;
+        case 0x7:
+            V[x] += kk;
+            break;
+        case 0x9:
+            if (V[x] != V[y]) pc += skip_size;
+            break;
+        case 0xA:
+            I = opcode & 0x0FFF;
+            break;
+        case 0xE:
+            if (kk == 0x9E && vm->keypad[V[x]])
+                pc += skip_size;
+            else if (kk == 0xA1 && !vm->keypad[V[x]])
+                pc += skip_size;
+            else if (kk != 0x9E && kk != 0xA1)
+                pure = false;
+            break;
+        case 0xF:
+            if (kk == 0x07)
+                V[x] = vm->DT;
+            else
+                pure = false;
+            break;
+        default:
+            pure = false;
+            break;
+        }
+        if (!pure) break;
+
+        // The iteration must also end with the instruction that just ran,
+        // so that the opcode left in vm is the same after any iteration
+        if (pc == start) {
+            bool same = I == vm->I && opcode == vm->opcode;
+            for (int i = 0; i < 16; i++)
+                same = same && V[i] == vm->V[i];
+            if (same) return len;
+            break;
+        }
+    }
+
+    vm->idle_pc = start;
+    vm->idle_wait = IDLE_BACKOFF;
+    return 0;
+}
+
+// Skips as many whole iterations of an idle loop of len instructions as fit
+// in the left instructions of the frame, these leave the VM as it is.
+// Returns the no. instructions skipped.
+static int
+skip_idle(Chip8 *vm, int len, int left)
+{
+    int skipped = left - left % len;
+    vm->idle = true;
+    vm->skipped += skipped;
+    PROFILE_SKIP(vm, skipped);
+    return skipped;
+}
+
+// Returns true if Fx0A is going to wait the rest of the frame, which is
+// when the keypad doesn't change between two executions
+static bool
+read_key(Chip8 *vm, uint8_t x)
+{
+    // On the original COSMAC VIP, the key was only registered when it was
+    // pressed and then *released*
+    switch (vm->wait_for_key) {
+    case 0:
+        vm->PC -= 2;
+        for (int i = 0; i < KEYPAD_SIZE; i++)
+            if (vm->keypad[i]) return true;
+        vm->wait_for_key = 1;
+        break;
+    case 1:
+        vm->PC -= 2;
+        for (int i = 0; i < KEYPAD_SIZE; i++) {
+            if (vm->keypad[i]) {
+                vm->V[x] = i;
+                vm->wait_for_key = 2;
+                return false;
+            }
+        }
+        return true;
+    case 2:
+        for (int i = 0; i < KEYPAD_SIZE; i++) {
+            if (vm->keypad[i]) {
+                vm->PC -= 2;
+                return true;
+            }
+        }
+        vm->wait_for_key = 0;
+        break;
+    }
+    return false;
+}
+
+// Wait for a key press, store the value of the key in Vx.
+// Returns 1 if it's going to wait the rest of the frame, unless idle loops
+// run (see c8_set_idle_skip()).
+static int
+op_Fx0A(Chip8 *vm, uint8_t x)
+{
+    return (read_key(vm, x) && !vm->run_idle) ? 1 : 0;
+}
+
+// Clear the display (the selected planes on XO-CHIP)
+static void
+op_00E0(Chip8 *vm)
+{
+    for (int p = 0; p < C8_PLANES; p++) {
+        if (!(vm->planes >> p & 1)) continue;
+        memset_(vm->screen[p], 0, sizeof(vm->screen[p]));
+        memset_(vm->lo_screen[p], 0, sizeof(vm->lo_screen[p]));
+    }
+    if (vm->upscaled) settle_lo_res(vm);
+    vm->dirty_rows = ALL_ROWS;
+}
+
+// Clears every plane, when XO-CHIP switches modes
+static void
+clear_planes(Chip8 *vm)
+{
+    memset_(vm->screen, 0, sizeof(vm->screen));
+    memset_(vm->lo_screen, 0, sizeof(vm->lo_screen));
+    vm->upscaled = false;
+}
+
+// Return from a subroutine
+static void
+op_00EE(Chip8 *vm)
+{
+    ASSERT(vm->SP > 0);
+    vm->PC = vm->stack[vm->SP--];
+}
+
+// Exit the interpreter (S-CHIP)
+static void
+op_00FD(Chip8 *vm)
+{
+    // Subsequent calls will encounter 00FD again,
+    // and c8_ended() will return true
+    vm->PC -= 2;
+}
+
+// Disable hi-res mode (S-CHIP), and clear the display on XO-CHIP
+static ALWAYS_INLINE void
+op_00FE(Chip8 *vm, unsigned quirks)
+{
+    if (quirks & C8_QUIRK_XO) {
+        clear_planes(vm);
+        vm->hi_res = false;
+        vm->screen_updated = true;
+        vm->dirty_rows = ALL_ROWS;
+    } else if (vm->hi_res) {
+        vm->screen_updated = true;
+        vm->dirty_rows = ALL_ROWS;
+        vm->hi_res = false;
+        settle_lo_res(vm);
+    }
+}
+
+// Enable hi-res mode (S-CHIP), and clear the display on XO-CHIP
+static ALWAYS_INLINE void
+op_00FF(Chip8 *vm, unsigned quirks)
+{
+    if (quirks & C8_QUIRK_XO) {
+        clear_planes(vm);
+        vm->screen_updated = true;
+        vm->dirty_rows = ALL_ROWS;
+    } else if (!vm->hi_res) {
+        vm->screen_updated = true;
+        vm->dirty_rows = ALL_ROWS;
+        upscale(vm);
+    }
+    vm->hi_res = true;
+}
+
+// Jump to location nnn.
+// Returns the length of the idle loop it closes, if any (see idle_loop()).
+static int
+op_1nnn(Chip8 *vm, uint16_t nnn)
+{
+    bool backwards = nnn < vm->PC;
+    vm->PC = nnn;
+    return backwards ? idle_loop(vm) : 0;
+}
+
+// Call subroutine at nnn
+static void
+op_2nnn(Chip8 *vm, uint16_t nnn)
+{
+    ASSERT(vm->SP < 15);
+    vm->stack[++vm->SP] = vm->PC;
+    vm->PC = nnn;
+}
+
+// Skip next instruction if Vx = kk
+static ALWAYS_INLINE void
+op_3xkk(Chip8 *vm, uint8_t x, uint8_t kk, unsigned quirks)
+{
+    if (vm->V[x] == kk) skip(vm, quirks);
+}
+
+// Skip next instruction if Vx != kk
+static ALWAYS_INLINE void
+op_4xkk(Chip8 *vm, uint8_t x, uint8_t kk, unsigned quirks)
+{
+    if (vm->V[x] != kk) skip(vm, quirks);
+}
+
+// Skip next instruction if Vx = Vy
+static ALWAYS_INLINE void
+op_5xy0(Chip8 *vm, uint8_t x, uint8_t y, unsigned quirks)
+{
+    if (vm->V[x] == vm->V[y]) skip(vm, quirks);
+}
+
+// Store Vx through Vy in memory starting at location I, in reverse order if
+// x > y. I is left unchanged. (XO-CHIP)
+static void
+op_5xy2(Chip8 *vm, uint8_t x, uint8_t y)
+{
+    int n = x < y ? y - x : x - y;
+    int dir = x < y ? 1 : -1;
+    for (int i = 0; i <= n; i++)
+        *ram_at(vm, (uint16_t) (vm->I + i)) = vm->V[x + dir * i];
+    invalidate_code(vm, vm->I, n + 1);
+}
+
+// Read Vx through Vy from memory starting at location I, in reverse order if
+// x > y. I is left unchanged. (XO-CHIP)
+static void
+op_5xy3(Chip8 *vm, uint8_t x, uint8_t y)
+{
+    int n = x < y ? y - x : x - y;
+    int dir = x < y ? 1 : -1;
+    for (int i = 0; i <= n; i++)
+        vm->V[x + dir * i] = *ram_at(vm, (uint16_t) (vm->I + i));
+}
+
+// Set Vx = kk
+static void
+op_6xkk(Chip8 *vm, uint8_t x, uint8_t kk)
+{
+    vm->V[x] = kk;
+}
+
+// Set Vx = Vx + kk
+static void
+op_7xkk(Chip8 *vm, uint8_t x, uint8_t kk)
+{
+    vm->V[x] += kk;
+}
+
+// Set Vx = Vy
+static void
+op_8xy0(Chip8 *vm, uint8_t x, uint8_t y)
+{
+    vm->V[x] = vm->V[y];
+}
+
+// Set Vx = Vx OR Vy (and VF = 0 on the COSMAC VIP)
+static ALWAYS_INLINE void
+op_8xy1(Chip8 *vm, uint8_t x, uint8_t y, unsigned quirks)
+{
+    vm->V[x] |= vm->V[y];
+    if (quirks & C8_QUIRK_VF_RESET) vm->V[0xF] = 0;
+}
+
+// Set Vx = Vx AND Vy (and VF = 0 on the COSMAC VIP)
+static ALWAYS_INLINE void
+op_8xy2(Chip8 *vm, uint8_t x, uint8_t y, unsigned quirks)
+{
+    vm->V[x] &= vm->V[y];
+    if (quirks & C8_QUIRK_VF_RESET) vm->V[0xF] = 0;
+}
+
+// Set Vx = Vx XOR Vy (and VF = 0 on the COSMAC VIP)
+static ALWAYS_INLINE void
+op_8xy3(Chip8 *vm, uint8_t x, uint8_t y, unsigned quirks)
+{
+    vm->V[x] ^= vm->V[y];
+    if (quirks & C8_QUIRK_VF_RESET) vm->V[0xF] = 0;
+}
+
+// Set Vx = Vx + Vy, set VF = carry
+static void
+op_8xy4(Chip8 *vm, uint8_t x, uint8_t y)
+{
+    bool carry = (vm->V[x] + vm->V[y]) > 255;
+    vm->V[x] += vm->V[y];
+    vm->V[0xF] = carry;
+}
+
+// Set Vx = Vx - Vy, set VF = NOT borrow
+static void
+op_8xy5(Chip8 *vm, uint8_t x, uint8_t y)
+{
+    bool not_borrow = vm->V[x] > vm->V[y];
+    vm->V[x] -= vm->V[y];
+    vm->V[0xF] = not_borrow;
+}
+
+// Set Vx = Vy SHR 1 (or Vx SHR 1 on S-CHIP), set VF = shifted out bit
+static ALWAYS_INLINE void
+op_8xy6(Chip8 *vm, uint8_t x, uint8_t y, unsigned quirks)
+{
+    if (!(quirks & C8_QUIRK_SHIFT)) vm->V[x] = vm->V[y];
+    uint8_t vf = vm->V[x] & 0x01;
+    vm->V[x] >>= 1;
+    vm->V[0xF] = vf;
+}
+
+// Set Vx = Vy - Vx, set VF = NOT borrow
+static void
+op_8xy7(Chip8 *vm, uint8_t x, uint8_t y)
+{
+    bool not_borrow = vm->V[y] > vm->V[x];
+    vm->V[x] = vm->V[y] - vm->V[x];
+    vm->V[0xF] = not_borrow;
+}
+
+// Set Vx = Vy SHL 1 (or Vx SHL 1 on S-CHIP), set VF = shifted out bit
+static ALWAYS_INLINE void
+op_8xyE(Chip8 *vm, uint8_t x, uint8_t y, unsigned quirks)
+{
+    if (!(quirks & C8_QUIRK_SHIFT)) vm->V[x] = vm->V[y];
+    uint8_t vf = vm->V[x] >> 7;
+    vm->V[x] <<= 1;
+    vm->V[0xF] = vf;
+}
+
+// Skip next instruction if Vx != Vy
+static ALWAYS_INLINE void
+op_9xy0(Chip8 *vm, uint8_t x, uint8_t y, unsigned quirks)
+{
+    if (vm->V[x] != vm->V[y]) skip(vm, quirks);
+}
+
+// Set I = nnn
+static void
+op_Annn(Chip8 *vm, uint16_t nnn)
+{
+    vm->I = nnn;
+}
+
+// Jump to location nnn + V0 (or xnn + Vx on S-CHIP)
+static ALWAYS_INLINE void
+op_Bnnn(Chip8 *vm, uint8_t x, uint16_t nnn, unsigned quirks)
+{
+    if (quirks & C8_QUIRK_JUMP)
+        vm->PC = vm->V[x] + nnn;
+    else
+        vm->PC = vm->V[0x0] + nnn;
+}
+
+// Set Vx = random byte AND kk
+static void
+op_Cxkk(Chip8 *vm, uint8_t x, uint8_t kk)
+{
+    vm->V[x] = rand_byte(&vm->rng) & kk;
+}
+
+// Skip next instruction if key with the value of Vx is pressed
+static ALWAYS_INLINE void
+op_Ex9E(Chip8 *vm, uint8_t x, unsigned quirks)
+{
+    if (vm->keypad[vm->V[x]]) skip(vm, quirks);
+}
+
+// Skip next instruction if key with the value of Vx is not pressed
+static ALWAYS_INLINE void
+op_ExA1(Chip8 *vm, uint8_t x, unsigned quirks)
+{
+    if (!vm->keypad[vm->V[x]]) skip(vm, quirks);
+}
+
+// Set I = nnnn, the 16-bit address that follows the instruction (XO-CHIP)
+static void
+op_F000(Chip8 *vm)
+{
+    vm->I = *ram_at(vm, vm->PC) << 8 | *ram_at(vm, (uint16_t) (vm->PC + 1));
+    vm->PC += 2;
+}
+
+// Select the planes drawn, scrolled and cleared, one bit each (XO-CHIP)
+static void
+op_Fn01(Chip8 *vm, uint8_t n)
+{
+    vm->planes = n & ((1 << C8_PLANES) - 1);
+}
+
+// Load the 16-byte audio pattern starting at location I (XO-CHIP)
+static void
+op_F002(Chip8 *vm)
+{
+    for (int i = 0; i < 16; i++)
+        vm->pattern[i] = *ram_at(vm, (uint16_t) (vm->I + i));
+    vm->has_pattern = true;
+}
+
+// Set the playback rate of the audio pattern to Vx (XO-CHIP)
+static void
+op_Fx3A(Chip8 *vm, uint8_t x)
+{
+    vm->pitch = vm->V[x];
+}
+
+// Set Vx = delay timer value
+static void
+op_Fx07(Chip8 *vm, uint8_t x)
+{
+    vm->V[x] = vm->DT;
+}
+
+// Set delay timer = Vx
+static void
+op_Fx15(Chip8 *vm, uint8_t x)
+{
+    vm->DT = vm->V[x];
+}
+
+// Set sound timer = Vx
+static void
+op_Fx18(Chip8 *vm, uint8_t x)
+{
+    vm->ST = vm->V[x];
+}
+
+// Set I = I + Vx
+static void
+op_Fx1E(Chip8 *vm, uint8_t x)
+{
+    vm->I += vm->V[x];
+}
+
+// Set I = location of sprite for digit Vx
+static void
+op_Fx29(Chip8 *vm, uint8_t x)
+{
+    // A font sprite is 5 bytes long
+    vm->I = FONT_OFFSET + (vm->V[x] * 5);
+}
+
+// Set I = location of hi-res sprite for digit Vx (S-CHIP)
+static void
+op_Fx30(Chip8 *vm, uint8_t x)
+{
+    // An hi-res font sprite is 10 bytes long
+    vm->I = HFONT_OFFSET + (vm->V[x] * 10);
+}
+
+// Store BCD representation of Vx in memory locations I, I+1, and I+2
+static ALWAYS_INLINE void
+op_Fx33(Chip8 *vm, uint8_t x, unsigned quirks)
+{
+    // Addresses past the end of the memory in use wrap around
+    unsigned mask = ram_mask(quirks);
+    *ram_at(vm, vm->I & mask) = (vm->V[x] / 100) % 10;
+    *ram_at(vm, (vm->I + 1) & mask) = (vm->V[x] / 10) % 10;
+    *ram_at(vm, (vm->I + 2) & mask) = (vm->V[x] / 1) % 10;
+    invalidate_code(vm, vm->I, 3);
+}
+
+// Store registers V0 through Vx in memory starting at location I
+static ALWAYS_INLINE void
+op_Fx55(Chip8 *vm, uint8_t x, unsigned quirks)
+{
+    for (int i = 0; i <= x; i++)
+        *ram_at(vm, (vm->I + i) & ram_mask(quirks)) = vm->V[i];
+    invalidate_code(vm, vm->I, x + 1);
+
+    if (quirks & C8_QUIRK_LOAD_STORE_X)
+        vm->I += x;
+    else if (!(quirks & C8_QUIRK_LOAD_STORE_0))
+        vm->I += (x + 1);
+}
+
+// Read registers V0 through Vx from memory starting at location I
+static ALWAYS_INLINE void
+op_Fx65(Chip8 *vm, uint8_t x, unsigned quirks)
+{
+    for (int i = 0; i <= x; i++)
+        vm->V[i] = *ram_at(vm, (vm->I + i) & ram_mask(quirks));
+
+    if (quirks & C8_QUIRK_LOAD_STORE_X)
+        vm->I += x;
+    else if (!(quirks & C8_QUIRK_LOAD_STORE_0))
+        vm->I += (x + 1);
+}
+
+// Store V0 through Vx in the HP-48 flag registers (S-CHIP, x <= 7 but
+// XO-CHIP has 16 of them)
+static void
+op_Fx75(Chip8 *vm, uint8_t x)
+{
+    memcpy_(vm->hp48_flags, vm->V, x + 1);
+}
+
+// Read V0 through Vx from the HP-48 flag registers (S-CHIP, x <= 7 but
+// XO-CHIP has 16 of them)
+static void
+op_Fx85(Chip8 *vm, uint8_t x)
+{
+    memcpy_(vm->V, vm->hp48_flags, x + 1);
+}
+
+// Dxyn, or Dxy0. Returns 1 if it waits for the next frame.
+static ALWAYS_INLINE int
+draw(Chip8 *vm, uint8_t x, uint8_t y, uint8_t n, unsigned quirks)
+{
+    op_Dxyn(vm, x, y, n, quirks);
+    vm->screen_updated = true;
+    return (quirks & C8_QUIRK_DISPLAY_WAIT) ? 1 : 0;
+}
+
+// Returns -1 on unknown opcodes, or the no. instructions per iteration of the
+// idle loop the instruction closes (see idle_loop()), 0 otherwise. Waiting
+// for the display counts as an idle loop of a single instruction.
+static ALWAYS_INLINE int
+decode_and_execute(Chip8 *vm, unsigned quirks)
+{
+    // Decode
+    uint8_t x = (vm->opcode & 0x0F00) >> 8;
+    uint8_t y = (vm->opcode & 0x00F0) >> 4;
+    uint8_t n = vm->opcode & 0x000F;
+    uint8_t kk = vm->opcode & 0x00FF;
+    uint16_t nnn = vm->opcode & 0x0FFF;
+    PROFILE_OPCODE(vm);
+
+    // Execute
+    switch (vm->opcode & 0xF000) {
+    case 0x0000:
+        if ((vm->opcode & 0xFFF0) == 0x00C0) {
+            // SCD nibble (00Cn) - S-CHIP
+            op_00Cn(vm, n, quirks);
+            vm->screen_updated = true;
+        } else if ((quirks & C8_QUIRK_XO) &&
+                   (vm->opcode & 0xFFF0) == 0x00D0) {
+            // SCU nibble (00Dn) - XO-CHIP
+            op_00Dn(vm, n, quirks);
+            vm->screen_updated = true;
+        } else if (vm->opcode == 0x00E0) {
+            // CLS (00E0)
+            op_00E0(vm);
+            vm->screen_updated = true;
+        } else if (vm->opcode == 0x00EE) {
+            // RET (00EE)
+            op_00EE(vm);
+        } else if (vm->opcode == 0x00FB) {
+            // SCR (00FB) - S-CHIP
+            op_00FB(vm, quirks);
+            vm->screen_updated = true;
+        } else if (vm->opcode == 0x00FC) {
+            // SCL (00FC) - S-CHIP
+            op_00FC(vm, quirks);
+            vm->screen_updated = true;
+        } else if (vm->opcode == 0x00FD) {
+            // EXIT (00FD) - S-CHIP
+            op_00FD(vm);
+        } else if (vm->opcode == 0x00FE) {
+            // LOW (00FE) - S-CHIP
+            op_00FE(vm, quirks);
+        } else if (vm->opcode == 0x00FF) {
+            // HIGH (00FF) - S-CHIP
+            op_00FF(vm, quirks);
+        } else {
+            // SYS addr (0nnn) - Not implemented
+        }
+        break;
+
+    case 0x1000:
+        // JP addr (1nnn)
+        return op_1nnn(vm, nnn);
+
+    case 0x2000:
+        // CALL addr (2nnn)
+        op_2nnn(vm, nnn);
+        break;
+
+    case 0x3000:
+        // SE Vx, byte (3xkk)
+        op_3xkk(vm, x, kk, quirks);
+        break;
+
+    case 0x4000:
+        // SNE Vx, byte (4xkk)
+        op_4xkk(vm, x, kk, quirks);
+        break;
+
+    case 0x5000:
+        if ((quirks & C8_QUIRK_XO) && n == 0x2) {
+            // SAVE Vx - Vy (5xy2) - XO-CHIP
+            op_5xy2(vm, x, y);
+        } else if ((quirks & C8_QUIRK_XO) && n == 0x3) {
+            // LOAD Vx - Vy (5xy3) - XO-CHIP
+            op_5xy3(vm, x, y);
+        } else {
+            // SE Vx, Vy (5xy0)
+            op_5xy0(vm, x, y, quirks);
+        }
+        break;
+
+    case 0x6000:
+        // LD Vx, byte (6xkk)
+        op_6xkk(vm, x, kk);
+        break;
+
+    case 0x7000:
+        // ADD Vx, byte (7xkk)
+        op_7xkk(vm, x, kk);
+        break;
+
+    case 0x8000:
+        switch (vm->opcode & 0x000F) {
+        case 0x0000:
+            // LD Vx, Vy (8xy0)
+            op_8xy0(vm, x, y);
+            break;
+
+        case 0x0001:
+            // OR Vx, Vy (8xy1)
+            op_8xy1(vm, x, y, quirks);
+            break;
+
+        case 0x0002:
+            // AND Vx, Vy (8xy2)
+            op_8xy2(vm, x, y, quirks);
+            break;
+
+        case 0x0003:
+            // XOR Vx, Vy (8xy3)
+            op_8xy3(vm, x, y, quirks);
+            break;
+
+        case 0x0004:
+            // ADD Vx, Vy (8xy4)
+            op_8xy4(vm, x, y);
+            break;
+
+        case 0x0005:
+            // SUB Vx, Vy (8xy5)
+            op_8xy5(vm, x, y);
+            break;
+
+        case 0x0006:
+            // SHR Vx {, Vy} (8xy6) - Ambiguous instruction
+            op_8xy6(vm, x, y, quirks);
+            break;
+
+        case 0x0007:
+            // SUBN Vx, Vy (8xy7)
+            op_8xy7(vm, x, y);
+            break;
+
+        case 0x000E:
+            // SHL Vx {, Vy} (8xyE) - Ambiguous instruction
+            op_8xyE(vm, x, y, quirks);
+            break;
+
+        default:
+            return -1;  // Unknown opcode
+        }
+        break;
+
+    case 0x9000:
+        // SNE Vx, Vy (9xy0)
+        op_9xy0(vm, x, y, quirks);
+        break;
+
+    case 0xA000:
+        // LD I, addr (Annn)
+        op_Annn(vm, nnn);
+        break;
+
+    case 0xB000:
+        // JP V0, addr (Bnnn) - Ambiguous instruction
+        op_Bnnn(vm, x, nnn, quirks);
+        break;
+
+    case 0xC000:
+        // RND Vx, byte (Cxkk)
+        op_Cxkk(vm, x, kk);
+        break;
+
+    case 0xD000:
+        // DRW Vx, Vy, nibble (Dxyn), or 16x16 sprites (Dxy0) - S-CHIP
+        return draw(vm, x, y, n, quirks);
+
+    case 0xE000:
+        switch (vm->opcode & 0x00FF) {
+        case 0x009E:
+            // SKP Vx (Ex9E)
+            op_Ex9E(vm, x, quirks);
+            break;
+
+        case 0x00A1:
+            // SKNP Vx (ExA1)
+            op_ExA1(vm, x, quirks);
+            break;
+
+        default:
+            return -1;  // Unknown opcode
+        }
+        break;
+
+    case 0xF000:
+        switch (vm->opcode & 0x00FF) {
+        case 0x0000:
+            // LD I, long addr (F000 nnnn) - XO-CHIP
+            if (!(quirks & C8_QUIRK_XO) || x != 0) return -1;  // Unknown
+            op_F000(vm);
+            break;
+
+        case 0x0001:
+            // PLANE n (Fn01) - XO-CHIP
+            if (!(quirks & C8_QUIRK_XO)) return -1;  // Unknown opcode
+            op_Fn01(vm, x);
+            break;
+
+        case 0x0002:
+            // AUDIO (F002) - XO-CHIP
+            if (!(quirks & C8_QUIRK_XO) || x != 0) return -1;  // Unknown
+            op_F002(vm);
+            break;
+
+        case 0x0007:
+            // LD Vx, DT (Fx07)
+            op_Fx07(vm, x);
+            break;
+
+        case 0x000A:
+            // LD Vx, K (Fx0A)
+            return op_Fx0A(vm, x);
+
+        case 0x0015:
+            // LD DT, Vx (Fx15)
+            op_Fx15(vm, x);
+            break;
+
+        case 0x0018:
+            // LD ST, Vx (Fx18)
+            op_Fx18(vm, x);
+            break;
+
+        case 0x001E:
+            // ADD I, Vx (Fx1E)
+            op_Fx1E(vm, x);
+            break;
+
+        case 0x0029:
+            // LD F, Vx (Fx29)
+            op_Fx29(vm, x);
+            break;
+
+        case 0x0030:
+            // LD HF, Vx (Fx30) - S-CHIP
+            op_Fx30(vm, x);
+            break;
+
+        case 0x0033:
+            // LD B, Vx (Fx33)
+            op_Fx33(vm, x, quirks);
+            break;
+
+        case 0x003A:
+            // PITCH Vx (Fx3A) - XO-CHIP
+            if (!(quirks & C8_QUIRK_XO)) return -1;  // Unknown opcode
+            op_Fx3A(vm, x);
+            break;
+
+        case 0x0055:
+            // LD [I], Vx (Fx55) - Ambiguous instruction
+            op_Fx55(vm, x, quirks);
+            break;
+
+        case 0x0065:
+            // LD Vx, [I] (Fx65) - Ambiguous instruction
+            op_Fx65(vm, x, quirks);
+            break;
+
+        case 0x0075:
+            // LD R, Vx (Fx75) - S-CHIP
+            op_Fx75(vm, x);
+            break;
+
+        case 0x0085:
+            // LD Vx, R (Fx85) - S-CHIP
+            op_Fx85(vm, x);
+            break;
+
+        default:
             return -1;  // Unknown opcode
         }
         break;
 
-    case 0x9000:
-        // SNE Vx, Vy (9xy0)
-        if (vm->V[x] != vm->V[y]) vm->PC += 2;
+    default:
+        return -1;  // Unknown opcode
+    }
+
+    return 0;
+}
+
+// Predecoded instruction handlers, as identified by decode()
+enum {
+    OP_NONE,  // Not decoded yet (predecoded cache entries only)
+    OP_0nnn,
+    OP_00Cn,
+    OP_00Dn,
+    OP_00E0,
+    OP_00EE,
+    OP_00FB,
+    OP_00FC,
+    OP_00FD,
+    OP_00FE,
+    OP_00FF,
+    OP_1nnn,
+    OP_2nnn,
+    OP_3xkk,
+    OP_4xkk,
+    OP_5xy0,
+    OP_5xy2,
+    OP_5xy3,
+    OP_6xkk,
+    OP_7xkk,
+    OP_8xy0,
+    OP_8xy1,
+    OP_8xy2,
+    OP_8xy3,
+    OP_8xy4,
+    OP_8xy5,
+    OP_8xy6,
+    OP_8xy7,
+    OP_8xyE,
+    OP_9xy0,
+    OP_Annn,
+    OP_Bnnn,
+    OP_Cxkk,
+    OP_Dxyn,
+    OP_Ex9E,
+    OP_ExA1,
+    OP_F000,
+    OP_Fn01,
+    OP_F002,
+    OP_Fx07,
+    OP_Fx0A,
+    OP_Fx15,
+    OP_Fx18,
+    OP_Fx1E,
+    OP_Fx29,
+    OP_Fx30,
+    OP_Fx33,
+    OP_Fx3A,
+    OP_Fx55,
+    OP_Fx65,
+    OP_Fx75,
+    OP_Fx85,
+    OP_UNKNOWN,
+};
+
+// Identify the instruction and extract its operands. The XO-CHIP ones are
+// only recognized with C8_QUIRK_XO.
+static void
+decode(uint16_t opcode, unsigned quirks, C8Instr *in)
+{
+    uint8_t op = OP_UNKNOWN;
+    bool xo = quirks & C8_QUIRK_XO;
+
+    switch (opcode & 0xF000) {
+    case 0x0000:
+        if ((opcode & 0xFFF0) == 0x00C0)
+            op = OP_00Cn;
+        else if (xo && (opcode & 0xFFF0) == 0x00D0)
+            op = OP_00Dn;
+        else if (opcode == 0x00E0)
+            op = OP_00E0;
+        else if (opcode == 0x00EE)
+            op = OP_00EE;
+        else if (opcode == 0x00FB)
+            op = OP_00FB;
+        else if (opcode == 0x00FC)
+            op = OP_00FC;
+        else if (opcode == 0x00FD)
+            op = OP_00FD;
+        else if (opcode == 0x00FE)
+            op = OP_00FE;
+        else if (opcode == 0x00FF)
+            op = OP_00FF;
+        else
+            op = OP_0nnn;
+        break;
+
+    case 0x1000:
+        op = OP_1nnn;
+        break;
+
+    case 0x2000:
+        op = OP_2nnn;
+        break;
+
+    case 0x3000:
+        op = OP_3xkk;
+        break;
+
+    case 0x4000:
+        op = OP_4xkk;
+        break;
+
+    case 0x5000:
+        if (xo && (opcode & 0x000F) == 0x0002)
+            op = OP_5xy2;
+        else if (xo && (opcode & 0x000F) == 0x0003)
+            op = OP_5xy3;
+        else
+            op = OP_5xy0;
+        break;
+
+    case 0x6000:
+        op = OP_6xkk;
+        break;
+
+    case 0x7000:
+        op = OP_7xkk;
+        break;
+
+    case 0x8000:
+        switch (opcode & 0x000F) {
+        case 0x0000:
+            op = OP_8xy0;
+            break;
+
+        case 0x0001:
+            op = OP_8xy1;
+            break;
+
+        case 0x0002:
+            op = OP_8xy2;
+            break;
+
+        case 0x0003:
+            op = OP_8xy3;
+            break;
+
+        case 0x0004:
+            op = OP_8xy4;
+            break;
+
+        case 0x0005:
+            op = OP_8xy5;
+            break;
+
+        case 0x0006:
+            op = OP_8xy6;
+            break;
+
+        case 0x0007:
+            op = OP_8xy7;
+            break;
+
+        case 0x000E:
+            op = OP_8xyE;
+            break;
+        }
+        break;
+
+    case 0x9000:
+        op = OP_9xy0;
+        break;
+
+    case 0xA000:
+        op = OP_Annn;
+        break;
+
+    case 0xB000:
+        op = OP_Bnnn;
+        break;
+
+    case 0xC000:
+        op = OP_Cxkk;
+        break;
+
+    case 0xD000:
+        op = OP_Dxyn;
+        break;
+
+    case 0xE000:
+        switch (opcode & 0x00FF) {
+        case 0x009E:
+            op = OP_Ex9E;
+            break;
+
+        case 0x00A1:
+            op = OP_ExA1;
+            break;
+        }
+        break;
+
+    case 0xF000:
+        switch (opcode & 0x00FF) {
+        case 0x0000:
+            if (xo && opcode == 0xF000) op = OP_F000;
+            break;
+
+        case 0x0001:
+            if (xo) op = OP_Fn01;
+            break;
+
+        case 0x0002:
+            if (xo && opcode == 0xF002) op = OP_F002;
+            break;
+
+        case 0x0007:
+            op = OP_Fx07;
+            break;
+
+        case 0x000A:
+            op = OP_Fx0A;
+            break;
+
+        case 0x0015:
+            op = OP_Fx15;
+            break;
+
+        case 0x0018:
+            op = OP_Fx18;
+            break;
+
+        case 0x001E:
+            op = OP_Fx1E;
+            break;
+
+        case 0x0029:
+            op = OP_Fx29;
+            break;
+
+        case 0x0030:
+            op = OP_Fx30;
+            break;
+
+        case 0x0033:
+            op = OP_Fx33;
+            break;
+
+        case 0x003A:
+            if (xo) op = OP_Fx3A;
+            break;
+
+        case 0x0055:
+            op = OP_Fx55;
+            break;
+
+        case 0x0065:
+            op = OP_Fx65;
+            break;
+
+        case 0x0075:
+            op = OP_Fx75;
+            break;
+
+        case 0x0085:
+            op = OP_Fx85;
+            break;
+        }
+        break;
+    }
+
+    in->opcode = opcode;
+    in->nnn = opcode & 0x0FFF;
+    in->op = op;
+    in->x = (opcode & 0x0F00) >> 8;
+    in->y = (opcode & 0x00F0) >> 4;
+    in->kk = opcode & 0x00FF;
+    in->fused = 0;
+}
+
+// Does the instruction skip the next one? (see skip())
+static bool
+is_skip(uint8_t op)
+{
+    return op == OP_3xkk || op == OP_4xkk || op == OP_5xy0 || op == OP_9xy0 ||
+           op == OP_Ex9E || op == OP_ExA1;
+}
+
+// Execution counters
+
+static const char *const op_names[C8_PROFILE_OPS] = {
+    [OP_0nnn] = "0nnn", [OP_00Cn] = "00Cn", [OP_00Dn] = "00Dn",
+    [OP_00E0] = "00E0", [OP_00EE] = "00EE", [OP_00FB] = "00FB",
+    [OP_00FC] = "00FC", [OP_00FD] = "00FD", [OP_00FE] = "00FE",
+    [OP_00FF] = "00FF", [OP_1nnn] = "1nnn", [OP_2nnn] = "2nnn",
+    [OP_3xkk] = "3xkk", [OP_4xkk] = "4xkk", [OP_5xy0] = "5xy0",
+    [OP_5xy2] = "5xy2", [OP_5xy3] = "5xy3", [OP_6xkk] = "6xkk",
+    [OP_7xkk] = "7xkk", [OP_8xy0] = "8xy0", [OP_8xy1] = "8xy1",
+    [OP_8xy2] = "8xy2", [OP_8xy3] = "8xy3", [OP_8xy4] = "8xy4",
+    [OP_8xy5] = "8xy5", [OP_8xy6] = "8xy6", [OP_8xy7] = "8xy7",
+    [OP_8xyE] = "8xyE", [OP_9xy0] = "9xy0", [OP_Annn] = "Annn",
+    [OP_Bnnn] = "Bnnn", [OP_Cxkk] = "Cxkk", [OP_Dxyn] = "Dxyn",
+    [OP_Ex9E] = "Ex9E", [OP_ExA1] = "ExA1", [OP_F000] = "F000",
+    [OP_Fn01] = "Fn01", [OP_F002] = "F002", [OP_Fx07] = "Fx07",
+    [OP_Fx0A] = "Fx0A", [OP_Fx15] = "Fx15", [OP_Fx18] = "Fx18",
+    [OP_Fx1E] = "Fx1E", [OP_Fx29] = "Fx29", [OP_Fx30] = "Fx30",
+    [OP_Fx33] = "Fx33", [OP_Fx3A] = "Fx3A", [OP_Fx55] = "Fx55",
+    [OP_Fx65] = "Fx65", [OP_Fx75] = "Fx75", [OP_Fx85] = "Fx85",
+    [OP_UNKNOWN] = "unknown",
+};
+
+int
+c8_attach_profile(Chip8 *vm, C8Profile *prof)
+{
+#ifdef C8_PROFILE
+    ASSERT(OP_UNKNOWN < C8_PROFILE_OPS);
+    vm->profile = prof;
+    return 0;
+#else
+    (void) prof;
+    vm->profile = NULL;
+    return -1;
+#endif
+}
+
+const char *
+c8_profile_op_name(int op)
+{
+    return (op >= 0 && op < C8_PROFILE_OPS) ? op_names[op] : NULL;
+}
+
+// Does address a rank below address b? Ties go to the lower address.
+static bool
+ranks_below(C8Profile *prof, int a, int b)
+{
+    uint64_t ca = prof->pc_count[a], cb = prof->pc_count[b];
+    return ca < cb || (ca == cb && a > b);
+}
+
+int
+c8_profile_hottest(C8Profile *prof, uint16_t *addr, int n)
+{
+    // Selection, n is meant to be small
+    int found = 0;
+    for (; found < n; found++) {
+        int best = -1;
+        for (int a = 0; a < RAM_SIZE; a++) {
+            if (prof->pc_count[a] == 0) continue;
+            if (found > 0 && !ranks_below(prof, a, addr[found - 1])) continue;
+            if (best < 0 || ranks_below(prof, best, a)) best = a;
+        }
+        if (best < 0) break;
+        addr[found] = best;
+    }
+    return found;
+}
+
+#ifdef C8_PROFILE
+
+static void
+profile_count(Chip8 *vm, int op, uint16_t addr)
+{
+    if (!vm->profile) return;
+    vm->profile->op_count[op]++;
+    vm->profile->pc_count[addr % RAM_SIZE]++;
+}
+
+// Same as profile_count(), for an instruction that wasn't decoded yet
+static void
+profile_opcode(Chip8 *vm)
+{
+    if (!vm->profile) return;
+    C8Instr in;
+    decode(vm->opcode, vm->quirks, &in);
+    profile_count(vm, in.op, vm->PC - 2);
+}
+
+#if C8_JIT_SUPPORTED || defined(C8_AOT)
+
+// Counts the length instructions of a translated block starting at addr
+static void
+profile_block(Chip8 *vm, uint16_t addr, int length)
+{
+    if (!vm->profile) return;
+    for (int i = 0; i < length; i++, addr += 2) {
+        C8Instr in;
+        decode(*ram_at(vm, addr) << 8 | *ram_at(vm, (uint16_t) (addr + 1)),
+               vm->quirks, &in);
+        profile_count(vm, in.op, addr);
+    }
+}
+
+#endif
+
+static void
+profile_skip(Chip8 *vm, int n)
+{
+    if (vm->profile) vm->profile->skipped += n;
+}
+
+static uint64_t
+profile_clock(Chip8 *vm)
+{
+    return (vm->profile && vm->profile->clock) ? vm->profile->clock() : 0;
+}
+
+static void
+profile_time(Chip8 *vm, C8TimedOp op, uint64_t start)
+{
+    if (!vm->profile || !vm->profile->clock) return;
+    vm->profile->time[op] += vm->profile->clock() - start;
+    vm->profile->calls[op]++;
+}
+
+#endif
+
+// No. instructions of each fused sequence
+static const uint8_t fusion_length[C8_FUSIONS] = {
+    [C8_FUSE_ANNN_DXYN] = 2, [C8_FUSE_7XKK_3XKK_1NNN] = 3,
+    [C8_FUSE_6XKK_FX15] = 2, [C8_FUSE_FX29_DXYN] = 2,
+    [C8_FUSE_FX33_FX65] = 2,
+};
+
+// No. bytes of the fused sequence starting at in, 0 if there's none
+static int
+fused_size(const C8Instr *in)
+{
+    if (in->op == OP_NONE || !in->fused) return 0;
+    return 2 * fusion_length[in->fused - 1];
+}
+
+// Invalidate the predecoded instructions overlapping RAM[addr, addr + len)
+static void
+invalidate_cache(Chip8 *vm, int addr, int len)
+{
+    if (!vm->cache) return;
+
+    // The instruction starting one byte before addr overlaps it as well, and
+    // so do fused sequences starting up to 5 bytes before
+    int start = addr > 5 ? addr - 5 : 0;
+    int end = addr + len < RAM_SIZE ? addr + len : RAM_SIZE;
+    for (int i = start; i < end; i++) {
+        C8Instr *in = &vm->cache->instr[i];
+        if (i >= addr - 1 || i + fused_size(in) > addr)
+            in->op = OP_NONE;
+    }
+}
+
+// Same as decode_and_execute(), for a predecoded instruction
+static ALWAYS_INLINE int
+execute(Chip8 *vm, const C8Instr *in, unsigned quirks)
+{
+    PROFILE_INSTR(vm, in->op);
+
+    // Operands are copied because Fx33, Fx55 and 5xy2 may overwrite *in
+    uint8_t x = in->x;
+    uint8_t y = in->y;
+    uint8_t n = in->kk & 0x000F;
+    uint8_t kk = in->kk;
+    uint16_t nnn = in->nnn;
+
+    switch (in->op) {
+    case OP_0nnn:
+        break;
+
+    case OP_00Cn:
+        op_00Cn(vm, n, quirks);
+        vm->screen_updated = true;
+        break;
+
+    case OP_00Dn:
+        op_00Dn(vm, n, quirks);
+        vm->screen_updated = true;
+        break;
+
+    case OP_00E0:
+        op_00E0(vm);
+        vm->screen_updated = true;
+        break;
+
+    case OP_00EE:
+        op_00EE(vm);
+        break;
+
+    case OP_00FB:
+        op_00FB(vm, quirks);
+        vm->screen_updated = true;
+        break;
+
+    case OP_00FC:
+        op_00FC(vm, quirks);
+        vm->screen_updated = true;
+        break;
+
+    case OP_00FD:
+        op_00FD(vm);
+        break;
+
+    case OP_00FE:
+        op_00FE(vm, quirks);
+        break;
+
+    case OP_00FF:
+        op_00FF(vm, quirks);
+        break;
+
+    case OP_1nnn:
+        return op_1nnn(vm, nnn);
+
+    case OP_2nnn:
+        op_2nnn(vm, nnn);
+        break;
+
+    case OP_3xkk:
+        op_3xkk(vm, x, kk, quirks);
+        break;
+
+    case OP_4xkk:
+        op_4xkk(vm, x, kk, quirks);
+        break;
+
+    case OP_5xy0:
+        op_5xy0(vm, x, y, quirks);
+        break;
+
+    case OP_5xy2:
+        op_5xy2(vm, x, y);
+        break;
+
+    case OP_5xy3:
+        op_5xy3(vm, x, y);
+        break;
+
+    case OP_6xkk:
+        op_6xkk(vm, x, kk);
+        break;
+
+    case OP_7xkk:
+        op_7xkk(vm, x, kk);
+        break;
+
+    case OP_8xy0:
+        op_8xy0(vm, x, y);
+        break;
+
+    case OP_8xy1:
+        op_8xy1(vm, x, y, quirks);
+        break;
+
+    case OP_8xy2:
+        op_8xy2(vm, x, y, quirks);
+        break;
+
+    case OP_8xy3:
+        op_8xy3(vm, x, y, quirks);
+        break;
+
+    case OP_8xy4:
+        op_8xy4(vm, x, y);
+        break;
+
+    case OP_8xy5:
+        op_8xy5(vm, x, y);
+        break;
+
+    case OP_8xy6:
+        op_8xy6(vm, x, y, quirks);
+        break;
+
+    case OP_8xy7:
+        op_8xy7(vm, x, y);
+        break;
+
+    case OP_8xyE:
+        op_8xyE(vm, x, y, quirks);
+        break;
+
+    case OP_9xy0:
+        op_9xy0(vm, x, y, quirks);
+        break;
+
+    case OP_Annn:
+        op_Annn(vm, nnn);
+        break;
+
+    case OP_Bnnn:
+        op_Bnnn(vm, x, nnn, quirks);
+        break;
+
+    case OP_Cxkk:
+        op_Cxkk(vm, x, kk);
+        break;
+
+    case OP_Dxyn:
+        return draw(vm, x, y, n, quirks);
+
+    case OP_Ex9E:
+        op_Ex9E(vm, x, quirks);
+        break;
+
+    case OP_ExA1:
+        op_ExA1(vm, x, quirks);
+        break;
+
+    case OP_F000:
+        op_F000(vm);
+        break;
+
+    case OP_Fn01:
+        op_Fn01(vm, x);
+        break;
+
+    case OP_F002:
+        op_F002(vm);
+        break;
+
+    case OP_Fx07:
+        op_Fx07(vm, x);
+        break;
+
+    case OP_Fx0A:
+        return op_Fx0A(vm, x);
+
+    case OP_Fx15:
+        op_Fx15(vm, x);
+        break;
+
+    case OP_Fx18:
+        op_Fx18(vm, x);
+        break;
+
+    case OP_Fx1E:
+        op_Fx1E(vm, x);
+        break;
+
+    case OP_Fx29:
+        op_Fx29(vm, x);
+        break;
+
+    case OP_Fx30:
+        op_Fx30(vm, x);
+        break;
+
+    case OP_Fx33:
+        op_Fx33(vm, x, quirks);
+        break;
+
+    case OP_Fx3A:
+        op_Fx3A(vm, x);
+        break;
+
+    case OP_Fx55:
+        op_Fx55(vm, x, quirks);
+        break;
+
+    case OP_Fx65:
+        op_Fx65(vm, x, quirks);
+        break;
+
+    case OP_Fx75:
+        op_Fx75(vm, x);
+        break;
+
+    case OP_Fx85:
+        op_Fx85(vm, x);
+        break;
+
+    default:
+        return -1;  // Unknown opcode
+    }
+
+    return 0;
+}
+
+// An instruction is 2 bytes long, addresses past the end of the memory in use
+// wrap around
+static ALWAYS_INLINE uint16_t
+fetch(Chip8 *vm, unsigned quirks)
+{
+    unsigned mask = ram_mask(quirks);
+    unsigned pc = vm->PC & mask;
+
+    // Both bytes are usually in the first 4 KB, even on XO-CHIP
+    if (pc < CHIP8_RAM_SIZE - 1) return vm->RAM[pc] << 8 | vm->RAM[pc + 1];
+    return *ram_at(vm, pc) << 8 | *ram_at(vm, (pc + 1) & mask);
+}
+
+void
+c8_attach_cache(Chip8 *vm, C8DecodeCache *cache)
+{
+    vm->cache = cache;
+    invalidate_cache(vm, 0, RAM_SIZE);
+}
+
+void
+c8_set_fusion(Chip8 *vm, bool on)
+{
+    if (!vm->cache) return;
+    vm->cache->fuse = on;
+    memset_(vm->cache->fused, 0, sizeof(vm->cache->fused));
+    invalidate_cache(vm, 0, RAM_SIZE);
+}
+
+const char *
+c8_fusion_name(int n)
+{
+    static const char *const names[C8_FUSIONS] = {
+        "Annn+Dxyn", "7xkk+3xkk+1nnn", "6xkk+Fx15", "Fx29+Dxyn", "Fx33+Fx65",
+    };
+    return (n >= 0 && n < C8_FUSIONS) ? names[n] : NULL;
+}
+
+// Returns the sequence made of the instructions a, b and c (NULL past the
+// end of RAM), or -1 if they don't start one
+static int
+match_fusion(const C8Instr *a, const C8Instr *b, const C8Instr *c)
+{
+    switch (a->op) {
+    case OP_Annn:
+        if (b->op == OP_Dxyn) return C8_FUSE_ANNN_DXYN;
+        break;
+
+    case OP_7xkk:
+        if (b->op == OP_3xkk && b->x == a->x && c && c->op == OP_1nnn)
+            return C8_FUSE_7XKK_3XKK_1NNN;
+        break;
+
+    case OP_6xkk:
+        if (b->op == OP_Fx15 && b->x == a->x) return C8_FUSE_6XKK_FX15;
+        break;
+
+    case OP_Fx29:
+        if (b->op == OP_Dxyn) return C8_FUSE_FX29_DXYN;
+        break;
+
+    case OP_Fx33:
+        if (b->op == OP_Fx65) return C8_FUSE_FX33_FX65;
+        break;
+    }
+    return -1;
+}
+
+// Decodes the instruction at PC into its cache entry, and marks the sequence
+// it starts if there's one to fuse. The rest of the sequence is decoded into
+// its own entries, invalidate_cache() drops the first one along with them.
+static void
+decode_cached(Chip8 *vm, C8Instr *in)
+{
+    decode(fetch(vm, vm->quirks), vm->quirks, in);
+    if (!vm->cache->fuse) return;
+
+    // The next 2 instructions, if they are whole and inside the memory in use
+    C8Instr *next[2] = {NULL, NULL};
+    int size = c8_memory_size(vm);
+    for (int i = 0; i < 2 && vm->PC + 2 * i + 3 < size; i++) {
+        int addr = vm->PC + 2 * i + 2;
+        next[i] = &vm->cache->instr[addr];
+        if (next[i]->op == OP_NONE)
+            decode(*ram_at(vm, addr) << 8 | *ram_at(vm, addr + 1), vm->quirks,
+                   next[i]);
+    }
+
+    int f = next[0] ? match_fusion(in, next[0], next[1]) : -1;
+    if (f >= 0) in->fused = f + 1;
+}
+
+// Moves past an instruction of a fused sequence, like cycle_cached() does
+static ALWAYS_INLINE void
+advance(Chip8 *vm, const C8Instr *in)
+{
+    vm->opcode = in->opcode;
+    vm->PC += 2;
+    PROFILE_INSTR(vm, in->op);
+}
+
+// Same as execute(), for the fused sequence starting at in (see
+// decode_cached()). Stores the no. instructions run in *count, which is less
+// than the length of the sequence when a skip leaves it early.
+static ALWAYS_INLINE int
+execute_fused(Chip8 *vm, const C8Instr *in, unsigned quirks, int *count)
+{
+    const C8Instr *b = in + 2, *c = in + 4;
+    uint8_t x = in->x;
+
+    vm->cache->fused[in->fused - 1]++;
+    switch (in->fused - 1) {
+    case C8_FUSE_ANNN_DXYN:
+        advance(vm, in);
+        vm->I = in->nnn;
+        advance(vm, b);
+        *count = 2;
+        return draw(vm, b->x, b->y, b->kk & 0x0F, quirks);
+
+    case C8_FUSE_7XKK_3XKK_1NNN:
+        advance(vm, in);
+        vm->V[x] += in->kk;
+        advance(vm, b);
+        if (vm->V[x] == b->kk) {
+            vm->PC += 2;
+            *count = 2;
+            return 0;
+        }
+        advance(vm, c);
+        *count = 3;
+        return op_1nnn(vm, c->nnn);
+
+    case C8_FUSE_6XKK_FX15:
+        advance(vm, in);
+        advance(vm, b);
+        vm->V[x] = in->kk;
+        vm->DT = in->kk;
+        *count = 2;
+        return 0;
+
+    case C8_FUSE_FX29_DXYN:
+        advance(vm, in);
+        op_Fx29(vm, x);
+        advance(vm, b);
+        *count = 2;
+        return draw(vm, b->x, b->y, b->kk & 0x0F, quirks);
+
+    case C8_FUSE_FX33_FX65:
+        advance(vm, in);
+        op_Fx33(vm, x, quirks);
+        *count = 1;
+
+        // The digits may have overwritten Fx65 (or *in)
+        if (b->op != OP_Fx65) return 0;
+        advance(vm, b);
+        op_Fx65(vm, b->x, quirks);
+        *count = 2;
+        return 0;
+    }
+
+    ASSERT(false);
+    return -1;
+}
+
+// Same as c8_cycle(), but instructions are decoded once and then fetched
+// from vm->cache until the memory they were decoded from is overwritten
+static ALWAYS_INLINE int
+cycle_cached(Chip8 *vm, unsigned quirks)
+{
+    for (int i = 0; i < vm->IPF; i++) {
+        int len;
+
+        // The last byte of memory can't hold a whole instruction
+        if (vm->PC >= ram_mask(quirks)) {
+            vm->opcode = fetch(vm, quirks);
+            vm->PC += 2;
+            len = decode_and_execute(vm, quirks);
+        } else {
+            C8Instr *in = &vm->cache->instr[vm->PC];
+            if (in->op == OP_NONE) decode_cached(vm, in);
+
+            // A sequence longer than the rest of the frame runs unfused
+            if (in->fused && fusion_length[in->fused - 1] <= vm->IPF - i) {
+                int count;
+                len = execute_fused(vm, in, quirks, &count);
+                i += count - 1;
+            } else {
+                vm->opcode = in->opcode;
+                vm->PC += 2;
+                len = execute(vm, in, quirks);
+            }
+        }
+
+        if (len < 0) return -1;
+        if (len > 0) i += skip_idle(vm, len, vm->IPF - i - 1);
+    }
+
+    return 0;
+}
+
+// Fetch-decode-execute a single instruction, returns the same as execute().
+// Runs on the generic interpreter: the translator and the batch only fall
+// back to it for the instructions they can't run themselves.
+static int
+step(Chip8 *vm)
+{
+    if (vm->cache && vm->PC < c8_memory_size(vm) - 1) {
+        C8Instr *in = &vm->cache->instr[vm->PC];
+        if (in->op == OP_NONE) decode_cached(vm, in);
+        vm->opcode = in->opcode;
+        vm->PC += 2;
+        return execute(vm, in, vm->quirks);
+    }
+
+    vm->opcode = fetch(vm, vm->quirks);
+    vm->PC += 2;
+    return decode_and_execute(vm, vm->quirks);
+}
+
+#if C8_JIT_SUPPORTED
+
+// x86-64 basic-block translator
+//
+// A block is a straight-line run of instructions that only touch registers
+// and timers, optionally ended by a jump or a skip. Blocks are called with
+// the Chip8 pointer in rdi (System V ABI). Between blocks, V[], I and PC live
+// in the Chip8 struct and are addressed as [rdi + disp32]. Within a block,
+// the registers it uses the most are loaded into host registers on entry and
+// stored back on exit, when that takes fewer memory accesses than leaving
+// them in memory, and PC is only written on exit, as an immediate. Draws,
+// Fx0A and everything else that touches memory, the screen or the keypad
+// end the block and run on the interpreter.
+// rax, rcx and rdx are scratch, callee-saved registers are pushed when used.
+
+#define JIT_NONE 0xFFFFFFFF     // No block starts at this address
+#define JIT_MAX_LENGTH 64       // Instructions per block
+#define JIT_MAX_INSTR_SIZE 32   // Bytes of machine code per instruction
+#define JIT_MAX_FRAME_SIZE 256  // Bytes of entry and exit code per block
+
+#define V_(x) (offsetof(Chip8, V) + (x))
+#define I_ offsetof(Chip8, I)
+#define PC_ offsetof(Chip8, PC)
+#define DT_ offsetof(Chip8, DT)
+#define ST_ offsetof(Chip8, ST)
+#define OPCODE_ offsetof(Chip8, opcode)
+
+// Host registers, by the name of their low byte
+enum {
+    AL, CL, DL, BL, SPL, BPL, SIL, DIL,
+    R8B, R9B, R10B, R11B, R12B, R13B, R14B, R15B,
+};
+
+// Registers given to V[] and I, caller-saved first
+static const uint8_t jit_pool[] = {SIL,  R8B,  R9B,  R10B, R11B, BL,
+                                   BPL,  R12B, R13B, R14B, R15B};
+#define JIT_CALLER_SAVED 5
+
+#define JIT_I 16  // Index of I after V[] in a JitFrame
+
+// Where a value lives within a block: a host register, or [rdi + disp]
+typedef struct {
+    int reg;  // -1 for memory
+    uint32_t disp;
+} JitOperand;
+
+#define MEM(disp) ((JitOperand){-1, (disp)})
+#define REG(r) ((JitOperand){(r), 0})
+
+// Registers of the block being translated, bit N of the masks is reg[N]
+typedef struct {
+    JitOperand reg[17];  // V0-VF, then I
+    uint32_t read;       // Read before being written by the block
+    uint32_t written;    // Written by the block
+    int pushed;          // No. callee-saved registers used
+} JitFrame;
+
+static void
+emit(C8Jit *jit, int len, const uint8_t *bytes)
+{
+    memcpy_(&jit->code[jit->code_used], bytes, len);
+    jit->code_used += len;
+}
+
+static void
+emit32(C8Jit *jit, uint32_t v)
+{
+    uint8_t bytes[] = {v, v >> 8, v >> 16, v >> 24};
+    emit(jit, 4, bytes);
+}
+
+// <prefix> <op> with a ModRM byte for reg and rm. Byte registers past bl
+// need a REX prefix: without one, 4-7 are ah, ch, dh and bh.
+static void
+emit_modrm(C8Jit *jit, uint8_t prefix, uint16_t op, int reg, bool rex,
+           JitOperand rm)
+{
+    uint8_t bytes[5];
+    int n = 0;
+    if (prefix) bytes[n++] = prefix;
+    if (rex || rm.reg > BL)
+        bytes[n++] = 0x40 | (reg >> 3) << 2 | (rm.reg > BL ? rm.reg >> 3 : 0);
+    if (op > 0xFF) bytes[n++] = op >> 8;
+    bytes[n++] = op & 0xFF;
+
+    if (rm.reg >= 0) {
+        bytes[n++] = 0xC0 | (reg & 7) << 3 | (rm.reg & 7);
+        emit(jit, n, bytes);
+    } else {
+        bytes[n++] = 0x80 | (reg & 7) << 3 | 7;
+        emit(jit, n, bytes);
+        emit32(jit, rm.disp);
+    }
+}
+
+// <op> reg, rm or <op> rm, reg, depending on op. prefix is 0x66 for 16-bit
+// operands, 0 for 8-bit ones.
+static void
+emit_rm(C8Jit *jit, uint8_t prefix, uint16_t op, int reg, JitOperand rm)
+{
+    emit_modrm(jit, prefix, op, reg, reg > BL, rm);
+}
+
+// <op> byte rm, imm8, ext is the opcode extension
+static void
+emit_rm_imm8(C8Jit *jit, uint8_t op, int ext, JitOperand rm, uint8_t imm)
+{
+    emit_modrm(jit, 0, op, ext, false, rm);
+    emit(jit, 1, &imm);
+}
+
+// mov word rm, imm16
+static void
+emit_mov_rm16_imm16(C8Jit *jit, JitOperand rm, uint16_t imm)
+{
+    uint8_t bytes[] = {imm, imm >> 8};
+    emit_modrm(jit, 0x66, 0xC7, 0, false, rm);
+    emit(jit, 2, bytes);
+}
+
+#define MOV_R8_RM8 0x8A
+#define MOV_RM8_R8 0x88
+#define MOV_R16_RM16 0x8B
+#define MOV_RM16_R16 0x89
+#define MOVZX_R32_RM8 0x0FB6
+#define OR_RM8_R8 0x08
+#define AND_RM8_R8 0x20
+#define XOR_RM8_R8 0x30
+#define ADD_R8_RM8 0x02
+#define ADD_RM16_R16 0x01
+#define CMP_R8_RM8 0x3A
+
+// push or pop a 64-bit register
+static void
+emit_push_pop(C8Jit *jit, uint8_t op, int reg)
+{
+    uint8_t bytes[] = {0x41, op | (reg & 7)};
+    if (reg > DIL)
+        emit(jit, 2, bytes);
+    else
+        emit(jit, 1, bytes + 1);
+}
+
+#define PUSH 0x50
+#define POP 0x58
+
+// Vx = Vx - Vy or Vx = Vy - Vx, VF = NOT borrow
+static void
+emit_sub(C8Jit *jit, const JitFrame *f, uint8_t x, uint8_t minuend,
+         uint8_t subtrahend)
+{
+    static const uint8_t cmp_seta_sub[] = {
+        0x38, 0xC8,        // cmp al, cl
+        0x0F, 0x97, 0xC2,  // seta dl
+        0x28, 0xC8,        // sub al, cl
+    };
+    emit_rm(jit, 0, MOV_R8_RM8, AL, f->reg[minuend]);
+    emit_rm(jit, 0, MOV_R8_RM8, CL, f->reg[subtrahend]);
+    emit(jit, sizeof(cmp_seta_sub), cmp_seta_sub);
+    emit_rm(jit, 0, MOV_RM8_R8, AL, f->reg[x]);
+    emit_rm(jit, 0, MOV_RM8_R8, DL, f->reg[0xF]);
+}
+
+// Vx = Vx >> 1 or Vx = Vx << 1, VF = shifted out bit
+static void
+emit_shift(C8Jit *jit, const JitFrame *f, unsigned quirks, uint8_t x,
+           uint8_t y, bool left)
+{
+    static const uint8_t shr[] = {
+        0x88, 0xC2,        // mov dl, al
+        0x80, 0xE2, 0x01,  // and dl, 1
+        0xD0, 0xE8,        // shr al, 1
+    };
+    static const uint8_t shl[] = {
+        0x88, 0xC2,        // mov dl, al
+        0xC0, 0xEA, 0x07,  // shr dl, 7
+        0xD0, 0xE0,        // shl al, 1
+    };
+    uint8_t src = (quirks & C8_QUIRK_SHIFT) ? x : y;
+    emit_rm(jit, 0, MOV_R8_RM8, AL, f->reg[src]);
+    emit(jit, sizeof(shl), left ? shl : shr);
+    emit_rm(jit, 0, MOV_RM8_R8, AL, f->reg[x]);
+    emit_rm(jit, 0, MOV_RM8_R8, DL, f->reg[0xF]);
+}
+
+// I = offset + Vx * size
+static void
+emit_font(C8Jit *jit, const JitFrame *f, uint8_t x, uint8_t size,
+          uint32_t offset)
+{
+    uint8_t imul_add[] = {
+        0x6B, 0xC0, size,  // imul eax, eax, size
+        0x05,              // add eax, offset
+    };
+    emit_rm(jit, 0, MOVZX_R32_RM8, AL, f->reg[x]);
+    emit(jit, sizeof(imul_add), imul_add);
+    emit32(jit, offset);
+    emit_rm(jit, 0x66, MOV_RM16_R16, AL, f->reg[JIT_I]);
+}
+
+// dst = src, through al if both are in memory
+static void
+emit_copy(C8Jit *jit, JitOperand dst, JitOperand src)
+{
+    if (dst.reg >= 0) {
+        emit_rm(jit, 0, MOV_R8_RM8, dst.reg, src);
+    } else if (src.reg >= 0) {
+        emit_rm(jit, 0, MOV_RM8_R8, src.reg, dst);
+    } else {
+        emit_rm(jit, 0, MOV_R8_RM8, AL, src);
+        emit_rm(jit, 0, MOV_RM8_R8, AL, dst);
+    }
+}
+
+// PC = next, or next + 2 if the condition holds (jcc skips the second mov)
+static void
+emit_skip(C8Jit *jit, uint8_t jcc, uint16_t next)
+{
+    emit_mov_rm16_imm16(jit, MEM(PC_), next);
+    uint8_t bytes[] = {jcc, 9};
+    emit(jit, 2, bytes);
+    emit_mov_rm16_imm16(jit, MEM(PC_), next + 2);
+}
+
+#define JNE 0x75
+#define JE 0x74
+
+// Sets the registers the instruction reads and writes (bit N for VN, bit
+// JIT_I for I), returns false if it can't be translated
+static bool
+jit_registers(const C8Instr *in, unsigned quirks, uint32_t *read,
+              uint32_t *written)
+{
+    uint32_t x = 1u << in->x, y = 1u << in->y, vf = 1u << 0xF;
+    uint32_t i = 1u << JIT_I;
+    uint32_t r = 0, w = 0;
+
+    switch (in->op) {
+    case OP_1nnn:
+        break;
+    case OP_3xkk:
+    case OP_4xkk:
+    case OP_Fx15:
+    case OP_Fx18:
+        r = x;
+        break;
+    case OP_5xy0:
+    case OP_9xy0:
+        r = x | y;
+        break;
+    case OP_6xkk:
+    case OP_Fx07:
+        w = x;
+        break;
+    case OP_7xkk:
+        r = w = x;
+        break;
+    case OP_8xy0:
+        r = y;
+        w = x;
+        break;
+    case OP_8xy1:
+    case OP_8xy2:
+    case OP_8xy3:
+        r = x | y;
+        w = x | ((quirks & C8_QUIRK_VF_RESET) ? vf : 0);
+        break;
+    case OP_8xy4:
+    case OP_8xy5:
+    case OP_8xy7:
+        r = x | y;
+        w = x | vf;
+        break;
+    case OP_8xy6:
+    case OP_8xyE:
+        r = (quirks & C8_QUIRK_SHIFT) ? x : y;
+        w = x | vf;
+        break;
+    case OP_Annn:
+        w = i;
+        break;
+    case OP_Fx1E:
+        r = x | i;
+        w = i;
+        break;
+    case OP_Fx29:
+    case OP_Fx30:
+        r = x;
+        w = i;
+        break;
+    default:
+        return false;
+    }
+
+    *read = r;
+    *written = w;
+    return true;
+}
+
+// Gives host registers to the registers of the block that save the most
+// memory accesses: a register used by n instructions costs a load if the
+// block reads it first, a store if it writes it, and a push and a pop if it's
+// callee-saved, instead of n accesses. The others stay in memory.
+static void
+allocate_registers(JitFrame *f, const int uses[17])
+{
+    uint32_t allocated = 0;
+    for (int n = 0; n < 17; n++)
+        f->reg[n] = MEM(n == JIT_I ? I_ : V_(n));
+    f->pushed = 0;
+
+    for (int k = 0; k < (int) sizeof(jit_pool); k++) {
+        int best = -1, best_gain = (k >= JIT_CALLER_SAVED) ? 2 : 0;
+        for (int n = 0; n < 17; n++) {
+            int gain = uses[n] - (f->read >> n & 1) - (f->written >> n & 1);
+            if (allocated >> n & 1 || gain <= best_gain) continue;
+            best = n;
+            best_gain = gain;
+        }
+        if (best < 0) break;
+        allocated |= 1u << best;
+        f->reg[best] = REG(jit_pool[k]);
+        if (k >= JIT_CALLER_SAVED) f->pushed++;
+    }
+}
+
+// Saves the callee-saved registers used and loads the allocated registers
+// the block reads
+static void
+emit_entry(C8Jit *jit, const JitFrame *f)
+{
+    for (int k = 0; k < f->pushed; k++)
+        emit_push_pop(jit, PUSH, jit_pool[JIT_CALLER_SAVED + k]);
+
+    for (int n = 0; n < 17; n++) {
+        if (f->reg[n].reg < 0 || !(f->read >> n & 1)) continue;
+        if (n == JIT_I)
+            emit_rm(jit, 0x66, MOV_R16_RM16, f->reg[n].reg, MEM(I_));
+        else
+            emit_rm(jit, 0, MOV_R8_RM8, f->reg[n].reg, MEM(V_(n)));
+    }
+}
+
+// Stores the allocated registers written and restores the callee-saved ones.
+// Neither mov nor pop changes the flags, which a skip then tests.
+static void
+emit_exit(C8Jit *jit, const JitFrame *f)
+{
+    for (int n = 0; n < 17; n++) {
+        if (f->reg[n].reg < 0 || !(f->written >> n & 1)) continue;
+        if (n == JIT_I)
+            emit_rm(jit, 0x66, MOV_RM16_R16, f->reg[n].reg, MEM(I_));
+        else
+            emit_rm(jit, 0, MOV_RM8_R8, f->reg[n].reg, MEM(V_(n)));
+    }
+
+    for (int k = f->pushed - 1; k >= 0; k--)
+        emit_push_pop(jit, POP, jit_pool[JIT_CALLER_SAVED + k]);
+}
+
+// Emits the instruction, which jit_registers() accepted. Jumps and skips
+// only emit their comparison here: translate_block() sets PC once the
+// registers are stored back.
+static void
+translate_instr(C8Jit *jit, const JitFrame *f, unsigned quirks,
+                const C8Instr *in)
+{
+    const JitOperand *V = f->reg;
+    uint8_t x = in->x;
+    uint8_t y = in->y;
+    uint8_t kk = in->kk;
+
+    switch (in->op) {
+    case OP_3xkk:
+    case OP_4xkk:
+        emit_rm_imm8(jit, 0x80, 7, V[x], kk);  // cmp Vx, kk
+        break;
+
+    case OP_5xy0:
+    case OP_9xy0:
+        emit_rm(jit, 0, MOV_R8_RM8, AL, V[x]);
+        emit_rm(jit, 0, CMP_R8_RM8, AL, V[y]);
+        break;
+
+    case OP_6xkk:
+        emit_rm_imm8(jit, 0xC6, 0, V[x], kk);  // mov Vx, kk
+        break;
+
+    case OP_7xkk:
+        emit_rm_imm8(jit, 0x80, 0, V[x], kk);  // add Vx, kk
+        break;
+
+    case OP_8xy0:
+        emit_copy(jit, V[x], V[y]);
+        break;
+
+    case OP_8xy1:
+    case OP_8xy2:
+    case OP_8xy3: {
+        uint8_t op = in->op == OP_8xy1   ? OR_RM8_R8
+                     : in->op == OP_8xy2 ? AND_RM8_R8
+                                         : XOR_RM8_R8;
+        emit_rm(jit, 0, MOV_R8_RM8, AL, V[y]);
+        emit_rm(jit, 0, op, AL, V[x]);
+        if (quirks & C8_QUIRK_VF_RESET)
+            emit_rm_imm8(jit, 0xC6, 0, V[0xF], 0);  // mov VF, 0
+        break;
+    }
+
+    case OP_8xy4: {
+        static const uint8_t setc_dl[] = {0x0F, 0x92, 0xC2};
+        emit_rm(jit, 0, MOV_R8_RM8, AL, V[x]);
+        emit_rm(jit, 0, ADD_R8_RM8, AL, V[y]);
+        emit(jit, sizeof(setc_dl), setc_dl);
+        emit_rm(jit, 0, MOV_RM8_R8, AL, V[x]);
+        emit_rm(jit, 0, MOV_RM8_R8, DL, V[0xF]);
+        break;
+    }
+
+    case OP_8xy5:
+        emit_sub(jit, f, x, x, y);
+        break;
+
+    case OP_8xy7:
+        emit_sub(jit, f, x, y, x);
+        break;
+
+    case OP_8xy6:
+    case OP_8xyE:
+        emit_shift(jit, f, quirks, x, y, in->op == OP_8xyE);
+        break;
+
+    case OP_Annn:
+        emit_mov_rm16_imm16(jit, f->reg[JIT_I], in->nnn);
+        break;
+
+    case OP_Fx07:
+        emit_copy(jit, V[x], MEM(DT_));
+        break;
+
+    case OP_Fx15:
+    case OP_Fx18:
+        emit_copy(jit, MEM(in->op == OP_Fx15 ? DT_ : ST_), V[x]);
+        break;
+
+    case OP_Fx1E:
+        emit_rm(jit, 0, MOVZX_R32_RM8, AL, V[x]);
+        emit_rm(jit, 0x66, ADD_RM16_R16, AL, f->reg[JIT_I]);
+        break;
+
+    case OP_Fx29:
+        emit_font(jit, f, x, 5, FONT_OFFSET);
+        break;
+
+    case OP_Fx30:
+        emit_font(jit, f, x, 10, HFONT_OFFSET);
+        break;
+    }
+}
+
+// Drops every block, which are all in the first size bytes of memory
+static void
+flush_jit(C8Jit *jit, int size)
+{
+    jit->code_used = 0;
+    jit->flushes++;
+    memset_(jit->offset, 0, size * sizeof(jit->offset[0]));
+    memset_(jit->covered, 0, size);
+}
+
+// Translates the block starting at addr, or marks it as JIT_NONE if its
+// first instruction can't be translated. The block is decoded first, to
+// know which registers it uses, then emitted.
+static void
+translate_block(Chip8 *vm, uint16_t addr)
+{
+    C8Jit *jit = vm->jit;
+    int size = c8_memory_size(vm);
+
+    uint32_t worst = JIT_MAX_LENGTH * JIT_MAX_INSTR_SIZE + JIT_MAX_FRAME_SIZE;
+    if (jit->code_size - jit->code_used < worst) flush_jit(jit, size);
+
+    C8Instr block[JIT_MAX_LENGTH];
+    JitFrame frame = {0};
+    int uses[17] = {0};
+    uint16_t pc = addr;
+    int length = 0;
+    bool ends = false;
+
+    while (!ends && length < JIT_MAX_LENGTH && pc < size - 1) {
+        C8Instr *in = &block[length];
+        decode(*ram_at(vm, pc) << 8 | *ram_at(vm, pc + 1), vm->quirks, in);
+
+        // Skips are translated for a 2-byte next instruction, which is
+        // covered as well so that overwriting it with F000 drops the block
+        bool skips = is_skip(in->op) && pc + 3 < size;
+        if (is_skip(in->op) && (!skips || long_instr(vm, vm->quirks, pc + 2)))
+            break;
+        uint32_t read, written;
+        if (!jit_registers(in, vm->quirks, &read, &written)) break;
+        frame.read |= read & ~frame.written;
+        frame.written |= written;
+        for (int n = 0; n < 17; n++)
+            uses[n] += (read | written) >> n & 1;
+
+        jit->covered[pc] = jit->covered[pc + 1] = 1;
+        if (skips) jit->covered[pc + 2] = jit->covered[pc + 3] = 1;
+        ends = skips || in->op == OP_1nnn;
+        length++;
+        pc += 2;
+    }
+
+    if (length == 0) {
+        jit->offset[addr] = JIT_NONE;
+        jit->covered[addr] = 1;
+        if (addr < size - 1) jit->covered[addr + 1] = 1;
+        return;
+    }
+
+    uint32_t start = jit->code_used;
+    allocate_registers(&frame, uses);
+    emit_entry(jit, &frame);
+    for (int n = 0; n < length; n++)
+        translate_instr(jit, &frame, vm->quirks, &block[n]);
+    emit_exit(jit, &frame);
+
+    const C8Instr *last = &block[length - 1];
+    if (last->op == OP_1nnn) {
+        emit_mov_rm16_imm16(jit, MEM(PC_), last->nnn);
+    } else if (is_skip(last->op)) {
+        bool eq = last->op == OP_3xkk || last->op == OP_5xy0;
+        emit_skip(jit, eq ? JNE : JE, pc);
+    } else {
+        emit_mov_rm16_imm16(jit, MEM(PC_), pc);
+    }
+    emit_mov_rm16_imm16(jit, MEM(OPCODE_), last->opcode);
+    emit(jit, 1, (const uint8_t[]){0xC3});  // ret
+
+    jit->offset[addr] = start + 1;
+    jit->length[addr] = length;
+    jit->blocks++;
+}
+
+static void
+invalidate_jit(Chip8 *vm, int addr, int len)
+{
+    if (!vm->jit) return;
+
+    int end = addr + len < RAM_SIZE ? addr + len : RAM_SIZE;
+    for (int i = addr; i < end; i++) {
+        if (vm->jit->covered[i]) {
+            flush_jit(vm->jit, c8_memory_size(vm));
+            return;
+        }
+    }
+}
+
+int
+c8_attach_jit(Chip8 *vm, C8Jit *jit, void *code, uint32_t code_size,
+              C8Protect protect)
+{
+    vm->jit = jit;
+    if (!jit) return 0;
+
+    ASSERT(protect);
+    *jit = (C8Jit){
+        .code = code,
+        .code_size = code_size,
+        .protect = protect,
+    };
+    flush_jit(jit, RAM_SIZE);
+    jit->flushes = 0;
+    return 0;
+}
+
+// Makes the code executable or writable, if it isn't already.
+// Returns false if the host couldn't change it.
+static bool
+protect_jit(C8Jit *jit, bool exec)
+{
+    if (jit->executable == exec) return true;
+    if (jit->protect(jit->code, jit->code_size, exec) != 0) return false;
+    jit->executable = exec;
+    return true;
+}
+
+// Same as c8_cycle(), but runs translated blocks whenever the remaining
+// budget allows it, and interprets everything else
+static int
+cycle_jit(Chip8 *vm)
+{
+    C8Jit *jit = vm->jit;
+    int i = 0;
+
+    while (i < vm->IPF) {
+        uint16_t pc = vm->PC;
+        if (pc < c8_memory_size(vm) - 1) {
+            if (jit->offset[pc] == 0 && protect_jit(jit, false))
+                translate_block(vm, pc);
+
+            // Not translated yet if the code couldn't be made writable
+            uint32_t offset = jit->offset[pc];
+            int length = jit->length[pc];
+            if (offset != 0 && offset != JIT_NONE && length <= vm->IPF - i &&
+                protect_jit(jit, true)) {
+                void (*block)(Chip8 *);
+                uint8_t *entry = &jit->code[offset - 1];
+                memcpy_(&block, &entry, sizeof(block));
+                block(vm);
+                i += length;
+#ifdef C8_PROFILE
+                profile_block(vm, pc, length);
+#endif
+
+                // Blocks end with a jump back when they close a loop
+                if (vm->PC < pc + 2 * length) {
+                    int len = idle_loop(vm);
+                    if (len > 0) i += skip_idle(vm, len, vm->IPF - i);
+                }
+                continue;
+            }
+        }
+
+        int len = step(vm);
+        if (len < 0) return -1;
+        i++;
+        if (len > 0) i += skip_idle(vm, len, vm->IPF - i);
+    }
+
+    return 0;
+}
+
+#else
+
+static void
+invalidate_jit(Chip8 *vm, int addr, int len)
+{
+    (void) vm, (void) addr, (void) len;
+}
+
+int
+c8_attach_jit(Chip8 *vm, C8Jit *jit, void *code, uint32_t code_size,
+              C8Protect protect)
+{
+    (void) jit, (void) code, (void) code_size, (void) protect;
+    vm->jit = NULL;
+    return -1;
+}
+
+#endif
+
+#ifdef C8_AOT
+
+// Ahead-of-time recompiled ROM
+//
+// chip8-aot (see aot.c) generates a C file that defines C8_AOT, includes
+// this file and then defines aot_program, so that the op_* helpers can be
+// inlined into the blocks. Blocks are straight-line runs of instructions
+// ending with a jump, a skip, a write to memory or anything else that
+// needs to be checked by the caller, and return the same as execute().
+
+typedef struct {
+    uint16_t start;
+    uint16_t end;    // Address right after the last instruction
+    uint8_t length;  // No. instructions
+    int (*run)(Chip8 *vm);
+} AotBlock;
+
+typedef struct {
+    const uint8_t *rom;  // ROM the blocks were compiled from
+    int rom_size;
+    uint8_t quirks;          // Quirks the blocks were compiled for
+    const AotBlock *blocks;  // Sorted by address
+    int count;
+} AotProgram;
+
+// Defined by the generated file
+static const AotProgram aot_program;
+
+// Enables the blocks whose code is still in RAM as it was compiled
+static void
+validate_aot(Chip8 *vm)
+{
+    if (!vm->aot) return;
+
+    const AotProgram *prog = &aot_program;
+    for (int b = 0; b < prog->count; b++) {
+        const AotBlock *block = &prog->blocks[b];
+        bool same = block->end <= PC_OFFSET + prog->rom_size;
+        for (int i = block->start; i < block->end && same; i++)
+            same = *ram_at(vm, i) == prog->rom[i - PC_OFFSET];
+        vm->aot->block[block->start] = same ? b + 1 : 0;
+    }
+}
+
+static void
+invalidate_aot(Chip8 *vm, int addr, int len)
+{
+    if (!vm->aot) return;
+
+    // Blocks starting up to C8_AOT_MAX_LENGTH instructions earlier overlap
+    int start = addr - 2 * C8_AOT_MAX_LENGTH + 1;
+    int end = addr + len < RAM_SIZE ? addr + len : RAM_SIZE;
+    for (int i = start > 0 ? start : 0; i < end; i++) {
+        int b = vm->aot->block[i];
+        if (b > 0 && aot_program.blocks[b - 1].end > addr)
+            vm->aot->block[i] = 0;
+    }
+}
+
+int
+c8_attach_aot(Chip8 *vm, C8Aot *aot)
+{
+    vm->aot = NULL;
+    if (!aot) return 0;
+
+    const AotProgram *prog = &aot_program;
+    bool same = vm->rom && vm->rom_size == prog->rom_size &&
+                vm->quirks == prog->quirks;
+    for (int i = 0; i < prog->rom_size && same; i++)
+        same = vm->rom[i] == prog->rom[i];
+    if (!same) return -1;
+
+    *aot = (C8Aot){0};
+    vm->aot = aot;
+    validate_aot(vm);
+    return 0;
+}
+
+// Same as c8_cycle(), but runs recompiled blocks whenever the remaining
+// budget allows it, and interprets everything else
+static int
+cycle_aot(Chip8 *vm)
+{
+    C8Aot *aot = vm->aot;
+    int i = 0;
+
+    while (i < vm->IPF) {
+        uint16_t pc = vm->PC;
+        int b = aot->block[pc];
+        int len;
+
+        if (b > 0 && aot_program.blocks[b - 1].length <= vm->IPF - i) {
+            const AotBlock *block = &aot_program.blocks[b - 1];
+            len = block->run(vm);
+            i += block->length;
+            aot->native += block->length;
+#ifdef C8_PROFILE
+            profile_block(vm, pc, block->length);
+#endif
+        } else {
+            len = step(vm);
+            if (len < 0) return -1;
+            i++;
+            aot->interpreted++;
+        }
+
+        if (len > 0) i += skip_idle(vm, len, vm->IPF - i);
+    }
+
+    return 0;
+}
+
+#else
+
+static void
+validate_aot(Chip8 *vm)
+{
+    (void) vm;
+}
+
+static void
+invalidate_aot(Chip8 *vm, int addr, int len)
+{
+    (void) vm, (void) addr, (void) len;
+}
+
+int
+c8_attach_aot(Chip8 *vm, C8Aot *aot)
+{
+    vm->aot = NULL;
+    return aot ? -1 : 0;
+}
+
+#endif
+
+// RAM[addr, addr + len) was overwritten, drop any code derived from it
+static void
+invalidate_code(Chip8 *vm, int addr, int len)
+{
+    // Writes past the end of the memory in use wrap around
+    int size = c8_memory_size(vm);
+    addr &= size - 1;
+    if (addr + len > size) {
+        invalidate_code(vm, 0, addr + len - size);
+        len = size - addr;
+    }
+    invalidate_cache(vm, addr, len);
+    invalidate_jit(vm, addr, len);
+    invalidate_aot(vm, addr, len);
+}
+
+// Same as c8_cycle(), without the cache or the translator
+static ALWAYS_INLINE int
+cycle_switch(Chip8 *vm, unsigned quirks)
+{
+    for (int i = 0; i < vm->IPF; i++) {
+        // Fetch (an instruction is 2 bytes long)
+        vm->opcode = fetch(vm, quirks);
+        vm->PC += 2;
+
+        int len = decode_and_execute(vm, quirks);
+        if (len < 0) return -1;
+        if (len > 0) i += skip_idle(vm, len, vm->IPF - i - 1);
+    }
+
+    return 0;
+}
+
+// Interpreters specialized for the quirks of each platform: the quirks are a
+// constant in each copy of cycle_switch() and cycle_cached(), so that the
+// ambiguous instructions don't test them. Any other combination of quirks
+// runs on the generic copy, which reads them from the VM.
+#define SPECIALIZED(X)                \
+    X(chip8, C8_QUIRKS_CHIP8)         \
+    X(schip_1_0, C8_QUIRKS_SCHIP_1_0) \
+    X(schip_1_1, C8_QUIRKS_SCHIP_1_1) \
+    X(xochip, C8_QUIRKS_XOCHIP)
+#define INTERPRETERS(X) SPECIALIZED(X) X(generic, vm->quirks)
+
+#ifdef C8_THREADED
+
+// Labels as values are a GNU extension
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+#define CYCLE_THREADED cycle_threaded_chip8
+#define QUIRKS C8_QUIRKS_CHIP8
+#include "chip8_threaded.inc"
+
+#define CYCLE_THREADED cycle_threaded_schip_1_0
+#define QUIRKS C8_QUIRKS_SCHIP_1_0
+#include "chip8_threaded.inc"
+
+#define CYCLE_THREADED cycle_threaded_schip_1_1
+#define QUIRKS C8_QUIRKS_SCHIP_1_1
+#include "chip8_threaded.inc"
+
+#define CYCLE_THREADED cycle_threaded_xochip
+#define QUIRKS C8_QUIRKS_XOCHIP
+#include "chip8_threaded.inc"
+
+#define CYCLE_THREADED cycle_threaded_generic
+#define QUIRKS vm->quirks
+#include "chip8_threaded.inc"
+
+#pragma GCC diagnostic pop
+
+#define CYCLE(name) cycle_threaded_##name
+#else
+#define CYCLE(name) cycle_switch_##name
+#define DEFINE_SWITCH(name, quirks)       \
+    static int cycle_switch_##name(Chip8 *vm) \
+    {                                         \
+        return cycle_switch(vm, quirks);      \
+    }
+INTERPRETERS(DEFINE_SWITCH)
+#endif
+
+#define DEFINE_CACHED(name, quirks)          \
+    static int cycle_cached_##name(Chip8 *vm) \
+    {                                        \
+        return cycle_cached(vm, quirks);     \
+    }
+INTERPRETERS(DEFINE_CACHED)
+
+typedef struct {
+    int (*cycle)(Chip8 *vm);
+    int (*cycle_cached)(Chip8 *vm);
+} Interpreter;
+
+#define INTERPRETER(name, quirks) {CYCLE(name), cycle_cached_##name},
+static const Interpreter interpreters[] = {INTERPRETERS(INTERPRETER)};
+
+// Returns the index in interpreters of the one to run the given quirks on
+static uint8_t
+select_interpreter(uint8_t quirks)
+{
+#define QUIRKS_OF(name, quirks) quirks,
+    static const uint8_t specialized[] = {SPECIALIZED(QUIRKS_OF)};
+    uint8_t i = 0;
+    while (i < sizeof(specialized) && specialized[i] != quirks)
+        i++;
+    return i;
+}
+
+int
+c8_cycle(Chip8 *vm)
+{
+    vm->screen_updated = false;
+    vm->dirty_rows = 0;
+    vm->idle = false;
+    vm->skipped = 0;
+
+#ifdef C8_AOT
+    if (vm->aot && vm->quirks == aot_program.quirks) return cycle_aot(vm);
+#endif
+#if C8_JIT_SUPPORTED
+    if (vm->jit) return cycle_jit(vm);
+#endif
+    const Interpreter *interp = &interpreters[vm->interpreter];
+    return vm->cache ? interp->cycle_cached(vm) : interp->cycle(vm);
+}
+
+// Copy the registers of a lane from its VM to the batch
+static void
+gather_lane(C8Batch *b, int lane)
+{
+    Chip8 *vm = &b->vm[lane];
+    for (int i = 0; i < 16; i++)
+        b->V[i][lane] = vm->V[i];
+    b->I[lane] = vm->I;
+    b->PC[lane] = vm->PC;
+    b->DT[lane] = vm->DT;
+    b->ST[lane] = vm->ST;
+    b->opcode[lane] = vm->opcode;
+    b->rng[lane] = vm->rng;
+}
+
+// Copy the registers of a lane from the batch back to its VM
+static void
+scatter_lane(C8Batch *b, int lane)
+{
+    Chip8 *vm = &b->vm[lane];
+    for (int i = 0; i < 16; i++)
+        vm->V[i] = b->V[i][lane];
+    vm->I = b->I[lane];
+    vm->PC = b->PC[lane];
+    vm->DT = b->DT[lane];
+    vm->ST = b->ST[lane];
+    vm->opcode = b->opcode[lane];
+    vm->rng = b->rng[lane];
+}
+
+// Returns true if every lane is about to execute the same opcode
+static bool
+converged(C8Batch *b, uint16_t *opcode)
+{
+    uint16_t pc = b->PC[0];
+    for (int lane = 1; lane < b->lanes; lane++)
+        if (b->PC[lane] != pc) return false;
+
+    unsigned mask = ram_mask(b->vm[0].quirks);
+    uint8_t hi = *ram_at(&b->vm[0], pc & mask);
+    uint8_t lo = *ram_at(&b->vm[0], (pc + 1) & mask);
+    for (int lane = 1; lane < b->lanes; lane++) {
+        if (*ram_at(&b->vm[lane], pc & mask) != hi) return false;
+        if (*ram_at(&b->vm[lane], (pc + 1) & mask) != lo) return false;
+    }
+
+    *opcode = hi << 8 | lo;
+    return true;
+}
+
+// Does a lane have F000 nnnn right after PC? Skipping it takes 4 bytes.
+static bool
+long_next(C8Batch *b)
+{
+    for (int lane = 0; lane < b->lanes; lane++)
+        if (long_instr(&b->vm[lane], b->vm[0].quirks, b->PC[lane] + 2))
+            return true;
+    return false;
+}
+
+// Execute an instruction on every lane at once, returns false if the
+// instruction can only be executed lane by lane. Loops run over all
+// C8_BATCH_LANES lanes, in use or not, so that they can be vectorized.
+static bool
+execute_lanes(C8Batch *b, const C8Instr *in)
+{
+    uint8_t *vx = b->V[in->x];
+    uint8_t *vy = b->V[in->y];
+    uint8_t *vf = b->V[0xF];
+    uint8_t kk = in->kk;
+    uint16_t nnn = in->nnn;
+
+    switch (in->op) {
+    case OP_0nnn:
+    case OP_1nnn:
+    case OP_3xkk:
+    case OP_4xkk:
+    case OP_5xy0:
+    case OP_6xkk:
+    case OP_7xkk:
+    case OP_8xy0:
+    case OP_8xy1:
+    case OP_8xy2:
+    case OP_8xy3:
+    case OP_8xy4:
+    case OP_8xy5:
+    case OP_8xy6:
+    case OP_8xy7:
+    case OP_8xyE:
+    case OP_9xy0:
+    case OP_Annn:
+    case OP_Bnnn:
+    case OP_Cxkk:
+    case OP_Ex9E:
+    case OP_ExA1:
+    case OP_Fx07:
+    case OP_Fx15:
+    case OP_Fx18:
+    case OP_Fx1E:
+    case OP_Fx29:
+    case OP_Fx30:
+        break;
+
+    default:
+        return false;
+    }
+
+    // Lanes skip F000 nnnn on their own
+    if (is_skip(in->op) && long_next(b)) return false;
+
+    for (int l = 0; l < C8_BATCH_LANES; l++) {
+        b->opcode[l] = in->opcode;
+        b->PC[l] += 2;
+    }
+
+    // Same semantics as the op_* functions
+    unsigned quirks = b->vm[0].quirks;
+    switch (in->op) {
+    case OP_0nnn:
         break;
 
-    case 0xA000:
-        // LD I, addr (Annn)
-        vm->I = nnn;
+    case OP_1nnn:
+        for (int l = 0; l < C8_BATCH_LANES; l++)
+            b->PC[l] = nnn;
         break;
 
-    case 0xB000:
-        // JP V0, addr (Bnnn) - Ambiguous instruction
-        if (vm->platform == P_SCHIP_1_0 || vm->platform == P_SCHIP_1_1)
-            vm->PC = vm->V[x] + nnn;
-        else
-            vm->PC = vm->V[0x0] + nnn;
+    case OP_3xkk:
+        for (int l = 0; l < C8_BATCH_LANES; l++)
+            b->PC[l] += (vx[l] == kk) ? 2 : 0;
         break;
 
-    case 0xC000:;
-        // RND Vx, byte (Cxkk)
-        vm->V[x] = rand_byte(&vm->rng) & kk;
+    case OP_4xkk:
+        for (int l = 0; l < C8_BATCH_LANES; l++)
+            b->PC[l] += (vx[l] != kk) ? 2 : 0;
         break;
 
-    case 0xD000:
-        if (vm->hi_res && n == 0) {
-            // DRW Vx, Vy, 0 (Dxy0) - S-CHIP
-            op_Dxy0(vm, x, y, n);
-        } else {
-            // DRW Vx, Vy, nibble (Dxyn)
-            op_Dxyn(vm, x, y, n);
-        }
-        vm->screen_updated = true;
+    case OP_5xy0:
+        for (int l = 0; l < C8_BATCH_LANES; l++)
+            b->PC[l] += (vx[l] == vy[l]) ? 2 : 0;
         break;
-    case 0xE000:
-        switch (vm->opcode & 0x00FF) {
-        case 0x009E:
-            // SKP Vx (Ex9E)
-            if (vm->keypad[vm->V[x]]) vm->PC += 2;
-            break;
 
-        case 0x00A1:
-            // SKNP Vx (ExA1)
-            if (!vm->keypad[vm->V[x]]) vm->PC += 2;
-            break;
+    case OP_6xkk:
+        for (int l = 0; l < C8_BATCH_LANES; l++)
+            vx[l] = kk;
+        break;
 
-        default:
-            return -1;  // Unknown opcode
+    case OP_7xkk:
+        for (int l = 0; l < C8_BATCH_LANES; l++)
+            vx[l] += kk;
+        break;
+
+    case OP_8xy0:
+        for (int l = 0; l < C8_BATCH_LANES; l++)
+            vx[l] = vy[l];
+        break;
+
+    case OP_8xy1:
+        for (int l = 0; l < C8_BATCH_LANES; l++)
+            vx[l] |= vy[l];
+        if (quirks & C8_QUIRK_VF_RESET)
+            memset_(vf, 0, C8_BATCH_LANES);
+        break;
+
+    case OP_8xy2:
+        for (int l = 0; l < C8_BATCH_LANES; l++)
+            vx[l] &= vy[l];
+        if (quirks & C8_QUIRK_VF_RESET)
+            memset_(vf, 0, C8_BATCH_LANES);
+        break;
+
+    case OP_8xy3:
+        for (int l = 0; l < C8_BATCH_LANES; l++)
+            vx[l] ^= vy[l];
+        if (quirks & C8_QUIRK_VF_RESET)
+            memset_(vf, 0, C8_BATCH_LANES);
+        break;
+
+    case OP_8xy4:
+        for (int l = 0; l < C8_BATCH_LANES; l++) {
+            uint8_t carry = (vx[l] + vy[l]) > 255;
+            vx[l] += vy[l];
+            vf[l] = carry;
         }
         break;
 
-    case 0xF000:
-        switch (vm->opcode & 0x00FF) {
-        case 0x0007:
-            // LD Vx, DT (Fx07)
-            vm->V[x] = vm->DT;
-            break;
+    case OP_8xy5:
+        for (int l = 0; l < C8_BATCH_LANES; l++) {
+            uint8_t not_borrow = vx[l] > vy[l];
+            vx[l] -= vy[l];
+            vf[l] = not_borrow;
+        }
+        break;
 
-        case 0x000A:
-            // LD Vx, K (Fx0A)
-            op_Fx0A(vm, x);
-            break;
+    case OP_8xy6:
+        for (int l = 0; l < C8_BATCH_LANES; l++) {
+            uint8_t value = (quirks & C8_QUIRK_SHIFT) ? vx[l] : vy[l];
+            vx[l] = value >> 1;
+            vf[l] = value & 0x01;
+        }
+        break;
 
-        case 0x0015:
-            // LD DT, Vx (Fx15)
-            vm->DT = vm->V[x];
-            break;
+    case OP_8xy7:
+        for (int l = 0; l < C8_BATCH_LANES; l++) {
+            uint8_t not_borrow = vy[l] > vx[l];
+            vx[l] = vy[l] - vx[l];
+            vf[l] = not_borrow;
+        }
+        break;
 
-        case 0x0018:
-            // LD ST, Vx (Fx18)
-            vm->ST = vm->V[x];
-            break;
+    case OP_8xyE:
+        for (int l = 0; l < C8_BATCH_LANES; l++) {
+            uint8_t value = (quirks & C8_QUIRK_SHIFT) ? vx[l] : vy[l];
+            vx[l] = value << 1;
+            vf[l] = value >> 7;
+        }
+        break;
 
-        case 0x001E:
-            // ADD I, Vx (Fx1E)
-            vm->I += vm->V[x];
-            break;
+    case OP_9xy0:
+        for (int l = 0; l < C8_BATCH_LANES; l++)
+            b->PC[l] += (vx[l] != vy[l]) ? 2 : 0;
+        break;
 
-        case 0x0029:
-            // LD F, Vx (Fx29)
-            // A font sprite is 5 bytes long
-            vm->I = FONT_OFFSET + (vm->V[x] * 5);
-            break;
+    case OP_Annn:
+        for (int l = 0; l < C8_BATCH_LANES; l++)
+            b->I[l] = nnn;
+        break;
 
-        case 0x0030:
-            // LD HF, Vx (Fx30) - S-CHIP
-            // An hi-res font sprite is 10 bytes long
-            vm->I = HFONT_OFFSET + (vm->V[x] * 10);
-            break;
+    case OP_Bnnn:
+        if (!(quirks & C8_QUIRK_JUMP)) vx = b->V[0x0];
+        for (int l = 0; l < C8_BATCH_LANES; l++)
+            b->PC[l] = vx[l] + nnn;
+        break;
 
-        case 0x0033:
-            // LD B, Vx (Fx33)
-            vm->RAM[vm->I + 0] = (vm->V[x] / 100) % 10;
-            vm->RAM[vm->I + 1] = (vm->V[x] / 10) % 10;
-            vm->RAM[vm->I + 2] = (vm->V[x] / 1) % 10;
-            break;
+    case OP_Cxkk:
+        for (int l = 0; l < C8_BATCH_LANES; l++)
+            vx[l] = rand_byte(&b->rng[l]) & kk;
+        break;
 
-        case 0x0055:
-            // LD [I], Vx (Fx55) - Ambiguous instruction
-            for (int i = 0; i <= x; i++)
-                vm->RAM[vm->I + i] = vm->V[i];
+    case OP_Ex9E:
+        for (int l = 0; l < b->lanes; l++)
+            b->PC[l] += b->vm[l].keypad[vx[l]] ? 2 : 0;
+        break;
 
-            if (vm->platform == P_CHIP8) vm->I += (x + 1);
-            if (vm->platform == P_SCHIP_1_0) vm->I += x;
-            break;
+    case OP_ExA1:
+        for (int l = 0; l < b->lanes; l++)
+            b->PC[l] += b->vm[l].keypad[vx[l]] ? 0 : 2;
+        break;
 
-        case 0x0065:
-            // LD Vx, [I] (Fx65) - Ambiguous instruction
-            for (int i = 0; i <= x; i++)
-                vm->V[i] = vm->RAM[vm->I + i];
+    case OP_Fx07:
+        for (int l = 0; l < C8_BATCH_LANES; l++)
+            vx[l] = b->DT[l];
+        break;
 
-            if (vm->platform == P_CHIP8) vm->I += (x + 1);
-            if (vm->platform == P_SCHIP_1_0) vm->I += x;
-            break;
+    case OP_Fx15:
+        for (int l = 0; l < C8_BATCH_LANES; l++)
+            b->DT[l] = vx[l];
+        break;
 
-        case 0x0075:
-            // LD R, Vx (Fx75) - S-CHIP
-            ASSERT(x <= 7);
-            memcpy_(vm->hp48_flags, vm->V, x + 1);
-            break;
+    case OP_Fx18:
+        for (int l = 0; l < C8_BATCH_LANES; l++)
+            b->ST[l] = vx[l];
+        break;
 
-        case 0x0085:
-            // LD Vx, R (Fx85) - S-CHIP
-            ASSERT(x <= 7);
-            memcpy_(vm->V, vm->hp48_flags, x + 1);
-            break;
+    case OP_Fx1E:
+        for (int l = 0; l < C8_BATCH_LANES; l++)
+            b->I[l] += vx[l];
+        break;
 
-        default:
-            return -1;  // Unknown opcode
-        }
+    case OP_Fx29:
+        // A font sprite is 5 bytes long
+        for (int l = 0; l < C8_BATCH_LANES; l++)
+            b->I[l] = FONT_OFFSET + vx[l] * 5;
         break;
 
-    default:
-        return -1;  // Unknown opcode
+    case OP_Fx30:
+        // An hi-res font sprite is 10 bytes long
+        for (int l = 0; l < C8_BATCH_LANES; l++)
+            b->I[l] = HFONT_OFFSET + vx[l] * 10;
+        break;
     }
 
-    return 0;
+    return true;
+}
+
+// Same as idle_loop() for every lane, after they all jumped back together.
+// The loop can only be skipped if every lane is idle, in the same loop.
+// Every lane is checked even once that fails, so that each of them backs
+// off busy loops as it would running on its own.
+// Returns the no. instructions skipped.
+static int
+skip_idle_lanes(C8Batch *b, int left)
+{
+    int len = 0;
+    for (int lane = 0; lane < b->lanes; lane++) {
+        scatter_lane(b, lane);
+        int n = idle_loop(&b->vm[lane]);
+        if (lane == 0)
+            len = n;
+        else if (n != len)
+            len = 0;
+    }
+    if (len == 0) return 0;
+
+    for (int lane = 0; lane < b->lanes; lane++)
+        skip_idle(&b->vm[lane], len, left);
+    return left - left % len;
+}
+
+void
+c8_batch_init(C8Batch *batch, Chip8 *lanes, int n)
+{
+    ASSERT(n > 0 && n <= C8_BATCH_LANES);
+    *batch = (C8Batch){
+        .vm = lanes,
+        .lanes = n,
+    };
 }
 
 int
-c8_cycle(Chip8 *vm)
+c8_batch_cycle(C8Batch *b)
 {
-    vm->screen_updated = false;
+    int IPF = b->vm[0].IPF;
+    b->failed = 0;
 
-    for (int i = 0; i < vm->IPF; i++) {
-        // Fetch (an instruction is 2 bytes long)
-        vm->opcode = (vm->RAM[vm->PC] << 8) | vm->RAM[vm->PC + 1];
-        vm->PC += 2;
+    // Each lane stops for the frame at its first sprite, so they don't stay
+    // in lockstep for long when waiting for the display
+    if (b->vm[0].quirks & C8_QUIRK_DISPLAY_WAIT) {
+        for (int lane = 0; lane < b->lanes; lane++)
+            if (c8_cycle(&b->vm[lane]) != 0) b->failed |= 1u << lane;
+        b->serial += IPF;
+        return b->failed ? -1 : 0;
+    }
 
-        if (decode_and_execute(vm) != 0) return -1;
+    for (int lane = 0; lane < b->lanes; lane++) {
+        ASSERT(b->vm[lane].IPF == IPF);
+        ASSERT(b->vm[lane].quirks == b->vm[0].quirks);
+        b->vm[lane].screen_updated = false;
+        b->vm[lane].dirty_rows = 0;
+        b->vm[lane].idle = false;
+        b->vm[lane].skipped = 0;
+        gather_lane(b, lane);
     }
 
-    return 0;
+    // No. instructions to run lane by lane before trying to execute them
+    // all at once again, doubled every time it isn't possible
+    int run = 1;
+
+    for (int i = 0; i < IPF;) {
+        C8Instr in;
+        uint16_t opcode;
+
+        if (b->failed == 0 && converged(b, &opcode)) {
+            uint16_t pc = b->PC[0];
+            decode(opcode, b->vm[0].quirks, &in);
+            if (execute_lanes(b, &in)) {
+#ifdef C8_PROFILE
+                for (int lane = 0; lane < b->lanes; lane++)
+                    profile_count(&b->vm[lane], in.op, pc);
+#endif
+                b->lockstep++;
+                run = 1;
+                i++;
+                if (in.op == OP_1nnn && in.nnn <= pc)
+                    i += skip_idle_lanes(b, IPF - i);
+                continue;
+            }
+        }
+
+        int n = (run < IPF - i) ? run : IPF - i;
+        run *= 2;
+
+        // Lanes have diverged, or the instruction touches memory or the
+        // screen: run the interpreter on each lane that is still running
+        for (int lane = 0; lane < b->lanes; lane++) {
+            if (b->failed & (1u << lane)) continue;
+            scatter_lane(b, lane);
+            for (int j = 0; j < n; j++) {
+                int len = step(&b->vm[lane]);
+                if (len < 0) {
+                    b->failed |= 1u << lane;
+                    break;
+                }
+                if (len > 0) j += skip_idle(&b->vm[lane], len, n - j - 1);
+            }
+            gather_lane(b, lane);
+        }
+        b->serial += n;
+        i += n;
+    }
+
+    for (int lane = 0; lane < b->lanes; lane++)
+        scatter_lane(b, lane);
+
+    return b->failed ? -1 : 0;
 }
@@ -8,8 +8,12 @@
 #define GAME_LOOP_DELAY 16.666
 #define GAME_LOOP_FREQ 60
 
-#define RAM_SIZE 4096
-#define MAX_ROM_SIZE 3584  // RAM_SIZE - PC_OFFSET
+#define RAM_SIZE 65536           // XO-CHIP (see c8_memory_size())
+#define MAX_ROM_SIZE 65024       // RAM_SIZE - PC_OFFSET
+#define CHIP8_RAM_SIZE 4096      // CHIP-8 and S-CHIP
+#define CHIP8_MAX_ROM_SIZE 3584  // CHIP8_RAM_SIZE - PC_OFFSET
+#define XO_RAM_SIZE 61440        // RAM_SIZE - CHIP8_RAM_SIZE (see
+                                 // c8_attach_xo_ram())
 
 #define FONT_OFFSET 0x50
 #define HFONT_OFFSET 0xA0
@@ -18,6 +22,7 @@
 #define SCREEN_WIDTH 128
 #define SCREEN_HEIGHT 64
 #define SCREEN_SIZE 1024  // 128x64 pixels = 8192 bits = 1024 bytes
+#define C8_PLANES 2       // Bitplanes, only XO-CHIP draws on the second one
 
 #define KEYPAD_SIZE 16
 
@@ -25,10 +30,120 @@ typedef enum {
     P_CHIP8,      // Enable "modern" CHIP-8 behavior
     P_SCHIP_1_0,  // Enable CHIP-48/S-CHIP 1.0 behavior
     P_SCHIP_1_1,  // Enable S-CHIP 1.1 behavior
+    P_XOCHIP,     // Enable XO-CHIP behavior
 } Platform;
 
+// Behaviors of the ambiguous instructions (see notes/quirks.txt), one bit
+// each. A platform sets its own combination, any other can be set on top.
+enum {
+    C8_QUIRK_SHIFT = 1 << 0,         // 8xy6 and 8xyE shift Vx, not Vy
+    C8_QUIRK_JUMP = 1 << 1,          // Bxnn jumps to xnn + Vx, not nnn + V0
+    C8_QUIRK_LOAD_STORE_X = 1 << 2,  // Fx55 and Fx65 add x to I...
+    C8_QUIRK_LOAD_STORE_0 = 1 << 3,  // ...or leave it unchanged
+    C8_QUIRK_VF_RESET = 1 << 4,      // 8xy1, 8xy2 and 8xy3 clear VF
+    C8_QUIRK_DISPLAY_WAIT = 1 << 5,  // Dxyn waits for the next frame
+    C8_QUIRK_WRAP = 1 << 6,          // Sprites wrap around the screen edges
+    C8_QUIRK_XO = 1 << 7,            // XO-CHIP instructions (see quirks.txt)
+    C8_QUIRKS = 8,                   // No. quirks
+};
+
+#define C8_QUIRKS_CHIP8 0
+#define C8_QUIRKS_SCHIP_1_0 \
+    (C8_QUIRK_SHIFT | C8_QUIRK_JUMP | C8_QUIRK_LOAD_STORE_X)
+#define C8_QUIRKS_SCHIP_1_1 \
+    (C8_QUIRK_SHIFT | C8_QUIRK_JUMP | C8_QUIRK_LOAD_STORE_0)
+#define C8_QUIRKS_XOCHIP (C8_QUIRK_WRAP | C8_QUIRK_XO)
+
+// Common sequences of instructions the predecoded cache can run as one
+// (see c8_set_fusion())
+typedef enum {
+    C8_FUSE_ANNN_DXYN,       // Point I to a sprite, draw it
+    C8_FUSE_7XKK_3XKK_1NNN,  // Count, compare, loop (same register)
+    C8_FUSE_6XKK_FX15,       // Arm the delay timer (same register)
+    C8_FUSE_FX29_DXYN,       // Point I to a digit, draw it
+    C8_FUSE_FX33_FX65,       // Store a number as BCD, load its digits
+    C8_FUSIONS,              // No. sequences
+} C8Fusion;
+
+// Predecoded instruction
+typedef struct {
+    uint16_t opcode;
+    uint16_t nnn;
+    uint8_t op;  // Instruction handler
+    uint8_t x;
+    uint8_t y;
+    uint8_t kk;     // n = kk & 0xF
+    uint8_t fused;  // C8Fusion + 1 of the sequence starting here, 0 if none
+} C8Instr;
+
+// Predecoded form of RAM, one entry per address (see c8_attach_cache())
+typedef struct {
+    C8Instr instr[RAM_SIZE];
+    bool fuse;                   // Are sequences fused? (see c8_set_fusion())
+    uint64_t fused[C8_FUSIONS];  // No. times each sequence ran fused
+} C8DecodeCache;
+
+// The x86-64 translator needs the System V calling convention
+#if defined(__x86_64__) && !defined(_WIN32)
+#define C8_JIT_SUPPORTED 1
+#else
+#define C8_JIT_SUPPORTED 0
+#endif
+
+// Makes the code memory of the translator executable and read-only if exec,
+// writable and not executable otherwise (see c8_attach_jit()).
+// Returns 0 on success.
+typedef int (*C8Protect)(void *code, uint32_t size, bool exec);
+
+// Translated basic blocks (see c8_attach_jit())
 typedef struct {
-    uint8_t RAM[RAM_SIZE];
+    uint8_t *code;  // Memory supplied by the host, writable when attached
+    uint32_t code_size;
+    uint32_t code_used;
+    C8Protect protect;
+    bool executable;  // Was code last made executable rather than writable?
+
+    uint32_t offset[RAM_SIZE];  // Offset + 1 of the block starting at PC
+    uint8_t length[RAM_SIZE];   // No. instructions in the block
+    uint8_t covered[RAM_SIZE];  // Was the byte translated?
+
+    uint32_t blocks;   // No. blocks translated
+    uint32_t flushes;  // No. times all blocks were dropped
+} C8Jit;
+
+#define C8_AOT_MAX_LENGTH 64  // Instructions per recompiled block
+
+// Blocks of a ROM recompiled ahead of time (see c8_attach_aot())
+typedef struct {
+    uint16_t block[RAM_SIZE];  // Index + 1 of the block starting at PC
+    uint64_t native;           // No. instructions run as recompiled code...
+    uint64_t interpreted;      // ...and by the interpreter
+} C8Aot;
+
+#define C8_PROFILE_OPS 64  // Max. no. instruction classes
+
+// Instructions timed by the profiler
+typedef enum {
+    C8_TIME_DXYN,    // Dxyn, 8-pixel wide sprites
+    C8_TIME_DXY0,    // Dxy0, 16x16 sprites (S-CHIP)
+    C8_TIME_SCROLL,  // 00Cn, 00Dn, 00FB and 00FC (S-CHIP)
+    C8_TIMED_OPS,
+} C8TimedOp;
+
+// Execution counters (see c8_attach_profile())
+typedef struct {
+    uint64_t (*clock)(void);  // Host timer for the timed instructions
+
+    uint64_t op_count[C8_PROFILE_OPS];  // Per class (c8_profile_op_name())
+    uint64_t pc_count[RAM_SIZE];        // Per address
+    uint64_t skipped;                   // Instructions of idle loops skipped
+
+    uint64_t time[C8_TIMED_OPS];   // Clock ticks spent in the instruction
+    uint64_t calls[C8_TIMED_OPS];  // No. times it was timed
+} C8Profile;
+
+typedef struct {
+    uint8_t RAM[CHIP8_RAM_SIZE];  // The rest is in xo_ram
 
     uint16_t I;   // Index register
     uint16_t PC;  // Program counter
@@ -36,26 +151,126 @@ typedef struct {
     uint16_t stack[16];
     uint8_t SP;  // Stack pointer
 
-    uint8_t V[16];          // Variable registers
-    uint8_t hp48_flags[8];  // HP-48's "RPL user flag" registers (S-CHIP)
+    uint8_t V[16];           // Variable registers
+    uint8_t hp48_flags[16];  // HP-48's "RPL user flag" registers (S-CHIP 8,
+                             // XO-CHIP 16)
 
-    uint8_t screen[SCREEN_SIZE];
+    // Each plane has 128 pixels per row, MSB first
+    uint64_t screen[C8_PLANES][SCREEN_HEIGHT][2];
+    uint64_t lo_screen[C8_PLANES][SCREEN_HEIGHT / 2];  // 64 pixels, in lo-res
+    bool upscaled;   // Lo-res screen in screen[] rather than lo_screen[]?
+    uint8_t planes;  // Planes drawn, scrolled and cleared, bit N = plane N
     uint8_t keypad[KEYPAD_SIZE];
     uint8_t wait_for_key;
 
     uint8_t DT;  // Delay timer
     uint8_t ST;  // Sound timer
 
+    uint8_t pattern[16];  // 1-bit audio samples, MSB first (XO-CHIP)
+    bool has_pattern;     // Was a pattern loaded?
+    uint8_t pitch;        // Playback rate of the pattern
+
     uint16_t opcode;  // Current opcode
     uint64_t rng;     // PRNG state
     int IPF;          // No. instructions executed each frame
 
     bool hi_res;          // Enable 128x64 hi-res mode (S-CHIP)
     bool screen_updated;  // Was the screen updated?
-
-    Platform platform;  // CHIP-8, CHIP-48/S-CHIP 1.0 or S-CHIP 1.1 behavior?
+    uint64_t dirty_rows;  // Rows updated by c8_cycle(), one bit per row
+
+    bool idle;          // Did c8_cycle() end in an idle loop?
+    bool run_idle;      // Run idle loops rather than skip them?
+    int skipped;        // No. instructions skipped by c8_cycle()
+    uint16_t idle_pc;   // Last loop start that wasn't an idle loop...
+    uint8_t idle_wait;  // ...and no. jumps to it before checking it again
+
+    Platform platform;    // CHIP-8, CHIP-48/S-CHIP 1.0, S-CHIP 1.1 or XO-CHIP?
+    uint8_t quirks;       // C8_QUIRK_* flags, the platform's by default
+    uint8_t interpreter;  // Interpreter specialized for the quirks
+
+    C8DecodeCache *cache;  // Predecoded instructions (optional)
+    C8Jit *jit;            // Translated basic blocks (optional)
+    C8Aot *aot;            // Recompiled basic blocks (optional)
+    C8Profile *profile;    // Execution counters (optional)
+    uint8_t *xo_ram;       // Memory past 4 KB (XO-CHIP only)
+
+    const unsigned char *rom;  // Last ROM loaded, owned by the host
+    int rom_size;
+    uint32_t rom_hash;
 } Chip8;
 
+// Save states (see c8_save_state())
+#define C8_STATE_VERSION 4
+#define C8_STATE_HEADER_SIZE 116
+#define C8_STATE_MAX_SIZE                                           \
+    (C8_STATE_HEADER_SIZE + 2 * (RAM_SIZE + C8_PLANES * SCREEN_SIZE) + \
+     4 * (C8_PLANES + 1))
+
+// Largest uncompressed state stored for each frame by c8_rewind_push(), only
+// the memory and planes in use are stored (about 5 KB without XO-CHIP)
+#define C8_SNAPSHOT_SIZE (RAM_SIZE + C8_PLANES * SCREEN_SIZE + 112)
+
+// History of frames to step back through (see c8_rewind_push())
+typedef struct {
+    uint8_t *buf;   // Ring buffer supplied by the host
+    uint32_t size;  // Size of the ring buffer, the memory used never exceeds it
+    uint32_t head;  // Where the next frame goes
+    uint32_t tail;  // Oldest frame, always a keyframe
+    int interval;   // No. frames between keyframes
+
+    uint32_t used;        // No. bytes used
+    uint32_t frames;      // No. frames stored
+    uint32_t keyframes;   // No. frames stored whole
+    uint32_t since_key;   // No. frames since the last keyframe, included
+    uint32_t max_frame;   // Largest frame stored, in bytes
+    uint32_t frame_size;  // Uncompressed size of the frames stored
+
+    uint8_t snapshot[2][C8_SNAPSHOT_SIZE];  // Newest frame and next one
+    int cur;
+    uint8_t scratch[2 * C8_SNAPSHOT_SIZE];  // Encoded frame
+} C8Rewind;
+
+// Frame capture stream (see c8_capture_frame())
+#define C8_CAPTURE_VERSION 1
+#define C8_CAPTURE_HEADER_SIZE 8
+#define C8_CAPTURE_MAX_FRAME_SIZE (4 + 2 * C8_PLANES * SCREEN_SIZE)
+
+// Encoder or decoder of a frame capture stream
+typedef struct {
+    int planes;       // No. planes captured, 2 for XO-CHIP, 1 otherwise
+    uint32_t frames;  // No. frames captured or decoded
+    uint64_t screen[C8_PLANES][SCREEN_HEIGHT][2];  // Last frame, 128x64
+
+    // Lo-res planes of the last frame captured, if it was lo-res
+    uint64_t lo_screen[C8_PLANES][SCREEN_HEIGHT / 2];
+    bool lo;
+
+    uint8_t delta[C8_PLANES * SCREEN_SIZE];        // XOR with the last frame
+    uint8_t scratch[2 * C8_PLANES * SCREEN_SIZE];  // Encoded frame
+} C8Capture;
+
+#define C8_BATCH_LANES 16  // Max. no. VMs stepped together
+
+// Registers of a group of VMs running the same ROM, in struct-of-arrays form
+// so that an instruction executed by every VM is executed for all of them at
+// once (see c8_batch_cycle())
+typedef struct {
+    Chip8 *vm;  // Lanes: memory, stack, screen and keypad of each VM
+    int lanes;  // No. lanes in use
+
+    uint8_t V[16][C8_BATCH_LANES];
+    uint16_t I[C8_BATCH_LANES];
+    uint16_t PC[C8_BATCH_LANES];
+    uint8_t DT[C8_BATCH_LANES];
+    uint8_t ST[C8_BATCH_LANES];
+    uint16_t opcode[C8_BATCH_LANES];
+    uint64_t rng[C8_BATCH_LANES];
+
+    uint32_t failed;    // Lanes that hit an unknown opcode in the last frame
+    uint64_t lockstep;  // No. instructions executed by all lanes at once
+    uint64_t serial;    // No. instructions executed lane by lane
+} C8Batch;
+
 // Fully resets state of the emulator.
 void c8_reset(Chip8 *vm);
 
@@ -64,17 +279,146 @@ void c8_soft_reset(Chip8 *vm);
 
 // Fully resets emulator and initializes it
 // - emu_freq: frequency of the emulator (or its "speed")
-// - plt: CHIP-8, CHIP-48/S-CHIP 1.0 or S-CHIP 1.1 behavior?
+// - plt: CHIP-8, CHIP-48/S-CHIP 1.0, S-CHIP 1.1 or XO-CHIP behavior?
 // - seed: initial seed for the PRNG
 void c8_init(Chip8 *vm, int emu_freq, Platform plt, uint64_t seed);
 
+// Attaches the memory past the first 4 KB, which only XO-CHIP uses, to the
+// emulator: ram holds XO_RAM_SIZE bytes, and is cleared. NULL detaches it.
+// It must be attached after c8_init(), and before c8_load_rom() when
+// C8_QUIRK_XO is set, so that emulators that don't need it stay small.
+void c8_attach_xo_ram(Chip8 *vm, uint8_t *ram);
+
+// Attaches a predecoded instruction cache to the emulator, NULL detaches it.
+// Instructions are decoded the first time they are executed and stay
+// cached until Fx33, Fx55 or c8_load_rom() overwrite them.
+// The cache must be attached after c8_init() and outlive the emulator.
+void c8_attach_cache(Chip8 *vm, C8DecodeCache *cache);
+
+// Makes the attached cache run the common sequences of C8Fusion as single
+// instructions, or stop doing so. A sequence only runs fused when what's left
+// of the frame fits all of it, so instruction counts stay exact. Off by
+// default, and resets the counters of cache->fused.
+void c8_set_fusion(Chip8 *vm, bool on);
+
+// Attaches an x86-64 block translator to the emulator, NULL detaches it.
+// Straight-line runs of register and timer instructions (optionally ended
+// by a jump or a skip) are translated into code_size bytes of memory,
+// everything else runs through the interpreter (and through the predecoded
+// cache, if attached). Translated blocks are dropped when the memory they
+// were translated from is overwritten.
+// The code is never writable and executable at once: the host supplies it
+// writable, and protect switches it to executable before blocks run and
+// back before new ones are written (e.g. with mprotect()). If it fails, the
+// interpreter runs the instructions instead.
+// Returns -1 if the translator isn't supported on this host.
+int c8_attach_jit(Chip8 *vm, C8Jit *jit, void *code, uint32_t code_size,
+                  C8Protect protect);
+
+// Attaches the ROM recompiled by chip8-aot to the emulator, NULL detaches it.
+// chip8-aot turns the code it finds in a ROM into a C file with a function
+// per basic block, which is built in place of chip8.c. Blocks run whenever
+// the remaining budget allows it and the emulator has the quirks they were
+// compiled for, everything else runs through the interpreter (and through
+// the predecoded cache, if attached). Blocks are dropped when the memory
+// they were compiled from is overwritten, until the ROM is loaded again.
+// Takes precedence over the translator. Must be attached after loading the
+// ROM, returns -1 if no ROM was recompiled in, or another ROM or other quirks.
+int c8_attach_aot(Chip8 *vm, C8Aot *aot);
+
+// Attaches execution counters to the emulator, NULL detaches it.
+// Every instruction executed is counted by class and by address, by every
+// engine, and Dxyn, Dxy0 and the scroll instructions are timed with
+// prof->clock if it's set. The counters are only compiled in with
+// -DC8_PROFILE and cost nothing otherwise.
+// Returns -1 if the emulator was compiled without -DC8_PROFILE.
+int c8_attach_profile(Chip8 *vm, C8Profile *prof);
+
+// Returns the name of a class of instructions counted in prof->op_count,
+// such as "Dxyn", or NULL if there's no such class.
+const char *c8_profile_op_name(int op);
+
+// Stores the n most executed addresses in addr, most executed first.
+// Returns the no. addresses stored, fewer than n if fewer were executed.
+int c8_profile_hottest(C8Profile *prof, uint16_t *addr, int n);
+
 // Loads ROM into the memory of the emulator.
-// ASSERT: size <= 3584
+// The ROM isn't copied and must outlive the emulator if save states are used.
+// ASSERT: size <= c8_memory_size(vm) - PC_OFFSET (MAX_ROM_SIZE on XO-CHIP,
+// CHIP8_MAX_ROM_SIZE otherwise)
 void c8_load_rom(Chip8 *vm, unsigned char *rom, int size);
 
+// Saves the whole state of the emulator (except attachments) in buf, which
+// must be at least C8_STATE_MAX_SIZE bytes long. RAM is stored as a diff
+// against the loaded ROM, so states are usually well under 2 KB.
+// Returns the no. bytes written, or -1 if buf is too small.
+int c8_save_state(Chip8 *vm, uint8_t *buf, int size);
+
+// Restores a state saved by c8_save_state(). The emulator must have the same
+// ROM loaded, but can be a different one, so many runs can be forked from a
+// single state. Attached caches and translators are kept, only the code the
+// state overwrites is invalidated.
+// Returns -1 if the state is corrupt, from another version or another ROM,
+// or needs XO-CHIP memory that isn't attached, in which case the emulator is
+// left untouched.
+int c8_load_state(Chip8 *vm, const uint8_t *buf, int size);
+
 // Fetch-decode-execute N instructions, where N = vm->IPF.
 int c8_cycle(Chip8 *vm);
 
+// Groups lanes[0..n-1] into a batch, n <= C8_BATCH_LANES. The lanes must be
+// initialized and share the same frequency and quirks, the batch doesn't
+// copy them and they can be accessed with the usual functions between frames.
+void c8_batch_init(C8Batch *batch, Chip8 *lanes, int n);
+
+// Runs c8_cycle() on every lane of the batch. As long as all lanes are at
+// the same address, register, timer and jump instructions are executed for
+// all of them at once, any other instruction runs on each lane separately.
+// Each lane ends up in the state c8_cycle() would have left it in.
+// Returns -1 if a lane encountered an unknown opcode (see batch->failed).
+int c8_batch_cycle(C8Batch *batch);
+
+// Sets up a rewind history in size bytes of host memory, with a keyframe
+// every interval frames.
+void c8_rewind_init(C8Rewind *rw, uint8_t *buf, uint32_t size, int interval);
+
+// Records the state of the emulator, meant to be called after every frame.
+// Each frame is stored as the XOR of its state and the previous frame's,
+// run-length encoded, or whole once every interval frames. The oldest
+// frames are dropped to make room, the cost per frame is proportional to
+// the memory in use (see c8_memory_size()). Changing it drops the history.
+// Returns -1 if buf can't even hold a single frame.
+int c8_rewind_push(C8Rewind *rw, Chip8 *vm);
+
+// Drops the newest frame and restores the one before it. The keypad and the
+// settings (frequency, platform) are left as they are.
+// Returns -1 if there's no older frame, or if the memory in use changed.
+int c8_rewind_pop(C8Rewind *rw, Chip8 *vm);
+
+// Starts capturing the screen of vm, scaled up to 128x64 like
+// c8_export_screen(), with both planes on XO-CHIP. Writes the header of the
+// stream to out and returns its size, C8_CAPTURE_HEADER_SIZE.
+int c8_capture_start(C8Capture *cap, Chip8 *vm, uint8_t *out);
+
+// Writes the record of the current frame to out, meant to be called after
+// every frame, and returns its size: the size of the payload as a varint,
+// then the XOR of the frame and the previous one (bytes of the planes in
+// the order of c8_screen_hash()), as runs of [no. unchanged bytes][no.
+// literal bytes] (varints) followed by the literals. A frame that didn't
+// change is a single 0 byte. Only the rows that changed cost more than a
+// compare, a frame takes well under a microsecond.
+// ASSERT: out holds C8_CAPTURE_MAX_FRAME_SIZE bytes
+int c8_capture_frame(C8Capture *cap, Chip8 *vm, uint8_t *out);
+
+// Starts decoding a stream from its header.
+// Returns -1 if it isn't a capture stream of this version.
+int c8_capture_open(C8Capture *cap, const uint8_t *in, int size);
+
+// Decodes the record at the start of in (size bytes) into cap->screen.
+// Returns the size of the record, 0 if in doesn't hold all of it, or -1 if
+// it's corrupt.
+int c8_capture_next(C8Capture *cap, const uint8_t *in, int size);
+
 // Decrement timers if they are non-zero.
 // This function should be called at a constant frequency of 60Hz.
 void c8_decrement_timers(Chip8 *vm);
@@ -82,20 +426,64 @@ void c8_decrement_timers(Chip8 *vm);
 // Returns true if sound timer is non-zero and sound should be played.
 bool c8_sound(Chip8 *vm);
 
+// Returns true if the sound is the audio pattern loaded by F002 (XO-CHIP)
+// rather than a plain tone. Its 128 1-bit samples (MSB first) are copied to
+// pattern, and loop at 4000 * 2^((pitch - 64) / 48) samples per second.
+bool c8_audio_pattern(Chip8 *vm, uint8_t pattern[16], int *pitch);
+
 // Returns true if one of the instructions executed by c8_cycle() modified
 // the screen, in which case the display should be updated.
 bool c8_screen_updated(Chip8 *vm);
 
+// Returns the rows of the 128x64 screen updated by c8_cycle(): bit N is set
+// if row N may have changed. Zero if the screen wasn't updated.
+uint64_t c8_dirty_rows(Chip8 *vm);
+
+// Returns true if c8_cycle() ended in an idle loop: a loop that only polls
+// the delay timer or the keypad (including Fx0A), which can't do anything
+// else until the next frame. The rest of such a loop is skipped, which
+// doesn't change the outcome, so the host can sleep until the next frame.
+bool c8_idle(Chip8 *vm);
+
+// Returns the no. instructions of the frame that c8_cycle() skipped rather
+// than executed: the rest of an idle loop, or of a frame waiting for the
+// display (C8_QUIRK_DISPLAY_WAIT).
+int c8_skipped(Chip8 *vm);
+
+// Makes c8_cycle() skip idle loops (the default), or execute them like any
+// other code, e.g. to benchmark the instructions actually executed. The
+// outcome is the same either way, but c8_idle() then only reports frames
+// waiting for the display, which are always skipped as nothing runs.
+void c8_set_idle_skip(Chip8 *vm, bool on);
+
 // Returns true if the last executed instruction was 00FD. (S-CHIP)
 bool c8_ended(Chip8 *vm);
 
-// Returns 1 if the pixel is set, 0 if the pixel is cleared.
+// Returns the color of the pixel, bit N set if it's set in plane N: 1 if the
+// pixel is set, 0 if it's cleared, 2 and 3 only if XO-CHIP drew plane 1.
 // ASSERT: 0 <= row <= 63 && 0 <= col <= 127
 int c8_get_pixel(Chip8 *vm, int row, int col);
 
+// Copies the first plane of the screen to out, scaled up to 128x64 in lo-res
+// mode. Lo-res screens are held at 64x32, so the host should read them
+// through this function (or c8_get_pixel()) rather than vm->screen.
+void c8_export_screen(Chip8 *vm, uint64_t out[SCREEN_HEIGHT][2]);
+
+// Same as c8_export_screen(), for plane N (XO-CHIP).
+// ASSERT: 0 <= plane < C8_PLANES
+void c8_export_plane(Chip8 *vm, int plane, uint64_t out[SCREEN_HEIGHT][2]);
+
+// Returns a 64-bit FNV-1a hash of the 128x64 screen, and of the second plane
+// if anything is drawn on it. Two VMs showing the same pixels always have the
+// same hash.
+uint64_t c8_screen_hash(Chip8 *vm);
+
 // Returns last executed opcode.
 int c8_get_opcode(Chip8 *vm);
 
+// Returns the byte at addr, which wraps around the memory in use.
+uint8_t c8_read_ram(Chip8 *vm, uint16_t addr);
+
 // Sets selected key to 1.
 // ASSERT: 0 <= key <= 15
 void c8_press_key(Chip8 *vm, int key);
@@ -107,7 +495,38 @@ void c8_release_key(Chip8 *vm, int key);
 // Sets frequency of the emulator (or its "speed").
 void c8_set_freq(Chip8 *vm, int emu_freq);
 
-// Sets behavior (CHIP-8, CHIP-48/S-CHIP 1.0 or S-CHIP 1.1) of the emulator.
+// Sets behavior (CHIP-8, CHIP-48/S-CHIP 1.0, S-CHIP 1.1 or XO-CHIP) of the
+// emulator, along with the quirks of the platform.
 void c8_set_platform(Chip8 *vm, Platform plt);
 
+// Sets the quirks of the emulator (C8_QUIRK_* flags), for instance
+// C8_QUIRKS_CHIP8 | C8_QUIRK_VF_RESET | C8_QUIRK_DISPLAY_WAIT for the
+// original COSMAC VIP interpreter. The quirks of each platform run on an
+// interpreter specialized for them, other combinations on a generic one.
+// C8_QUIRK_XO needs the memory attached by c8_attach_xo_ram() to run.
+void c8_set_quirks(Chip8 *vm, uint8_t quirks);
+
+// Returns the name of quirk N (C8_QUIRK_* = 1 << N), such as "vf-reset", or
+// NULL if there's no such quirk.
+const char *c8_quirk_name(int n);
+
+// Returns the name of the platform, such as "schip1.1", or NULL if there's
+// no such platform.
+const char *c8_platform_name(Platform plt);
+
+// Parses the name of a platform followed by extra quirks, each after a '+',
+// e.g. "chip8+vf-reset+display-wait". The quirks are meant to be added to
+// the platform's with c8_set_quirks().
+// Returns false if a name is unknown.
+bool c8_parse_platform(const char *s, Platform *plt, uint8_t *quirks);
+
+// Returns the size of the memory in use, RAM_SIZE with C8_QUIRK_XO and
+// CHIP8_RAM_SIZE otherwise. Addresses wrap around at that size, and only
+// that much is saved, snapshotted and scanned for code.
+int c8_memory_size(const Chip8 *vm);
+
+// Returns the name of sequence N (C8Fusion), such as "Annn+Dxyn", or NULL if
+// there's no such sequence.
+const char *c8_fusion_name(int n);
+
 #endif
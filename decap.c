@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+
+// Colors of pixels set in no plane, plane 0, plane 1 and both, as in chip8
+static uint32_t palette[4] = {0x000000, 0xFFFFFF, 0xFF6600, 0x662200};
+
+typedef struct {
+    const char *capture_path;
+    const char *out;  // PNG file prefix, or "-" for a PPM stream on stdout
+    int scale;
+    long first;  // First frame exported
+    long count;  // No. frames exported, all if 0
+} Options;
+
+// Reads the whole file, returns NULL on error
+static uint8_t *
+read_file(const char *path, long *size)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) return NULL;
+
+    long capacity = 1 << 16, n = 0;
+    uint8_t *data = malloc(capacity);
+    size_t got;
+    while (data && (got = fread(data + n, 1, capacity - n, file)) > 0) {
+        n += (long) got;
+        if (n == capacity) {
+            uint8_t *grown = realloc(data, capacity *= 2);
+            if (!grown) free(data);
+            data = grown;
+        }
+    }
+    fclose(file);
+    *size = n;
+    return data;
+}
+
+static uint32_t crc_table[256];
+
+static void
+crc_init(void)
+{
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        crc_table[n] = c;
+    }
+}
+
+static uint32_t
+crc_update(uint32_t crc, const uint8_t *p, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        crc = crc_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+static void
+put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void
+write_chunk(FILE *file, const char *type, const uint8_t *data, uint32_t n)
+{
+    uint8_t word[4];
+    put32(word, n);
+    fwrite(word, 1, 4, file);
+    fwrite(type, 1, 4, file);
+    if (n > 0) fwrite(data, 1, n, file);
+
+    uint32_t crc = crc_update(0xFFFFFFFF, (const uint8_t *) type, 4);
+    crc = crc_update(crc, data, n);
+    put32(word, crc ^ 0xFFFFFFFF);
+    fwrite(word, 1, 4, file);
+}
+
+// Color of every pixel of the frame, scaled up, one byte per pixel
+static void
+frame_pixels(const C8Capture *cap, int scale, uint8_t *pixels)
+{
+    int width = SCREEN_WIDTH * scale;
+    for (int row = 0; row < SCREEN_HEIGHT * scale; row++) {
+        for (int col = 0; col < width; col++) {
+            int r = row / scale, c = col / scale, color = 0;
+            for (int p = 0; p < cap->planes; p++)
+                color |= (cap->screen[p][r][c / 64] >> (63 - c % 64) & 1) << p;
+            pixels[row * width + col] = (uint8_t) color;
+        }
+    }
+}
+
+// Writes a PNG with a 4-color palette. The image data is stored in
+// uncompressed deflate blocks, which keeps this free of zlib.
+static int
+write_png(const char *path, const uint8_t *pixels, int width, int height)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file) return -1;
+    fwrite("\x89PNG\r\n\x1A\n", 1, 8, file);
+
+    uint8_t ihdr[13] = {0};
+    put32(ihdr, width);
+    put32(ihdr + 4, height);
+    ihdr[8] = 8;  // Bit depth
+    ihdr[9] = 3;  // Indexed color
+    write_chunk(file, "IHDR", ihdr, sizeof(ihdr));
+
+    uint8_t plte[3 * 4];
+    for (int i = 0; i < 4; i++) {
+        plte[3 * i] = palette[i] >> 16;
+        plte[3 * i + 1] = palette[i] >> 8;
+        plte[3 * i + 2] = palette[i];
+    }
+    write_chunk(file, "PLTE", plte, sizeof(plte));
+
+    // Each row starts with filter type 0
+    size_t raw_size = (size_t) (width + 1) * height;
+    size_t blocks = (raw_size + 0xFFFE) / 0xFFFF;
+    uint8_t *idat = malloc(2 + raw_size + 5 * blocks + 4);
+    if (!idat) {
+        fclose(file);
+        return -1;
+    }
+    uint8_t *p = idat;
+    *p++ = 0x78;  // zlib header: deflate, 32 KB window, no dictionary
+    *p++ = 0x01;
+
+    uint32_t a = 1, b = 0;  // Adler-32 of the raw data
+    size_t left = raw_size, pos = 0;
+    while (left > 0) {
+        uint16_t n = left > 0xFFFF ? 0xFFFF : (uint16_t) left;
+        *p++ = left == n;  // Last block?
+        *p++ = n & 0xFF;
+        *p++ = n >> 8;
+        *p++ = ~n & 0xFF;
+        *p++ = (uint16_t) ~n >> 8;
+        for (int i = 0; i < n; i++, pos++) {
+            size_t row = pos / (width + 1), col = pos % (width + 1);
+            uint8_t byte = col == 0 ? 0 : pixels[row * width + col - 1];
+            *p++ = byte;
+            a = (a + byte) % 65521;
+            b = (b + a) % 65521;
+        }
+        left -= n;
+    }
+    put32(p, b << 16 | a);
+    p += 4;
+
+    write_chunk(file, "IDAT", idat, (uint32_t) (p - idat));
+    write_chunk(file, "IEND", NULL, 0);
+    free(idat);
+    return fclose(file) == 0 ? 0 : -1;
+}
+
+// Appends a binary PPM to stream, which video encoders read frame by frame
+static void
+write_ppm(FILE *stream, const uint8_t *pixels, int width, int height)
+{
+    fprintf(stream, "P6\n%d %d\n255\n", width, height);
+    for (int i = 0; i < width * height; i++) {
+        uint32_t rgb = palette[pixels[i]];
+        uint8_t bytes[3] = {rgb >> 16, rgb >> 8, rgb};
+        fwrite(bytes, 1, 3, stream);
+    }
+}
+
+// Parses "RRGGBB,RRGGBB[,RRGGBB,RRGGBB]": background, foreground, then the
+// colors of plane 1 alone and of both planes
+static bool
+parse_palette(const char *s)
+{
+    for (int i = 0; i < 4; i++) {
+        char *end;
+        palette[i] = strtoul(s, &end, 16) & 0xFFFFFF;
+        if (end == s) return false;
+        if (*end == '\0') return i == 1 || i == 3;
+        if (*end != ',') return false;
+        s = end + 1;
+    }
+    return false;
+}
+
+static void
+usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [options] <capture-file> <png-prefix | ->\n"
+            "  -s <scale>    pixels per CHIP-8 pixel (default: 4)\n"
+            "  -f <frame>    first frame exported (default: 0)\n"
+            "  -n <frames>   no. frames exported (default: all)\n"
+            "  -c <colors>   RRGGBB,RRGGBB[,RRGGBB,RRGGBB]: background,\n"
+            "                foreground, then the XO-CHIP colors\n"
+            "Decodes a capture written by chip8 -c or chip8-headless -c to\n"
+            "<png-prefix>000000.png, ... or, with -, to a stream of PPM\n"
+            "frames on stdout, e.g. for a video:\n"
+            "  %s game.c8fc - | ffmpeg -framerate 60 -f image2pipe \\\n"
+            "      -c:v ppm -i - -pix_fmt yuv420p game.mp4\n",
+            argv0, argv0);
+}
+
+static bool
+parse_options(Options *opt, int argc, char *argv[])
+{
+    *opt = (Options){.scale = 4};
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        if (argv[i][2] != '\0' || i + 1 >= argc) return false;
+
+        const char *arg = argv[++i];
+        switch (argv[i - 1][1]) {
+        case 's':
+            opt->scale = atoi(arg);
+            break;
+        case 'f':
+            opt->first = atol(arg);
+            break;
+        case 'n':
+            opt->count = atol(arg);
+            break;
+        case 'c':
+            if (!parse_palette(arg)) return false;
+            break;
+        default:
+            return false;
+        }
+    }
+
+    if (argc - i != 2) return false;
+    opt->capture_path = argv[i];
+    opt->out = argv[i + 1];
+    return opt->scale > 0 && opt->scale <= 64 && opt->first >= 0 &&
+           opt->count >= 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    Options opt;
+    if (!parse_options(&opt, argc, argv)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    long size;
+    uint8_t *data = read_file(opt.capture_path, &size);
+    static C8Capture cap;
+    if (!data || c8_capture_open(&cap, data, (int) size) != 0) {
+        fprintf(stderr, "Error: %s isn't a capture\n", opt.capture_path);
+        free(data);
+        return 1;
+    }
+
+    crc_init();
+    int width = SCREEN_WIDTH * opt.scale, height = SCREEN_HEIGHT * opt.scale;
+    uint8_t *pixels = malloc((size_t) width * height);
+    bool to_stdout = strcmp(opt.out, "-") == 0;
+    char path[1024];
+    long exported = 0, pos = C8_CAPTURE_HEADER_SIZE;
+    int status = 0;
+
+    while (pixels && pos < size) {
+        if (opt.count > 0 && exported == opt.count) break;
+
+        // Records are bounded, so an int is enough for what's left of one
+        long left = size - pos;
+        int n = c8_capture_next(&cap, data + pos,
+                                left < INT32_MAX ? (int) left : INT32_MAX);
+        if (n <= 0) {
+            // A capture cut short (e.g. by a crash) keeps what came before
+            fprintf(stderr, "Warning: %s after frame %u\n",
+                    n == 0 ? "truncated" : "corrupt", cap.frames);
+            break;
+        }
+        pos += n;
+
+        long frame = (long) cap.frames - 1;
+        if (frame < opt.first) continue;
+
+        frame_pixels(&cap, opt.scale, pixels);
+        if (to_stdout) {
+            write_ppm(stdout, pixels, width, height);
+        } else {
+            snprintf(path, sizeof(path), "%s%06ld.png", opt.out, frame);
+            if (write_png(path, pixels, width, height) != 0) {
+                fprintf(stderr, "Error: couldn't write %s\n", path);
+                status = 1;
+                break;
+            }
+        }
+        exported++;
+    }
+
+    if (!pixels) {
+        fprintf(stderr, "Error: out of memory\n");
+        status = 1;
+    }
+    if (to_stdout && fflush(stdout) != 0) status = 1;
+    fprintf(stderr, "%u frames decoded, %ld exported\n", cap.frames,
+            exported);
+
+    free(pixels);
+    free(data);
+    return status;
+}
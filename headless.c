@@ -0,0 +1,526 @@
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+
+#include "chip8.h"
+#include "movie.h"
+#include "profile.h"
+
+typedef struct {
+    const char *rom_path;
+    Platform platform;
+    uint8_t quirks;  // Added to those of the platform
+    int emu_freq;  // No. instructions per second
+    long frames;   // Run for N frames...
+    double secs;   // ...or for N seconds, as fast as possible
+    uint64_t seed;
+    const char *engine;      // switch, cache, fused, jit or aot
+    int lanes;               // Run N copies of the ROM in lockstep batches
+    const char *load_state;  // Start from this save state...
+    const char *save_state;  // ...and/or save the final state here
+    const char *movie;       // Replay the input (and settings) of a movie
+    const char *profile;     // Write execution counters here
+    const char *capture;     // Write the screen of every frame here
+    bool run_idle;           // Execute idle loops rather than skip them
+} Options;
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Clock of the profiler, in nanoseconds
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [options] <rom-file>\n"
+            "  -p <platform>   chip8, schip1.0, schip1.1 or xochip\n"
+            "                  (default: chip8), followed by extra quirks:\n"
+            "                  +vf-reset, +display-wait, +shift, +jump,\n"
+            "                  +load-store-x, +load-store-0 or +wrap\n"
+            "  -f <frequency>  emulator frequency (default: 1200)\n"
+            "  -n <frames>     run for N frames (default: 600)\n"
+            "  -t <seconds>    run for N seconds, as fast as possible\n"
+            "  -s <seed>       PRNG seed (default: 0)\n"
+            "  -e <engine>     switch, cache, fused, jit or aot\n"
+            "                  (default: switch)\n"
+            "  -b <lanes>      run N copies of the ROM in lockstep batches,\n"
+            "                  with seeds seed, seed+1, ...\n"
+            "  -l <state-file> start from a save state\n"
+            "  -w <state-file> save the final state\n"
+            "  -m <movie-file> replay a movie recorded by chip8, with its\n"
+            "                  platform, frequency and seed, until it ends\n"
+            "  -P <json-file>  write execution counters, \"-\" for stdout\n"
+            "                  (needs a build with -DC8_PROFILE)\n"
+            "  -c <file>       capture the screen of every frame (see\n"
+            "                  chip8-decap)\n"
+            "  -i              execute idle loops rather than skip them\n",
+            argv0);
+}
+
+static bool
+parse_options(Options *opt, int argc, char *argv[])
+{
+    *opt = (Options){
+        .platform = P_CHIP8,
+        .emu_freq = 1200,
+        .frames = 600,
+        .engine = "switch",
+    };
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (argv[i][1] == '\0' || argv[i][2] != '\0') return false;
+        if (argv[i][1] == 'i') {
+            opt->run_idle = true;
+            continue;
+        }
+        if (i + 1 >= argc) return false;
+
+        const char *arg = argv[++i];
+        switch (argv[i - 1][1]) {
+        case 'p':
+            if (!c8_parse_platform(arg, &opt->platform, &opt->quirks))
+                return false;
+            break;
+        case 'f':
+            opt->emu_freq = atoi(arg);
+            break;
+        case 'n':
+            opt->frames = atol(arg);
+            opt->secs = 0;
+            break;
+        case 't':
+            opt->secs = atof(arg);
+            opt->frames = 0;
+            break;
+        case 's':
+            opt->seed = strtoull(arg, NULL, 0);
+            break;
+        case 'e':
+            if (strcmp(arg, "switch") != 0 && strcmp(arg, "cache") != 0 &&
+                strcmp(arg, "fused") != 0 && strcmp(arg, "jit") != 0 &&
+                strcmp(arg, "aot") != 0)
+                return false;
+            opt->engine = arg;
+            break;
+        case 'b':
+            opt->lanes = atoi(arg);
+            if (opt->lanes <= 0) return false;
+            break;
+        case 'l':
+            opt->load_state = arg;
+            break;
+        case 'w':
+            opt->save_state = arg;
+            break;
+        case 'm':
+            opt->movie = arg;
+            break;
+        case 'P':
+            opt->profile = arg;
+            break;
+        case 'c':
+            opt->capture = arg;
+            break;
+        default:
+            return false;
+        }
+    }
+
+    if (i != argc - 1 || ((opt->movie || opt->capture) && opt->lanes > 0))
+        return false;
+    opt->rom_path = argv[i];
+    return opt->emu_freq > 0 && (opt->frames > 0 || opt->secs > 0);
+}
+
+// Loads the ROM into n VMs
+static int
+load_rom(Chip8 *vm, int n, const char *path)
+{
+    // Save states refer to the ROM, which must outlive the VMs
+    static unsigned char rom[MAX_ROM_SIZE];
+
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Error: couldn't open ROM file\n");
+        return -1;
+    }
+    size_t size = fread(rom, 1, sizeof(rom), file);
+    fclose(file);
+
+    // CHIP-8 and S-CHIP only have 4 KB
+    if ((int) size > c8_memory_size(vm) - PC_OFFSET) {
+        fprintf(stderr, "Error: the ROM doesn't fit in %d bytes of memory\n",
+                c8_memory_size(vm));
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++)
+        c8_load_rom(&vm[i], rom, (int) size);
+    return 0;
+}
+
+// Loads a save state into n VMs
+static int
+load_state(Chip8 *vm, int n, const char *path)
+{
+    static uint8_t state[C8_STATE_MAX_SIZE];
+
+    FILE *file = fopen(path, "rb");
+    if (!file) return -1;
+    size_t size = fread(state, 1, sizeof(state), file);
+    fclose(file);
+
+    for (int i = 0; i < n; i++)
+        if (c8_load_state(&vm[i], state, (int) size) != 0) return -1;
+    return 0;
+}
+
+static int
+save_state(Chip8 *vm, const char *path)
+{
+    static uint8_t state[C8_STATE_MAX_SIZE];
+    int size = c8_save_state(vm, state, sizeof(state));
+
+    FILE *file = fopen(path, "wb");
+    if (!file) return -1;
+    size_t written = fwrite(state, 1, size, file);
+    return (fclose(file) == 0 && written == (size_t) size) ? 0 : -1;
+}
+
+// Attaches the same counters to n VMs
+static int
+attach_profile(Chip8 *vm, int n, C8Profile *prof)
+{
+    prof->clock = now_ns;
+    for (int i = 0; i < n; i++)
+        if (c8_attach_profile(&vm[i], prof) != 0) return -1;
+    return 0;
+}
+
+static int
+save_profile(C8Profile *prof, Chip8 *vm, const char *path)
+{
+    if (profile_save_json(prof, vm, path) == 0) return 0;
+    fprintf(stderr, "Error: couldn't write profile\n");
+    return -1;
+}
+
+// Translated code is either writable or executable (see c8_attach_jit())
+static int
+protect_code(void *code, uint32_t size, bool exec)
+{
+    return mprotect(code, size,
+                    exec ? PROT_READ | PROT_EXEC : PROT_READ | PROT_WRITE);
+}
+
+static int
+attach_jit(Chip8 *vm, C8Jit *jit)
+{
+    const size_t size = 1 << 20;
+    void *code = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) return -1;
+    return c8_attach_jit(vm, jit, code, size, protect_code);
+}
+
+// How many times each sequence ran fused
+static void
+print_fusions(const C8DecodeCache *cache)
+{
+    for (int f = 0; f < C8_FUSIONS; f++) {
+        if (cache->fused[f] == 0) continue;
+        printf("fused:       %-14s %llu\n", c8_fusion_name(f),
+               (unsigned long long) cache->fused[f]);
+    }
+}
+
+// Runs opt->lanes copies of the ROM, C8_BATCH_LANES at a time
+static int
+run_batch(const Options *opt)
+{
+    int n = opt->lanes;
+    int batches = (n + C8_BATCH_LANES - 1) / C8_BATCH_LANES;
+    Chip8 *vm = calloc(n, sizeof(*vm));
+    C8Batch *batch = calloc(batches, sizeof(*batch));
+    if (!vm || !batch) {
+        fprintf(stderr, "Error: out of memory\n");
+        return 1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        c8_init(&vm[i], opt->emu_freq, opt->platform, opt->seed + i);
+        c8_set_quirks(&vm[i], vm[i].quirks | opt->quirks);
+        c8_set_idle_skip(&vm[i], !opt->run_idle);
+    }
+
+    // Only XO-CHIP lanes need the memory past 4 KB
+    uint8_t *xo_ram = NULL;
+    if (vm[0].quirks & C8_QUIRK_XO) {
+        xo_ram = malloc((size_t) n * XO_RAM_SIZE);
+        if (!xo_ram) {
+            fprintf(stderr, "Error: out of memory\n");
+            return 1;
+        }
+        for (int i = 0; i < n; i++)
+            c8_attach_xo_ram(&vm[i], &xo_ram[(size_t) i * XO_RAM_SIZE]);
+    }
+    if (load_rom(vm, n, opt->rom_path) != 0) return 1;
+    if (opt->load_state && load_state(vm, n, opt->load_state) != 0) {
+        fprintf(stderr, "Error: couldn't load state\n");
+        return 1;
+    }
+    static C8Profile profile;
+    if (opt->profile && attach_profile(vm, n, &profile) != 0) {
+        fprintf(stderr, "Error: built without -DC8_PROFILE\n");
+        return 1;
+    }
+    for (int i = 0; i < batches; i++) {
+        int lanes = n - i * C8_BATCH_LANES;
+        if (lanes > C8_BATCH_LANES) lanes = C8_BATCH_LANES;
+        c8_batch_init(&batch[i], &vm[i * C8_BATCH_LANES], lanes);
+    }
+
+    long frames = 0;
+    double skipped = 0;
+    int status = 0;
+    double start = now();
+    double elapsed = 0;
+
+    // The first lane runs with the same seed as a single VM would, so its
+    // screen hash can be compared with a run without -b
+    while (!c8_ended(&vm[0]) && status == 0) {
+        if (opt->frames > 0 && frames >= opt->frames) break;
+
+        for (int i = 0; i < batches; i++) {
+            if (c8_batch_cycle(&batch[i]) != 0) {
+                fprintf(stderr, "Error: unknown opcode in batch %d\n", i);
+                status = 1;
+            }
+        }
+
+        for (int i = 0; i < n; i++) {
+            c8_decrement_timers(&vm[i]);
+            skipped += c8_skipped(&vm[i]);
+        }
+        frames++;
+
+        if (opt->secs > 0 && frames % 64 == 0) {
+            elapsed = now() - start;
+            if (elapsed >= opt->secs) break;
+        }
+    }
+
+    elapsed = now() - start;
+    if (elapsed <= 0) elapsed = 1e-9;
+
+    double lockstep = 0, serial = 0;
+    for (int i = 0; i < batches; i++) {
+        lockstep += batch[i].lockstep;
+        serial += batch[i].serial;
+    }
+    double executed = (double) frames * vm[0].IPF * n - skipped;
+
+    printf("rom:         %s\n", opt->rom_path);
+    printf("platform:    %s\n", c8_platform_name(opt->platform));
+    printf("ipf:         %d\n", vm[0].IPF);
+    printf("lanes:       %d\n", n);
+    printf("frames:      %ld\n", frames);
+    printf("elapsed:     %.6f s\n", elapsed);
+    printf("executed:    %.0f\n", executed);
+    printf("skipped:     %.0f\n", skipped);
+    printf("ips:         %.0f\n", executed / elapsed);
+    printf("lockstep:    %.1f%%\n",
+           100 * lockstep / (lockstep + serial > 0 ? lockstep + serial : 1));
+    printf("screen hash: %016llx\n",
+           (unsigned long long) c8_screen_hash(&vm[0]));
+
+    if (opt->profile && save_profile(&profile, vm, opt->profile) != 0)
+        status = 1;
+
+    free(batch);
+    free(xo_ram);
+    free(vm);
+    return status;
+}
+
+int
+main(int argc, char *argv[])
+{
+    Options opt;
+    if (!parse_options(&opt, argc, argv)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    static Chip8 vm;
+    static uint8_t xo_ram[XO_RAM_SIZE];
+    static C8DecodeCache cache;
+    static C8Jit jit;
+    static C8Aot aot;
+    Movie movie = {0};
+    if (opt.movie) {
+        if (movie_load(&movie, opt.movie) != 0) {
+            fprintf(stderr, "Error: couldn't load movie\n");
+            return 1;
+        }
+        movie_init_vm(&movie, &vm);
+        opt.frames = movie.frames;
+    } else {
+        c8_init(&vm, opt.emu_freq, opt.platform, opt.seed);
+        c8_set_quirks(&vm, vm.quirks | opt.quirks);
+    }
+    c8_attach_xo_ram(&vm, xo_ram);
+    c8_set_idle_skip(&vm, !opt.run_idle);
+
+    if (strcmp(opt.engine, "switch") != 0) c8_attach_cache(&vm, &cache);
+    if (strcmp(opt.engine, "fused") == 0) c8_set_fusion(&vm, true);
+    if (strcmp(opt.engine, "jit") == 0 && attach_jit(&vm, &jit) != 0) {
+        fprintf(stderr, "Error: JIT not supported on this host\n");
+        return 1;
+    }
+
+    if (opt.lanes > 0) return run_batch(&opt);
+
+    static C8Profile profile;
+    if (opt.profile && attach_profile(&vm, 1, &profile) != 0) {
+        fprintf(stderr, "Error: built without -DC8_PROFILE\n");
+        return 1;
+    }
+
+    if (load_rom(&vm, 1, opt.rom_path) != 0) return 1;
+    if (opt.load_state && load_state(&vm, 1, opt.load_state) != 0) {
+        fprintf(stderr, "Error: couldn't load state\n");
+        return 1;
+    }
+    // Recompiled code is checked against the ROM and the quirks
+    bool use_aot = strcmp(opt.engine, "aot") == 0;
+    if (use_aot && c8_attach_aot(&vm, &aot) != 0) {
+        fprintf(stderr, "Error: not built with this ROM recompiled for "
+                        "these quirks (see chip8-aot)\n");
+        return 1;
+    }
+    if (opt.movie && movie.rom_hash != vm.rom_hash) {
+        fprintf(stderr, "Error: the movie was recorded with another ROM\n");
+        return 1;
+    }
+
+    // Records go through stdio's buffer, so the time measured includes
+    // what recording actually costs a frame
+    static C8Capture capture;
+    static uint8_t record[C8_CAPTURE_MAX_FRAME_SIZE];
+    FILE *capture_file = NULL;
+    uint64_t capture_ns = 0, capture_bytes = 0;
+    if (opt.capture) {
+        capture_file = fopen(opt.capture, "wb");
+        if (!capture_file) {
+            fprintf(stderr, "Error: couldn't write %s\n", opt.capture);
+            return 1;
+        }
+        int size = c8_capture_start(&capture, &vm, record);
+        fwrite(record, 1, size, capture_file);
+    }
+
+    long frames = 0, idle = 0;
+    double skipped = 0;
+    int status = 0;
+    double start = now();
+    double elapsed = 0;
+
+    while (!c8_ended(&vm)) {
+        if (opt.frames > 0 && frames >= opt.frames) break;
+        if (opt.movie && movie_play(&movie, frames, &vm) != 0) break;
+
+        if (c8_cycle(&vm) != 0) {
+            fprintf(stderr, "Error: unknown opcode \"0x%x\"\n",
+                    c8_get_opcode(&vm));
+            status = 1;
+            break;
+        }
+
+        if (capture_file) {
+            uint64_t t = now_ns();
+            int size = c8_capture_frame(&capture, &vm, record);
+            fwrite(record, 1, size, capture_file);
+            capture_ns += now_ns() - t;
+            capture_bytes += size;
+        }
+
+        c8_decrement_timers(&vm);
+        idle += c8_idle(&vm);
+        skipped += c8_skipped(&vm);
+        frames++;
+
+        // Checking the clock every frame would dominate low IPF runs
+        if (opt.secs > 0 && frames % 64 == 0) {
+            elapsed = now() - start;
+            if (elapsed >= opt.secs) break;
+        }
+    }
+
+    elapsed = now() - start;
+    if (elapsed <= 0) elapsed = 1e-9;
+
+    // Instructions executed during the final frame are not counted
+    // separately: c8_cycle() either runs all of them or stops the run.
+    // Skipped instructions (see c8_skipped()) didn't run at all.
+    double executed = (double) frames * vm.IPF - skipped;
+
+    printf("rom:         %s\n", opt.rom_path);
+    printf("platform:    %s\n", c8_platform_name(vm.platform));
+    printf("ipf:         %d\n", vm.IPF);
+    printf("frames:      %ld\n", frames);
+    printf("elapsed:     %.6f s\n", elapsed);
+    printf("executed:    %.0f\n", executed);
+    printf("skipped:     %.0f\n", skipped);
+    printf("ips:         %.0f\n", executed / elapsed);
+    printf("fps:         %.0f\n", frames / elapsed);
+    printf("idle:        %.1f%% of frames\n",
+           100.0 * idle / (frames > 0 ? frames : 1));
+    if (use_aot) {
+        double executed = aot.native + aot.interpreted;
+        printf("recompiled:  %.1f%% of instructions executed\n",
+               100.0 * aot.native / (executed > 0 ? executed : 1));
+    }
+    if (cache.fuse) print_fusions(&cache);
+    if (capture_file) {
+        long n = frames > 0 ? frames : 1;
+        printf("capture:     %.0f ns/frame, %.1f bytes/frame\n",
+               (double) capture_ns / n, (double) capture_bytes / n);
+        if (fclose(capture_file) != 0) {
+            fprintf(stderr, "Error: couldn't write %s\n", opt.capture);
+            status = 1;
+        }
+    }
+    printf("screen hash: %016llx\n",
+           (unsigned long long) c8_screen_hash(&vm));
+
+    if (opt.save_state && save_state(&vm, opt.save_state) != 0) {
+        fprintf(stderr, "Error: couldn't save state\n");
+        return 1;
+    }
+    if (opt.profile && save_profile(&profile, &vm, opt.profile) != 0)
+        return 1;
+
+    movie_free(&movie);
+    return status;
+}
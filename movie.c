@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "movie.h"
+
+// File format, little-endian:
+// "C8MV", version, platform, quirks, 1 unused byte, IPF (4 bytes), seed (8),
+// ROM hash (4), no. frames (4), then the keypad of each frame (2 bytes).
+// Version 1 movies have no quirks, they ran with those of the platform.
+#define HEADER_SIZE 28
+
+void
+movie_start(Movie *movie, Chip8 *vm)
+{
+    *movie = (Movie){
+        .seed = vm->rng,
+        .platform = vm->platform,
+        .quirks = vm->quirks,
+        .IPF = vm->IPF,
+        .rom_hash = vm->rom_hash,
+    };
+}
+
+int
+movie_record(Movie *movie, Chip8 *vm)
+{
+    if (movie->frames == movie->capacity) {
+        uint32_t capacity = movie->capacity ? 2 * movie->capacity : 4096;
+        uint16_t *keys = realloc(movie->keys, capacity * sizeof(*keys));
+        if (!keys) return -1;
+        movie->keys = keys;
+        movie->capacity = capacity;
+    }
+
+    uint16_t keys = 0;
+    for (int i = 0; i < KEYPAD_SIZE; i++)
+        keys |= (vm->keypad[i] != 0) << i;
+    movie->keys[movie->frames++] = keys;
+    return 0;
+}
+
+void
+movie_truncate(Movie *movie, uint32_t frames)
+{
+    movie->frames = frames < movie->frames ? movie->frames - frames : 0;
+}
+
+void
+movie_init_vm(Movie *movie, Chip8 *vm)
+{
+    c8_init(vm, 0, movie->platform, movie->seed);
+    c8_set_quirks(vm, movie->quirks);
+    vm->IPF = movie->IPF;
+}
+
+int
+movie_play(Movie *movie, uint32_t frame, Chip8 *vm)
+{
+    if (frame >= movie->frames) return -1;
+    for (int i = 0; i < KEYPAD_SIZE; i++) {
+        if (movie->keys[frame] >> i & 1)
+            c8_press_key(vm, i);
+        else
+            c8_release_key(vm, i);
+    }
+    return 0;
+}
+
+static void
+put(uint8_t *p, uint64_t v, int size)
+{
+    for (int i = 0; i < size; i++)
+        p[i] = v >> (8 * i);
+}
+
+static uint64_t
+get(const uint8_t *p, int size)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < size; i++)
+        v |= (uint64_t) p[i] << (8 * i);
+    return v;
+}
+
+int
+movie_save(Movie *movie, const char *path)
+{
+    uint8_t header[HEADER_SIZE] = {'C', '8', 'M', 'V', MOVIE_VERSION};
+    header[5] = movie->platform;
+    header[6] = movie->quirks;
+    put(&header[8], movie->IPF, 4);
+    put(&header[12], movie->seed, 8);
+    put(&header[20], movie->rom_hash, 4);
+    put(&header[24], movie->frames, 4);
+
+    FILE *file = fopen(path, "wb");
+    if (!file) return -1;
+
+    bool ok = fwrite(header, 1, HEADER_SIZE, file) == HEADER_SIZE;
+    for (uint32_t i = 0; ok && i < movie->frames; i++) {
+        uint8_t keys[2];
+        put(keys, movie->keys[i], 2);
+        ok = fwrite(keys, 1, 2, file) == 2;
+    }
+
+    return (fclose(file) == 0 && ok) ? 0 : -1;
+}
+
+int
+movie_load(Movie *movie, const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) return -1;
+
+    uint8_t header[HEADER_SIZE];
+    if (fread(header, 1, HEADER_SIZE, file) != HEADER_SIZE ||
+        memcmp(header, "C8MV", 4) != 0 || header[4] < 1 ||
+        header[4] > MOVIE_VERSION || header[5] > P_XOCHIP ||
+        (int32_t) get(&header[8], 4) <= 0) {
+        fclose(file);
+        return -1;
+    }
+
+    static const uint8_t platform_quirks[] = {
+        [P_CHIP8] = C8_QUIRKS_CHIP8,
+        [P_SCHIP_1_0] = C8_QUIRKS_SCHIP_1_0,
+        [P_SCHIP_1_1] = C8_QUIRKS_SCHIP_1_1,
+        [P_XOCHIP] = C8_QUIRKS_XOCHIP,
+    };
+
+    // Version 1 only stores the platform, version 2 predates C8_QUIRK_XO
+    uint8_t quirks = header[6];
+    if (header[4] == 1)
+        quirks = platform_quirks[header[5]];
+    else if (header[4] == 2 && header[5] == P_XOCHIP)
+        quirks |= C8_QUIRK_XO;
+
+    *movie = (Movie){
+        .platform = header[5],
+        .quirks = quirks,
+        .IPF = (int32_t) get(&header[8], 4),
+        .seed = get(&header[12], 8),
+        .rom_hash = (uint32_t) get(&header[20], 4),
+    };
+
+    uint32_t frames = (uint32_t) get(&header[24], 4);
+    movie->keys = malloc((frames ? frames : 1) * sizeof(*movie->keys));
+    if (!movie->keys) {
+        fclose(file);
+        return -1;
+    }
+    movie->capacity = frames;
+
+    for (uint32_t i = 0; i < frames; i++) {
+        uint8_t keys[2];
+        if (fread(keys, 1, 2, file) != 2) {
+            fclose(file);
+            movie_free(movie);
+            return -1;
+        }
+        movie->keys[movie->frames++] = (uint16_t) get(keys, 2);
+    }
+
+    fclose(file);
+    return 0;
+}
+
+void
+movie_free(Movie *movie)
+{
+    free(movie->keys);
+    *movie = (Movie){0};
+}
@@ -0,0 +1,48 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include <stdint.h>
+
+#include "chip8.h"
+
+#define MOVIE_VERSION 3
+
+// Everything needed to replay a session exactly: the settings and seed the
+// emulator started with, and the state of the keypad during each frame
+typedef struct {
+    uint64_t seed;
+    Platform platform;
+    uint8_t quirks;
+    int IPF;
+    uint32_t rom_hash;  // The movie only makes sense with the same ROM
+
+    uint16_t *keys;  // Keypad of each frame, bit N is set if key N is down
+    uint32_t frames;
+    uint32_t capacity;
+} Movie;
+
+// Starts recording a movie of vm, right after c8_init() and c8_load_rom().
+void movie_start(Movie *movie, Chip8 *vm);
+
+// Records the keypad for the next frame, to be called before c8_cycle().
+// Returns -1 if out of memory.
+int movie_record(Movie *movie, Chip8 *vm);
+
+// Drops the last N recorded frames (e.g. after rewinding).
+void movie_truncate(Movie *movie, uint32_t frames);
+
+// Initializes vm with the settings of the movie, like c8_init(). The ROM
+// must be loaded afterwards (attaching the XO-CHIP memory first).
+void movie_init_vm(Movie *movie, Chip8 *vm);
+
+// Sets the keypad of vm to the one of the given frame, to be called before
+// c8_cycle(). Returns -1 if the movie has ended.
+int movie_play(Movie *movie, uint32_t frame, Chip8 *vm);
+
+// Returns -1 on I/O errors and on files that aren't movies.
+int movie_save(Movie *movie, const char *path);
+int movie_load(Movie *movie, const char *path);
+
+void movie_free(Movie *movie);
+
+#endif
@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "profile.h"
+
+static const char *timed_names[C8_TIMED_OPS] = {"Dxyn", "Dxy0", "scroll"};
+
+static void
+write_ops(C8Profile *prof, FILE *file)
+{
+    // Classes sorted by count, most executed first
+    int order[C8_PROFILE_OPS], n = 0;
+    for (int op = 0; op < C8_PROFILE_OPS; op++) {
+        if (prof->op_count[op] == 0) continue;
+        int i = n++;
+        for (; i > 0 && prof->op_count[order[i - 1]] < prof->op_count[op]; i--)
+            order[i] = order[i - 1];
+        order[i] = op;
+    }
+
+    fprintf(file, "  \"ops\": [");
+    for (int i = 0; i < n; i++) {
+        const char *name = c8_profile_op_name(order[i]);
+        fprintf(file, "%s\n    {\"op\": \"%s\", \"count\": %llu}",
+                i > 0 ? "," : "", name ? name : "?",
+                (unsigned long long) prof->op_count[order[i]]);
+    }
+    fprintf(file, "\n  ],\n");
+}
+
+static void
+write_timed(C8Profile *prof, FILE *file)
+{
+    fprintf(file, "  \"timed\": [");
+    for (int op = 0; op < C8_TIMED_OPS; op++) {
+        uint64_t calls = prof->calls[op];
+        fprintf(file,
+                "%s\n    {\"op\": \"%s\", \"calls\": %llu, \"ticks\": %llu, "
+                "\"ticks_per_call\": %.1f}",
+                op > 0 ? "," : "", timed_names[op], (unsigned long long) calls,
+                (unsigned long long) prof->time[op],
+                calls ? (double) prof->time[op] / calls : 0.0);
+    }
+    fprintf(file, "\n  ],\n");
+}
+
+static void
+write_hottest(C8Profile *prof, Chip8 *vm, FILE *file)
+{
+    uint16_t addr[PROFILE_HOT_ADDRS];
+    int n = c8_profile_hottest(prof, addr, PROFILE_HOT_ADDRS);
+
+    fprintf(file, "  \"hottest\": [");
+    for (int i = 0; i < n; i++) {
+        int a = addr[i];
+        int opcode = c8_read_ram(vm, a) << 8 | c8_read_ram(vm, a + 1);
+        fprintf(file,
+                "%s\n    {\"addr\": \"0x%03X\", \"opcode\": \"%04X\", "
+                "\"count\": %llu}",
+                i > 0 ? "," : "", a, opcode,
+                (unsigned long long) prof->pc_count[a]);
+    }
+    fprintf(file, "\n  ]\n");
+}
+
+int
+profile_save_json(C8Profile *prof, Chip8 *vm, const char *path)
+{
+    bool to_stdout = strcmp(path, "-") == 0;
+    FILE *file = to_stdout ? stdout : fopen(path, "w");
+    if (!file) return -1;
+
+    uint64_t executed = 0;
+    for (int op = 0; op < C8_PROFILE_OPS; op++)
+        executed += prof->op_count[op];
+
+    fprintf(file, "{\n");
+    fprintf(file, "  \"executed\": %llu,\n", (unsigned long long) executed);
+    fprintf(file, "  \"skipped\": %llu,\n",
+            (unsigned long long) prof->skipped);
+    write_ops(prof, file);
+    write_timed(prof, file);
+    write_hottest(prof, vm, file);
+    fprintf(file, "}\n");
+
+    if (to_stdout) return fflush(file) == 0 ? 0 : -1;
+    return fclose(file) == 0 ? 0 : -1;
+}
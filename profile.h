@@ -0,0 +1,15 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "chip8.h"
+
+#define PROFILE_HOT_ADDRS 32  // No. addresses listed in a report
+
+// Writes the counters of prof as JSON to path, "-" for stdout: instructions
+// executed and skipped, executions per class of instruction (most executed
+// first), time spent in the timed instructions, and the most executed
+// addresses along with the opcode found there in vm.
+// Returns -1 on I/O errors.
+int profile_save_json(C8Profile *prof, Chip8 *vm, const char *path);
+
+#endif
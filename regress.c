@@ -0,0 +1,449 @@
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 199309L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "chip8.h"
+
+#define MAX_TESTS 256
+#define MAX_WORKERS 64
+
+// Every test runs once per engine, and all of them must match the hash.
+// E_CAPTURE is the switch interpreter, executing idle loops rather than
+// skipping them, with every frame captured and decoded again (see
+// c8_capture_frame()). E_AOT only runs with -a, on the tests of the ROM
+// recompiled in by chip8-aot.
+typedef enum {
+    E_SWITCH,
+    E_CACHE,
+    E_FUSED,
+    E_JIT,
+    E_BATCH,
+    E_CAPTURE,
+    E_AOT,
+    E_COUNT,
+} Engine;
+
+static const char *engine_names[E_COUNT] = {
+    "switch", "cache", "fused", "jit", "batch", "capture", "aot",
+};
+
+// One line of the golden file
+typedef struct {
+    char rom[256];
+    char platform[64];  // Name, then extra quirks: "chip8+vf-reset"
+    int emu_freq;
+    int frames;
+    int poke;  // Written to 0x1FF to skip the menu of the Timendus tests
+    uint64_t golden;
+
+    unsigned char data[MAX_ROM_SIZE];
+    int size;
+    uint64_t hash[E_COUNT];
+} Test;
+
+// Double-ended queue of jobs (test * no. engines + engine). The owner pops
+// from the bottom, idle workers steal from the top.
+typedef struct {
+    pthread_mutex_t lock;
+    int jobs[MAX_TESTS * E_COUNT];
+    int top;
+    int bottom;
+} Deque;
+
+typedef struct {
+    Test *tests;
+    Deque deque[MAX_WORKERS];
+    int workers;
+    Engine engine[E_COUNT];  // Engines each test runs on
+    int engines;
+} Pool;
+
+typedef struct {
+    Pool *pool;
+    int id;
+} Worker;
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Captures the frame, and checks that decoding it gives the screen back
+static bool
+capture_frame(C8Capture *enc, C8Capture *dec, Chip8 *vm)
+{
+    uint8_t record[C8_CAPTURE_MAX_FRAME_SIZE];
+    uint64_t plane[SCREEN_HEIGHT][2];
+    int size = c8_capture_frame(enc, vm, record);
+    if (c8_capture_next(dec, record, size) != size) return false;
+    for (int p = 0; p < enc->planes; p++) {
+        c8_export_plane(vm, p, plane);
+        if (memcmp(plane, dec->screen[p], sizeof(plane)) != 0) return false;
+    }
+    return true;
+}
+
+// Translated code is either writable or executable (see c8_attach_jit()).
+// The translator would quietly leave the blocks to the interpreter if this
+// failed, and the JIT tests would pass without testing it.
+static int
+protect_code(void *code, uint32_t size, bool exec)
+{
+    if (mprotect(code, size,
+                 exec ? PROT_READ | PROT_EXEC : PROT_READ | PROT_WRITE) == 0)
+        return 0;
+    fprintf(stderr, "Error: couldn't make the JIT code %s\n",
+            exec ? "executable" : "writable");
+    exit(1);
+}
+
+// Runs a test on one engine, returns the hash of the final screen, or 0 if
+// a capture didn't decode to the screen or the JIT didn't translate any
+// block. Runs stop early on unknown opcodes and on 00FD, like the SDL
+// frontend does.
+static uint64_t
+run_test(Test *t, Engine engine)
+{
+    Platform plt = P_CHIP8;
+    uint8_t quirks = 0;
+    c8_parse_platform(t->platform, &plt, &quirks);
+
+    // Only the first lane is checked, the others have their own seeds so
+    // that the batch also has to deal with diverging lanes
+    Chip8 *vm = calloc(C8_BATCH_LANES, sizeof(*vm));
+    uint8_t *xo_ram = malloc((size_t) C8_BATCH_LANES * XO_RAM_SIZE);
+    C8DecodeCache *cache = calloc(1, sizeof(*cache));
+    C8Jit *jit = calloc(1, sizeof(*jit));
+    C8Aot *aot = calloc(1, sizeof(*aot));
+    C8Capture *capture = calloc(2, sizeof(*capture));  // Encoder, decoder
+    const uint32_t code_size = 1 << 20;
+    void *code = MAP_FAILED;
+    if (!vm || !xo_ram || !cache || !jit || !aot || !capture) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+
+    int lanes = (engine == E_BATCH) ? C8_BATCH_LANES : 1;
+    for (int i = 0; i < lanes; i++) {
+        c8_init(&vm[i], t->emu_freq, plt, i);
+        c8_set_quirks(&vm[i], vm[i].quirks | quirks);
+        if (vm[i].quirks & C8_QUIRK_XO)
+            c8_attach_xo_ram(&vm[i], &xo_ram[(size_t) i * XO_RAM_SIZE]);
+        if (t->size > c8_memory_size(&vm[i]) - PC_OFFSET) {
+            fprintf(stderr, "Error: %s doesn't fit in memory\n", t->rom);
+            exit(1);
+        }
+        if (engine != E_SWITCH && engine != E_BATCH && engine != E_CAPTURE)
+            c8_attach_cache(&vm[i], cache);
+        if (engine == E_FUSED) c8_set_fusion(&vm[i], true);
+        if (engine == E_CAPTURE) c8_set_idle_skip(&vm[i], false);
+        c8_load_rom(&vm[i], t->data, t->size);
+        if (t->poke) vm[i].RAM[0x1FF] = t->poke;
+    }
+
+    if (engine == E_JIT) {
+        code = mmap(NULL, code_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (code == MAP_FAILED ||
+            c8_attach_jit(&vm[0], jit, code, code_size, protect_code) != 0) {
+            fprintf(stderr, "Error: couldn't attach the JIT\n");
+            exit(1);
+        }
+    }
+    if (engine == E_AOT && c8_attach_aot(&vm[0], aot) != 0) {
+        fprintf(stderr, "Error: %s isn't recompiled in\n", t->rom);
+        exit(1);
+    }
+
+    C8Batch batch;
+    c8_batch_init(&batch, vm, lanes);
+
+    uint8_t header[C8_CAPTURE_HEADER_SIZE];
+    c8_capture_start(&capture[0], &vm[0], header);
+    c8_capture_open(&capture[1], header, sizeof(header));
+    bool decoded = true;
+
+    for (int frame = 0; frame < t->frames && !c8_ended(&vm[0]); frame++) {
+        if (engine == E_BATCH) {
+            c8_batch_cycle(&batch);
+            if (batch.failed & 1) break;
+        } else if (c8_cycle(&vm[0]) != 0) {
+            break;
+        }
+        if (engine == E_CAPTURE && decoded)
+            decoded = capture_frame(&capture[0], &capture[1], &vm[0]);
+        for (int i = 0; i < lanes; i++)
+            c8_decrement_timers(&vm[i]);
+    }
+
+    uint64_t hash = decoded ? c8_screen_hash(&vm[0]) : 0;
+    if (engine == E_JIT && jit->blocks == 0) {
+        fprintf(stderr, "Error: the JIT didn't translate any block of %s\n",
+                t->rom);
+        hash = 0;
+    }
+    if (code != MAP_FAILED) munmap(code, code_size);
+    free(capture);
+    free(aot);
+    free(jit);
+    free(cache);
+    free(xo_ram);
+    free(vm);
+    return hash;
+}
+
+// Is the test for the ROM and the quirks recompiled in by chip8-aot?
+static bool
+is_recompiled(Test *t)
+{
+    static Chip8 vm;
+    static uint8_t xo_ram[XO_RAM_SIZE];
+    static C8Aot aot;
+
+    Platform plt = P_CHIP8;
+    uint8_t quirks = 0;
+    c8_parse_platform(t->platform, &plt, &quirks);
+    c8_init(&vm, t->emu_freq, plt, 0);
+    c8_set_quirks(&vm, vm.quirks | quirks);
+    c8_attach_xo_ram(&vm, xo_ram);
+    if (t->size > c8_memory_size(&vm) - PC_OFFSET) return false;
+    c8_load_rom(&vm, t->data, t->size);
+    return c8_attach_aot(&vm, &aot) == 0;
+}
+
+// Pops a job from the bottom of the worker's own deque, or steals one from
+// the top of another deque. Returns -1 once every deque is empty.
+static int
+next_job(Pool *pool, int id)
+{
+    for (int i = 0; i < pool->workers; i++) {
+        Deque *d = &pool->deque[(id + i) % pool->workers];
+        int job = -1;
+
+        pthread_mutex_lock(&d->lock);
+        if (d->top < d->bottom)
+            job = (i == 0) ? d->jobs[--d->bottom] : d->jobs[d->top++];
+        pthread_mutex_unlock(&d->lock);
+
+        if (job >= 0) return job;
+    }
+    return -1;
+}
+
+static void *
+worker_main(void *arg)
+{
+    Worker *w = arg;
+    int job;
+    while ((job = next_job(w->pool, w->id)) >= 0) {
+        Test *t = &w->pool->tests[job / w->pool->engines];
+        Engine engine = w->pool->engine[job % w->pool->engines];
+        t->hash[engine] = run_test(t, engine);
+    }
+    return NULL;
+}
+
+// Reads the golden file, and the ROMs it refers to (relative to its
+// directory). Returns the number of tests, -1 on error.
+static int
+load_tests(const char *path, Test *tests)
+{
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Error: couldn't open %s\n", path);
+        return -1;
+    }
+
+    const char *slash = strrchr(path, '/');
+    int dir_len = slash ? (int) (slash - path + 1) : 0;
+
+    char line[512];
+    int n = 0;
+    while (fgets(line, sizeof(line), file)) {
+        if (line[0] == '#' || line[0] == '\n') continue;
+
+        Test *t = &tests[n];
+        unsigned long long golden;
+        Platform plt;
+        uint8_t quirks;
+        if (n == MAX_TESTS ||
+            sscanf(line, "%255s %63s %d %d %i %llx", t->rom, t->platform,
+                   &t->emu_freq, &t->frames, &t->poke, &golden) != 6 ||
+            !c8_parse_platform(t->platform, &plt, &quirks) ||
+            t->emu_freq <= 0) {
+            fprintf(stderr, "Error: bad line in %s: %s", path, line);
+            fclose(file);
+            return -1;
+        }
+        t->golden = golden;
+
+        char rom_path[1024];
+        snprintf(rom_path, sizeof(rom_path), "%.*s%s", dir_len, path, t->rom);
+        FILE *rom = fopen(rom_path, "rb");
+        if (!rom) {
+            fprintf(stderr, "Error: couldn't open %s\n", rom_path);
+            fclose(file);
+            return -1;
+        }
+        t->size = (int) fread(t->data, 1, sizeof(t->data), rom);
+        fclose(rom);
+        n++;
+    }
+
+    fclose(file);
+    return n;
+}
+
+static int
+save_tests(const char *path, const Test *tests, int n)
+{
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "Error: couldn't write %s\n", path);
+        return -1;
+    }
+
+    fprintf(file,
+            "# Golden screen hashes, checked by `make test`.\n"
+            "# Regenerate with ./chip8-regress -u after an intended change.\n"
+            "# poke: value written to 0x1FF before running (0 = none), which\n"
+            "# makes the Timendus tests skip their menu.\n"
+            "#\n"
+            "# rom                   platform  freq   frames  poke  hash\n");
+    for (int i = 0; i < n; i++) {
+        const Test *t = &tests[i];
+        fprintf(file, "%-23s %-9s %-6d %-7d %-5d %016llx\n", t->rom,
+                t->platform, t->emu_freq, t->frames, t->poke,
+                (unsigned long long) t->hash[E_SWITCH]);
+    }
+
+    fclose(file);
+    return 0;
+}
+
+static void
+usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [options] [golden-file]\n"
+            "  -j <threads>  no. worker threads (default: no. cores)\n"
+            "  -u            update the golden hashes\n"
+            "  -a            only run the tests of the ROM recompiled in by\n"
+            "                chip8-aot, on the aot engine\n"
+            "Default golden file: ROMs/tests/golden.txt\n",
+            argv0);
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *path = "ROMs/tests/golden.txt";
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    bool update = false;
+    bool aot = false;
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-u") == 0) {
+            update = true;
+        } else if (strcmp(argv[i], "-a") == 0) {
+            aot = true;
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            workers = atol(argv[++i]);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (i < argc) path = argv[i++];
+    if (i != argc || workers <= 0 || (update && aot)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (workers > MAX_WORKERS) workers = MAX_WORKERS;
+
+    static Test tests[MAX_TESTS];
+    int n = load_tests(path, tests);
+    if (n < 0) return 1;
+
+    static Pool pool;
+    if (aot) {
+        // Keep the tests the recompiled ROM can run
+        int kept = 0;
+        for (int t = 0; t < n; t++)
+            if (is_recompiled(&tests[t])) tests[kept++] = tests[t];
+        n = kept;
+        if (n == 0) {
+            fprintf(stderr, "Error: no test for the ROM recompiled in "
+                            "(see chip8-aot)\n");
+            return 1;
+        }
+        pool.engine[pool.engines++] = E_AOT;
+    } else {
+        for (Engine e = 0; e < E_AOT; e++)
+            pool.engine[pool.engines++] = e;
+    }
+
+    // Deal jobs round-robin, slow tests end up being stolen
+    pool.tests = tests;
+    pool.workers = (int) workers;
+    for (int w = 0; w < pool.workers; w++)
+        pthread_mutex_init(&pool.deque[w].lock, NULL);
+    for (int job = 0; job < n * pool.engines; job++) {
+        Deque *d = &pool.deque[job % pool.workers];
+        d->jobs[d->bottom++] = job;
+    }
+
+    double start = now();
+    pthread_t threads[MAX_WORKERS];
+    Worker args[MAX_WORKERS];
+    for (int w = 0; w < pool.workers; w++) {
+        args[w] = (Worker){&pool, w};
+        pthread_create(&threads[w], NULL, worker_main, &args[w]);
+    }
+    for (int w = 0; w < pool.workers; w++)
+        pthread_join(threads[w], NULL);
+    double elapsed = now() - start;
+
+    int failed = 0;
+    for (int t = 0; t < n; t++) {
+        Test *test = &tests[t];
+        for (int i = 0; i < pool.engines; i++) {
+            // Engines must always agree, the golden hash only when checking
+            Engine e = pool.engine[i];
+            uint64_t expected = update ? test->hash[E_SWITCH] : test->golden;
+            if (test->hash[e] == expected) continue;
+            printf("FAIL %-23s %-9s %-6s got %016llx, expected %016llx\n",
+                   test->rom, test->platform, engine_names[e],
+                   (unsigned long long) test->hash[e],
+                   (unsigned long long) expected);
+            failed++;
+        }
+    }
+
+    printf("%d/%d passed (%d tests x %d engines, %d threads) in %.3f s\n",
+           n * pool.engines - failed, n * pool.engines, n, pool.engines,
+           pool.workers, elapsed);
+
+    if (update) {
+        if (failed) {
+            fprintf(stderr, "Error: engines disagree, not updating\n");
+            return 1;
+        }
+        if (save_tests(path, tests, n) != 0) return 1;
+        printf("Updated %s\n", path);
+    }
+
+    return failed ? 1 : 0;
+}
@@ -2,19 +2,292 @@
 
 #include "SDL2/SDL.h"
 #include "chip8.h"
+#include "movie.h"
 
 typedef struct {
     SDL_Window *window;
     SDL_Renderer *renderer;
     SDL_Texture *texture;
+    uint32_t palette[256][4];  // Nibbles of planes 0, 1 -> 4 RGBA pixels
 } GfxContext;
 
+// Histogram of durations, in HIST_STEP ms buckets
+#define HIST_BUCKETS 200
+#define HIST_STEP 0.25
+
+typedef struct {
+    const char *name;
+    Uint32 count[HIST_BUCKETS + 1];  // The last bucket holds the rest
+    Uint32 n;
+    double sum;
+    double max;
+} Histogram;
+
+void
+hist_add(Histogram *h, double ms)
+{
+    int bucket = (int) (ms / HIST_STEP);
+    h->count[bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS]++;
+    h->n++;
+    h->sum += ms;
+    if (ms > h->max) h->max = ms;
+}
+
+// Returns the upper bound of the bucket holding the p-th percentile
+double
+hist_percentile(Histogram *h, double p)
+{
+    Uint32 rank = (Uint32) (h->n * p / 100), seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->count[i];
+        if (seen > rank) return (i + 1) * HIST_STEP;
+    }
+    return h->max;
+}
+
+void
+hist_dump(Histogram *h)
+{
+    if (h->n == 0) {
+        SDL_Log("%s: no samples", h->name);
+        return;
+    }
+    SDL_Log("%s: %u samples, mean %.2f ms, p50 %.2f ms, p99 %.2f ms, "
+            "max %.2f ms",
+            h->name, h->n, h->sum / h->n, hist_percentile(h, 50),
+            hist_percentile(h, 99), h->max);
+    for (int i = 0; i <= HIST_BUCKETS; i++) {
+        if (h->count[i] == 0) continue;
+        if (i < HIST_BUCKETS)
+            SDL_Log("  %6.2f-%6.2f ms: %u", i * HIST_STEP,
+                    (i + 1) * HIST_STEP, h->count[i]);
+        else
+            SDL_Log("  %6.2f+       ms: %u", i * HIST_STEP, h->count[i]);
+    }
+}
+
+// Paces frames against absolute deadlines, so time overslept in a frame is
+// made up for in the next ones instead of adding up
+typedef struct {
+    Uint64 freq;      // Performance counter ticks per second
+    Uint64 period;    // Ticks per frame
+    Uint64 spin;      // Ticks before the deadline spent spinning, not sleeping
+    Uint64 deadline;  // End of the current frame
+    Uint64 last;      // Start of the current frame
+    double speed;     // Multiple of GAME_LOOP_FREQ
+    Histogram frame_time;
+} Pacer;
+
+// Frames the pacer may fall behind before giving up on catching up
+#define PACER_MAX_LAG 4
+
+void
+pacer_init(Pacer *pacer)
+{
+    Uint64 freq = SDL_GetPerformanceFrequency();
+    Uint64 now = SDL_GetPerformanceCounter();
+    *pacer = (Pacer){
+        .freq = freq,
+        .period = (Uint64) (freq / (double) GAME_LOOP_FREQ + 0.5),
+        .spin = freq / 500,  // 2 ms covers the granularity of SDL_Delay()
+        .last = now,
+        .speed = 1,
+        .frame_time = {.name = "Frame time"},
+    };
+    pacer->deadline = now + pacer->period;
+}
+
+// Runs frames speed times faster from now on, or as fast as possible if
+// speed is 0
+void
+pacer_set_speed(Pacer *pacer, double speed)
+{
+    Uint64 now = SDL_GetPerformanceCounter();
+    pacer->speed = speed;
+    pacer->period =
+        speed > 0 ? (Uint64) (pacer->freq / (GAME_LOOP_FREQ * speed) + 0.5)
+                  : 0;
+    pacer->deadline = now + pacer->period;
+    pacer->last = now;
+}
+
+// Waits until the end of the current frame: sleeps most of the time left,
+// then spins until the deadline
+void
+pacer_wait(Pacer *pacer)
+{
+    Uint64 now = SDL_GetPerformanceCounter();
+    if (now + pacer->spin < pacer->deadline) {
+        Uint64 sleep = pacer->deadline - pacer->spin - now;
+        SDL_Delay((Uint32) (sleep * 1000 / pacer->freq));
+    }
+    while ((now = SDL_GetPerformanceCounter()) < pacer->deadline)
+        ;
+
+    // After a long stall (e.g. the window was dragged) running frames back
+    // to back to catch up would look worse than skipping ahead
+    pacer->deadline += pacer->period;
+    if (now > pacer->deadline + PACER_MAX_LAG * pacer->period)
+        pacer->deadline = now + pacer->period;
+
+    // Frame times are only meaningful at normal speed
+    if (pacer->speed == 1)
+        hist_add(&pacer->frame_time,
+                 (double) (now - pacer->last) * 1000 / pacer->freq);
+    pacer->last = now;
+}
+
+// Square wave played while the sound timer is non-zero, or the audio
+// pattern of an XO-CHIP program. The emulation thread only sets the atomics,
+// and the audio callback only reads them, so neither ever waits for the
+// other.
+typedef struct {
+    SDL_AudioDeviceID device;  // 0 if there's no audio
+    SDL_AudioSpec spec;        // As obtained from the device
+    SDL_atomic_t on;           // Should the tone play?
+    SDL_atomic_t changed;      // Low bits of the counter when `on` changed
+    SDL_atomic_t pattern[4];   // 128 1-bit samples, MSB first
+    SDL_atomic_t rate;         // Pattern samples per second, 0 for the tone
+
+    // Only touched by the callback until the device is closed
+    bool playing;          // Value of `on` in the last callback
+    Uint32 phase;          // Samples into the current period of the wave
+    double position;       // Pattern sample being played, and the fraction
+    Uint64 last_callback;  // Performance counter
+    Uint32 underruns;      // Callbacks late by more than half a buffer
+    Histogram latency;     // From a change of `on` to it being heard
+} Beeper;
+
+#define BEEPER_FREQ 44100
+#define BEEPER_TONE 440
+#define BEEPER_VOLUME 3000
+
+void
+beeper_callback(void *data, Uint8 *stream, int len)
+{
+    Beeper *beeper = data;
+    Sint16 *samples = (Sint16 *) stream;
+    int n = len / (int) sizeof(*samples);
+    Uint64 freq = SDL_GetPerformanceFrequency();
+    Uint64 now = SDL_GetPerformanceCounter();
+
+    // The device played out the last buffer before asking for this one
+    Uint64 period = beeper->spec.samples * freq / beeper->spec.freq;
+    if (beeper->last_callback && now - beeper->last_callback > period * 3 / 2)
+        beeper->underruns++;
+    beeper->last_callback = now;
+
+    // What's written now is heard once the buffer queued before it is done
+    bool on = SDL_AtomicGet(&beeper->on);
+    if (on != beeper->playing) {
+        Uint32 waited = (Uint32) now - (Uint32) SDL_AtomicGet(&beeper->changed);
+        hist_add(&beeper->latency, (double) (waited + period) * 1000 / freq);
+        beeper->playing = on;
+    }
+
+    Uint32 pattern[4];
+    for (int i = 0; i < 4; i++)
+        pattern[i] = (Uint32) SDL_AtomicGet(&beeper->pattern[i]);
+    int rate = SDL_AtomicGet(&beeper->rate);
+    double step = (double) rate / beeper->spec.freq;
+
+    Uint32 half = beeper->spec.freq / (2 * BEEPER_TONE);
+    for (int i = 0; i < n; i++) {
+        if (!on) {
+            samples[i] = 0;
+            continue;
+        }
+        if (rate > 0) {
+            int bit = (int) beeper->position;
+            bool high = pattern[bit / 32] >> (31 - bit % 32) & 1;
+            samples[i] = high ? BEEPER_VOLUME : -BEEPER_VOLUME;
+            beeper->position += step;
+            if (beeper->position >= 128) beeper->position -= 128;
+            continue;
+        }
+        samples[i] = beeper->phase < half ? BEEPER_VOLUME : -BEEPER_VOLUME;
+        if (++beeper->phase == 2 * half) beeper->phase = 0;
+    }
+}
+
+// Opens the default audio device with a buffer of the given no. samples,
+// the smaller the buffer the sooner the tone follows the sound timer.
+// Returns false if there's no audio, the emulator then runs silent.
+bool
+beeper_open(Beeper *beeper, int buffer_size)
+{
+    *beeper = (Beeper){.latency = {.name = "Sound timer to output"}};
+    if (SDL_InitSubSystem(SDL_INIT_AUDIO) != 0) return false;
+
+    SDL_AudioSpec want = {
+        .freq = BEEPER_FREQ,
+        .format = AUDIO_S16SYS,
+        .channels = 1,
+        .samples = (Uint16) buffer_size,
+        .callback = beeper_callback,
+        .userdata = beeper,
+    };
+    beeper->device = SDL_OpenAudioDevice(NULL, 0, &want, &beeper->spec,
+                                         SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+    if (beeper->device == 0) {
+        SDL_Log("Error: couldn't open audio: %s", SDL_GetError());
+        return false;
+    }
+
+    SDL_Log("Audio: %d Hz, buffer of %u samples (%.1f ms)", beeper->spec.freq,
+            beeper->spec.samples,
+            beeper->spec.samples * 1000.0 / beeper->spec.freq);
+    SDL_PauseAudioDevice(beeper->device, 0);
+    return true;
+}
+
+// Starts or stops the tone, never blocks
+void
+beeper_set(Beeper *beeper, bool on)
+{
+    if (!beeper || SDL_AtomicGet(&beeper->on) == on) return;
+    SDL_AtomicSet(&beeper->changed, (int) SDL_GetPerformanceCounter());
+    SDL_AtomicSet(&beeper->on, on);
+}
+
+// Plays pattern at the given pitch instead of the tone, or the tone again if
+// pattern is NULL. A pattern changed while it plays may be heard half old,
+// half new for one buffer.
+void
+beeper_set_pattern(Beeper *beeper, const uint8_t pattern[16], int pitch)
+{
+    if (!beeper) return;
+    if (!pattern) {
+        SDL_AtomicSet(&beeper->rate, 0);
+        return;
+    }
+    for (int i = 0; i < 4; i++) {
+        const uint8_t *p = &pattern[4 * i];
+        SDL_AtomicSet(&beeper->pattern[i],
+                      (int) ((Uint32) p[0] << 24 | p[1] << 16 | p[2] << 8 |
+                             p[3]));
+    }
+    SDL_AtomicSet(&beeper->rate,
+                  (int) (4000 * SDL_pow(2, (pitch - 64) / 48.0) + 0.5));
+}
+
+void
+beeper_close(Beeper *beeper)
+{
+    if (beeper->device == 0) return;
+    SDL_CloseAudioDevice(beeper->device);
+    SDL_Log("Audio: %u underruns", beeper->underruns);
+}
+
+// With vsync, SDL_RenderPresent() waits for the display, which only holds
+// back the render thread
 void
 gfx_create(GfxContext *ctx,
            const char *title,
            int width,
            int height,
-           int scale_factor)
+           int scale_factor,
+           bool vsync)
 {
     SDL_Init(SDL_INIT_VIDEO);
 
@@ -22,17 +295,81 @@ gfx_create(GfxContext *ctx,
                                    SDL_WINDOWPOS_CENTERED, width * scale_factor,
                                    height * scale_factor, SDL_WINDOW_SHOWN);
 
-    ctx->renderer = SDL_CreateRenderer(ctx->window, -1, 0);
+    SDL_DisplayMode mode;
+    int display = SDL_GetWindowDisplayIndex(ctx->window);
+    if (vsync && SDL_GetCurrentDisplayMode(display, &mode) == 0 &&
+        (mode.refresh_rate < GAME_LOOP_FREQ - 1 ||
+         mode.refresh_rate > GAME_LOOP_FREQ + 1)) {
+        SDL_Log("The display runs at %d Hz, not syncing to it",
+                mode.refresh_rate);
+        vsync = false;
+    }
+
+    Uint32 flags = vsync ? SDL_RENDERER_PRESENTVSYNC : 0;
+    ctx->renderer = SDL_CreateRenderer(ctx->window, -1, flags);
 
     ctx->texture = SDL_CreateTexture(ctx->renderer, SDL_PIXELFORMAT_RGBA8888,
                                      SDL_TEXTUREACCESS_STREAMING, width,
                                      height);
 }
 
+// Builds the lookup table used to expand a nibble of each plane to RGBA
+// pixels. colors[N] is the color of pixels set in the planes of bits N, in
+// RGBA8888 format: 0 is the background, 1 the foreground, 2 and 3 only show
+// up in XO-CHIP programs.
+void
+gfx_set_colors(GfxContext *ctx, const uint32_t colors[4])
+{
+    for (int index = 0; index < 256; index++) {
+        for (int bit = 0; bit < 4; bit++) {
+            int lo = index >> (7 - bit) & 1, hi = index >> (3 - bit) & 1;
+            ctx->palette[index][bit] = colors[hi << 1 | lo];
+        }
+    }
+}
+
+// Converts rows first to last (inclusive) of the planes to RGBA pixels
 void
-gfx_update(GfxContext *ctx, const void *pixels, int pitch)
+planes_to_rgba(GfxContext *ctx,
+               uint64_t (*screen)[SCREEN_HEIGHT][2],
+               void *pixels,
+               int pitch,
+               int first,
+               int last)
 {
-    SDL_UpdateTexture(ctx->texture, NULL, pixels, pitch);
+    for (int row = first; row <= last; row++) {
+        uint8_t *line = (uint8_t *) pixels + (row - first) * pitch;
+        uint32_t *dst = (uint32_t *) line;
+
+        // Each row is 2 words long, leftmost pixel first
+        for (int i = 0; i < SCREEN_WIDTH / 4; i++) {
+            int shift = 60 - 4 * (i % 16);
+            int lo = screen[0][row][i / 16] >> shift & 0xF;
+            int hi = screen[1][row][i / 16] >> shift & 0xF;
+            SDL_memcpy(&dst[4 * i], ctx->palette[lo << 4 | hi],
+                       4 * sizeof(uint32_t));
+        }
+    }
+}
+
+// Converts rows first to last (inclusive) of the planes straight into the
+// texture and presents it
+void
+gfx_update(GfxContext *ctx,
+           uint64_t (*screen)[SCREEN_HEIGHT][2],
+           int first,
+           int last)
+{
+    SDL_Rect rect = {0, first, SCREEN_WIDTH, last - first + 1};
+    void *pixels;
+    int pitch;
+
+    // The locked area is write-only, so every pixel in it must be written
+    if (SDL_LockTexture(ctx->texture, &rect, &pixels, &pitch) == 0) {
+        planes_to_rgba(ctx, screen, pixels, pitch, first, last);
+        SDL_UnlockTexture(ctx->texture);
+    }
+
     SDL_RenderClear(ctx->renderer);
     SDL_RenderCopy(ctx->renderer, ctx->texture, NULL, NULL);
     SDL_RenderPresent(ctx->renderer);
@@ -47,8 +384,131 @@ gfx_destroy(GfxContext *ctx)
     SDL_Quit();
 }
 
+// Saves the state of the emulator to a file
+void
+save_state(Chip8 *vm, const char *path)
+{
+    static uint8_t state[C8_STATE_MAX_SIZE];
+    int size = c8_save_state(vm, state, sizeof(state));
+
+    SDL_RWops *file = SDL_RWFromFile(path, "wb");
+    if (!file || SDL_RWwrite(file, state, 1, size) != (size_t) size)
+        SDL_Log("Error: couldn't save state to %s", path);
+    if (file) SDL_RWclose(file);
+}
+
+// Restores the state of the emulator from a file, returns true on success
+bool
+load_state(Chip8 *vm, const char *path)
+{
+    static uint8_t state[C8_STATE_MAX_SIZE];
+
+    SDL_RWops *file = SDL_RWFromFile(path, "rb");
+    if (!file) {
+        SDL_Log("Error: couldn't open %s", path);
+        return false;
+    }
+    size_t size = SDL_RWread(file, state, 1, sizeof(state));
+    SDL_RWclose(file);
+
+    if (c8_load_state(vm, state, (int) size) != 0) {
+        SDL_Log("Error: %s isn't a valid state for this ROM", path);
+        return false;
+    }
+    return true;
+}
+
+// Screens published by the emulation thread to the render thread. Each
+// thread owns one buffer, the third one is exchanged through `latest`, so
+// neither ever waits for the other.
+typedef struct {
+    uint64_t screen[C8_PLANES][SCREEN_HEIGHT][2];
+    Uint32 input_time;    // Time of the first key event this frame reflects
+    int number;           // No. frames emulated before this one
+    uint64_t dirty_rows;  // Rows changed since the frame last shown, at least
+} Frame;
+
+typedef struct {
+    Frame frames[3];
+    SDL_atomic_t latest;  // Index of the exchanged buffer, | FRESH if unread
+    int back;             // Written by the emulation thread
+    int front;            // Read by the render thread
+} TripleBuffer;
+
+#define FRESH 4
+
+void
+tb_init(TripleBuffer *tb)
+{
+    SDL_memset(tb, 0, sizeof(*tb));
+    SDL_AtomicSet(&tb->latest, 1);
+    tb->back = 0;
+    tb->front = 2;
+}
+
+// Publishes the back buffer and takes the exchanged one in its place.
+// Returns true if the frame it replaced was never read.
+bool
+tb_publish(TripleBuffer *tb)
+{
+    SDL_MemoryBarrierRelease();
+    int old = SDL_AtomicSet(&tb->latest, tb->back | FRESH);
+    tb->back = old & 3;
+    return old & FRESH;
+}
+
+// Takes the newest frame, returns NULL if none was published since the
+// last call
+Frame *
+tb_acquire(TripleBuffer *tb)
+{
+    if (!(SDL_AtomicGet(&tb->latest) & FRESH)) return NULL;
+    int old = SDL_AtomicSet(&tb->latest, tb->front);
+    SDL_MemoryBarrierAcquire();
+    tb->front = old & 3;
+    return &tb->frames[tb->front];
+}
+
+// No. frames whose dirty rows are kept, the render thread redraws everything
+// if it's further behind
+#define DIRTY_HISTORY 64
+
+// State shared by the render thread (input, display) and the emulation
+// thread (everything else)
+typedef struct {
+    Chip8 *vm;
+    Movie *movie;
+    const char *record_path;  // Recording a movie...
+    const char *replay_path;  // ...or replaying one
+    uint32_t movie_frame;     // Next frame to replay
+    const char *state_path;
+    C8Rewind *rewind;         // NULL if there's no memory for it
+    C8Capture *capture;       // Screen of every frame, if capturing...
+    SDL_RWops *capture_file;  // ...to this file
+    Beeper *beeper;
+    Pacer pacer;
+
+    SDL_atomic_t keys;        // Keypad, bit N is set if key N is down
+    SDL_atomic_t rewinding;   // Is Backspace held?
+    SDL_atomic_t save;        // F5 was pressed...
+    SDL_atomic_t load;        // ...or F9
+    SDL_atomic_t input_time;  // Time of the first key event not applied yet
+    SDL_atomic_t turbo;       // Toggled by Tab
+    SDL_atomic_t frames;      // No. frames emulated so far
+    SDL_atomic_t shown;       // Number of the frame last shown, -1 if none
+    uint64_t dirty_rows;      // Rows changed by the frame being emulated...
+    uint64_t dirty[DIRTY_HISTORY];  // ...and by the last frames
+    double turbo_speed;       // Speed in turbo mode, 0 if uncapped
+    SDL_atomic_t quit;        // Set by either thread to stop both
+    int status;               // Exit status, set by the emulation thread
+
+    TripleBuffer screens;
+} Emulator;
+
+// Polls events on the render thread and passes them on to the emulator.
+// Returns true if the user wants to quit.
 bool
-handle_input_event(Chip8 *vm)
+handle_input_event(Emulator *emu)
 {
     static const SDL_Scancode scancodes[] = {
         SDL_SCANCODE_X, SDL_SCANCODE_1, SDL_SCANCODE_2, SDL_SCANCODE_3,
@@ -59,6 +519,7 @@ handle_input_event(Chip8 *vm)
 
     SDL_Event event;
     bool quit = false;
+    int keys = SDL_AtomicGet(&emu->keys);
 
     while (SDL_PollEvent(&event)) {
         switch (event.type) {
@@ -71,17 +532,32 @@ handle_input_event(Chip8 *vm)
                 quit = true;
                 break;
             }
+            if (event.key.keysym.scancode == SDL_SCANCODE_F5) {
+                SDL_AtomicSet(&emu->save, 1);
+                break;
+            }
+            if (event.key.keysym.scancode == SDL_SCANCODE_F9) {
+                SDL_AtomicSet(&emu->load, 1);
+                break;
+            }
+            if (event.key.keysym.scancode == SDL_SCANCODE_TAB &&
+                !event.key.repeat) {
+                SDL_AtomicSet(&emu->turbo, !SDL_AtomicGet(&emu->turbo));
+                break;
+            }
 
             for (int i = 0; i < KEYPAD_SIZE; i++) {
-                if (event.key.keysym.scancode == scancodes[i])
-                    c8_press_key(vm, i);
+                if (event.key.keysym.scancode != scancodes[i]) continue;
+                keys |= 1 << i;
+                SDL_AtomicCAS(&emu->input_time, 0, event.key.timestamp);
             }
             break;
 
         case SDL_KEYUP:
             for (int i = 0; i < KEYPAD_SIZE; i++) {
-                if (event.key.keysym.scancode == scancodes[i])
-                    c8_release_key(vm, i);
+                if (event.key.keysym.scancode != scancodes[i]) continue;
+                keys &= ~(1 << i);
+                SDL_AtomicCAS(&emu->input_time, 0, event.key.timestamp);
             }
             break;
 
@@ -90,27 +566,225 @@ handle_input_event(Chip8 *vm)
         }
     }
 
+    SDL_AtomicSet(&emu->keys, keys);
+    const Uint8 *state = SDL_GetKeyboardState(NULL);
+    SDL_AtomicSet(&emu->rewinding, state[SDL_SCANCODE_BACKSPACE]);
     return quit;
 }
 
+// Steps back one frame while Backspace is held
+void
+emu_rewind(Emulator *emu, bool *rewinding)
+{
+    C8Rewind *rw = emu->rewind;
+    if (!*rewinding) {
+        SDL_Log("Rewind: %u frames (%.1f s) in %u KB of %u KB, "
+                "%u keyframes, largest frame %u bytes",
+                rw->frames, rw->frames / 60.0, rw->used >> 10,
+                rw->size >> 10, rw->keyframes, rw->max_frame);
+    }
+    *rewinding = true;
+
+    // Rewinding a movie takes back its last frame
+    if (c8_rewind_pop(rw, emu->vm) == 0 && emu->movie) {
+        if (emu->record_path) movie_truncate(emu->movie, 1);
+        if (emu->replay_path && emu->movie_frame > 0) emu->movie_frame--;
+    }
+}
+
+// Runs one frame of the emulator, returns false once it's over
+bool
+emu_frame(Emulator *emu, bool *rewinding)
+{
+    Chip8 *vm = emu->vm;
+
+    // Loading a state in the middle of a movie would break it
+    if (SDL_AtomicSet(&emu->save, 0)) save_state(vm, emu->state_path);
+    if (SDL_AtomicSet(&emu->load, 0) && !emu->record_path &&
+        !emu->replay_path) {
+        load_state(vm, emu->state_path);
+        emu->dirty_rows |= c8_dirty_rows(vm);
+    }
+
+    if (emu->rewind && SDL_AtomicGet(&emu->rewinding)) {
+        beeper_set(emu->beeper, false);
+        emu_rewind(emu, rewinding);
+        emu->dirty_rows |= c8_dirty_rows(vm);
+        return true;
+    }
+    *rewinding = false;
+
+    int keys = SDL_AtomicGet(&emu->keys);
+    for (int i = 0; i < KEYPAD_SIZE; i++) {
+        if (keys >> i & 1)
+            c8_press_key(vm, i);
+        else
+            c8_release_key(vm, i);
+    }
+
+    if (emu->replay_path &&
+        movie_play(emu->movie, emu->movie_frame++, vm) != 0) {
+        SDL_Log("Replay finished after %u frames", emu->movie->frames);
+        return false;
+    }
+    if (emu->record_path && movie_record(emu->movie, vm) != 0) {
+        SDL_Log("Error: out of memory, stopping the recording");
+        return false;
+    }
+    if (c8_cycle(vm) != 0) {
+        SDL_Log("Error: unknown opcode \"0x%x\"\n", c8_get_opcode(vm));
+        emu->status = 1;
+        return false;
+    }
+    emu->dirty_rows |= c8_dirty_rows(vm);
+
+    // Instructions run in a burst at the start of the frame, so the tone
+    // starts right after the Fx18 that set the timer
+    uint8_t pattern[16];
+    int pitch;
+    bool xo = c8_audio_pattern(vm, pattern, &pitch);
+    beeper_set_pattern(emu->beeper, xo ? pattern : NULL, pitch);
+    beeper_set(emu->beeper, c8_sound(vm) && !SDL_AtomicGet(&emu->turbo));
+    c8_decrement_timers(vm);
+    if (emu->rewind) c8_rewind_push(emu->rewind, vm);
+    return !c8_ended(vm);
+}
+
+// Appends the frame just run (rewound frames included) to the capture.
+// Encoding takes well under a microsecond and the file is buffered, so
+// capturing doesn't change the timing of the frames.
 void
-mono_to_rgba(Chip8 *vm, uint32_t *pixels, int size)
+emu_capture(Emulator *emu)
 {
-    SDL_assert(size >= SCREEN_SIZE * 8);
-    for (int row = 0; row < SCREEN_HEIGHT; row++) {
-        for (int col = 0; col < SCREEN_WIDTH; col++) {
-            int i = SCREEN_WIDTH * row + col;
-            pixels[i] = c8_get_pixel(vm, row, col) ? 0xFFFFFFFF : 0x0;
+    static uint8_t record[C8_CAPTURE_MAX_FRAME_SIZE];
+    int size = c8_capture_frame(emu->capture, emu->vm, record);
+    if (SDL_RWwrite(emu->capture_file, record, 1, size) != (size_t) size) {
+        SDL_Log("Error: couldn't write the capture, stopping it");
+        emu->capture = NULL;
+    }
+}
+
+// Records the rows changed by frame n, and returns those changed since the
+// frame the render thread last showed. That frame may be newer by the time
+// it reads frame n, so the rows are a superset of those it has to redraw.
+uint64_t
+emu_dirty_rows(Emulator *emu, int n)
+{
+    emu->dirty[n % DIRTY_HISTORY] = emu->dirty_rows;
+    emu->dirty_rows = 0;
+
+    int shown = SDL_AtomicGet(&emu->shown);
+    if (n - shown > DIRTY_HISTORY) return ~(uint64_t) 0;
+    uint64_t rows = 0;
+    for (int i = shown + 1; i <= n; i++)
+        rows |= emu->dirty[i % DIRTY_HISTORY];
+    return rows;
+}
+
+// Emulation thread: runs frames at 60 Hz and publishes the screen after
+// each one, whether the render thread keeps up or not
+int
+emu_thread(void *data)
+{
+    Emulator *emu = data;
+    bool rewinding = false;
+    Uint32 input_time = 0;  // Of the first key event not shown yet
+    bool turbo = false;
+
+    pacer_init(&emu->pacer);
+    while (!SDL_AtomicGet(&emu->quit)) {
+        if (turbo != (bool) SDL_AtomicGet(&emu->turbo)) {
+            turbo = !turbo;
+            pacer_set_speed(&emu->pacer, turbo ? emu->turbo_speed : 1);
         }
+
+        Uint32 t = SDL_AtomicSet(&emu->input_time, 0);
+        if (input_time == 0) input_time = t;
+
+        bool running = emu_frame(emu, &rewinding);
+        if (emu->capture) emu_capture(emu);
+
+        Frame *frame = &emu->screens.frames[emu->screens.back];
+        for (int p = 0; p < C8_PLANES; p++)
+            c8_export_plane(emu->vm, p, frame->screen[p]);
+        frame->input_time = input_time;
+        frame->number = SDL_AtomicGet(&emu->frames);
+        frame->dirty_rows = emu_dirty_rows(emu, frame->number);
+
+        // A frame dropped by the render thread passes its input on
+        if (!tb_publish(&emu->screens)) input_time = 0;
+
+        SDL_AtomicAdd(&emu->frames, 1);
+
+        if (!running) break;
+        pacer_wait(&emu->pacer);
     }
+
+    beeper_set(emu->beeper, false);
+    SDL_AtomicSet(&emu->quit, 1);
+    return 0;
 }
 
 int
 main(int argc, char *argv[])
 {
-    if (argc != 4) {
-        SDL_Log("Usage: %s <scale-factor> <emulator-frequency> <rom-file>",
-                argv[0]);
+    // -r records the session to a movie, -m replays one, -v syncs to the
+    // display, -t logs frame time and latency histograms on exit, -a sets
+    // the audio buffer size (0 to mute), -f caps the speed of turbo mode,
+    // -p picks the platform (and extra quirks, see c8_parse_platform()) and
+    // -c captures the screen of every frame
+    const char *argv0 = argv[0];
+    const char *record_path = NULL, *replay_path = NULL;
+    const char *capture_path = NULL;
+    Platform platform = P_CHIP8;
+    uint8_t quirks = 0;
+    bool bad_platform = false;
+    bool vsync = false, telemetry = false;
+    int audio_buffer = 256;
+    double turbo_speed = 0;
+    int arg = 1;
+    while (arg + 1 < argc && argv[arg][0] == '-') {
+        if (SDL_strcmp(argv[arg], "-a") == 0) {
+            audio_buffer = SDL_atoi(argv[arg + 1]);
+            arg += 2;
+        } else if (SDL_strcmp(argv[arg], "-f") == 0) {
+            turbo_speed = SDL_atof(argv[arg + 1]);
+            arg += 2;
+        } else if (SDL_strcmp(argv[arg], "-v") == 0) {
+            vsync = true;
+            arg++;
+        } else if (SDL_strcmp(argv[arg], "-t") == 0) {
+            telemetry = true;
+            arg++;
+        } else if (SDL_strcmp(argv[arg], "-r") == 0) {
+            record_path = argv[arg + 1];
+            arg += 2;
+        } else if (SDL_strcmp(argv[arg], "-m") == 0) {
+            replay_path = argv[arg + 1];
+            arg += 2;
+        } else if (SDL_strcmp(argv[arg], "-c") == 0) {
+            capture_path = argv[arg + 1];
+            arg += 2;
+        } else if (SDL_strcmp(argv[arg], "-p") == 0) {
+            const char *name = argv[arg + 1];
+            bad_platform = !c8_parse_platform(name, &platform, &quirks);
+            arg += 2;
+        } else {
+            break;
+        }
+    }
+    argc -= arg - 1;
+    argv += arg - 1;
+
+    if ((argc != 4 && argc != 6 && argc != 8) || (record_path && replay_path) ||
+        bad_platform) {
+        SDL_Log("Usage: %s [-v] [-t] [-a <audio-buffer-size>] "
+                "[-f <turbo-speed>] "
+                "[-p chip8 | schip1.0 | schip1.1 | xochip [+<quirk>...]] "
+                "[-r <movie-file> | -m <movie-file>] [-c <capture-file>] "
+                "<scale-factor> <emulator-frequency> <rom-file> "
+                "[<fg-color> <bg-color> [<color-2> <color-3>]]",
+                argv0);
         return 1;
     }
 
@@ -118,50 +792,198 @@ main(int argc, char *argv[])
     const int emu_freq = SDL_atoi(argv[2]);
     const int scale_factor = SDL_atoi(argv[1]);
 
-    Chip8 vm;
-    c8_init(&vm, emu_freq, P_CHIP8, time(NULL));
+    // Replays run with the settings and seed of the recording
+    static Chip8 vm;
+    static uint8_t xo_ram[XO_RAM_SIZE];
+    Movie movie = {0};
+    if (replay_path) {
+        if (movie_load(&movie, replay_path) != 0) {
+            SDL_Log("Error: couldn't load movie %s", replay_path);
+            return 1;
+        }
+        movie_init_vm(&movie, &vm);
+    } else {
+        c8_init(&vm, emu_freq, platform, time(NULL));
+        c8_set_quirks(&vm, vm.quirks | quirks);
+    }
+    c8_attach_xo_ram(&vm, xo_ram);
 
+    // Save states refer to the ROM, which must outlive the emulator
+    static unsigned char rom[MAX_ROM_SIZE];
     SDL_RWops *file = SDL_RWFromFile(argv[3], "rb");
     if (!file) {
         SDL_Log("Error: couldn't open ROM file");
         return 1;
     }
-    SDL_RWread(file, &vm.RAM[PC_OFFSET], 1, MAX_ROM_SIZE);
+    size_t rom_size = SDL_RWread(file, rom, 1, MAX_ROM_SIZE);
     SDL_RWclose(file);
+    if ((int) rom_size > c8_memory_size(&vm) - PC_OFFSET) {
+        SDL_Log("Error: the ROM doesn't fit in %d bytes of memory",
+                c8_memory_size(&vm));
+        return 1;
+    }
+    c8_load_rom(&vm, rom, (int) rom_size);
+
+    if (replay_path && movie.rom_hash != vm.rom_hash) {
+        SDL_Log("Error: the movie was recorded with another ROM");
+        return 1;
+    }
+    if (record_path) movie_start(&movie, &vm);
+
+    char state_path[1024];
+    SDL_snprintf(state_path, sizeof(state_path), "%s.state", argv[3]);
+
+    // Holding backspace steps back through the last few minutes
+    static C8Rewind rewind;
+    const Uint32 rewind_size = 4 << 20;
+    uint8_t *rewind_buf = SDL_malloc(rewind_size);
+    if (rewind_buf) c8_rewind_init(&rewind, rewind_buf, rewind_size, 120);
+
+    static Emulator emu;
+    emu = (Emulator){
+        .vm = &vm,
+        .movie = (record_path || replay_path) ? &movie : NULL,
+        .record_path = record_path,
+        .replay_path = replay_path,
+        .state_path = state_path,
+        .rewind = rewind_buf ? &rewind : NULL,
+        .turbo_speed = turbo_speed,
+    };
+    tb_init(&emu.screens);
+    SDL_AtomicSet(&emu.shown, -1);
+
+    // Decoded by chip8-decap
+    static C8Capture capture;
+    SDL_RWops *capture_file = NULL;
+    if (capture_path) {
+        uint8_t header[C8_CAPTURE_HEADER_SIZE];
+        int size = c8_capture_start(&capture, &vm, header);
+        capture_file = SDL_RWFromFile(capture_path, "wb");
+        if (!capture_file ||
+            SDL_RWwrite(capture_file, header, 1, size) != (size_t) size) {
+            SDL_Log("Error: couldn't write %s", capture_path);
+            return 1;
+        }
+        emu.capture = &capture;
+        emu.capture_file = capture_file;
+    }
 
     GfxContext ctx;
-    gfx_create(&ctx, "CHIP-8", SCREEN_WIDTH, SCREEN_HEIGHT, scale_factor);
+    gfx_create(&ctx, "CHIP-8", SCREEN_WIDTH, SCREEN_HEIGHT, scale_factor,
+               vsync);
+
+    // Colors are given as RRGGBB, in hex: foreground, background, then the
+    // colors of XO-CHIP's second plane alone and of both planes
+    uint32_t colors[4] = {0x000000, 0xFFFFFF, 0xFF6600, 0x662200};
+    if (argc >= 6) {
+        colors[1] = SDL_strtoul(argv[4], NULL, 16);
+        colors[0] = SDL_strtoul(argv[5], NULL, 16);
+    }
+    if (argc == 8) {
+        colors[2] = SDL_strtoul(argv[6], NULL, 16);
+        colors[3] = SDL_strtoul(argv[7], NULL, 16);
+    }
+    for (int i = 0; i < 4; i++)
+        colors[i] = colors[i] << 8 | 0xFF;
+    gfx_set_colors(&ctx, colors);
 
-    uint32_t pixels[SCREEN_SIZE * 8];
-    const int pitch = sizeof(pixels[0]) * SCREEN_WIDTH;
-    const double performance_freq = (double) SDL_GetPerformanceFrequency();
+    static Beeper beeper;
+    if (audio_buffer > 0 && beeper_open(&beeper, audio_buffer))
+        emu.beeper = &beeper;
 
-    while (true) {
-        Uint64 start = SDL_GetPerformanceCounter();
+    // The emulator keeps its own 60 Hz, the render thread only shows the
+    // newest frame it published and so never slows it down
+    SDL_Thread *thread = SDL_CreateThread(emu_thread, "emulator", &emu);
+    if (!thread) {
+        SDL_Log("Error: couldn't create the emulation thread: %s",
+                SDL_GetError());
+        movie_free(&movie);
+        SDL_free(rewind_buf);
+        beeper_close(&beeper);
+        gfx_destroy(&ctx);
+        return 1;
+    }
+
+    // Time from a key event to the first frame presented after it, in ms
+    Histogram latency = {.name = "Input to present"};
+    Uint32 input_time = 0;
+    static uint64_t shown[C8_PLANES][SCREEN_HEIGHT][2];
+    gfx_update(&ctx, shown, 0, SCREEN_HEIGHT - 1);
+    Uint32 presented = SDL_GetTicks();
+
+    // Speed actually achieved, measured every second
+    Uint32 speed_time = presented;
+    int speed_frames = 0;
 
-        if (handle_input_event(&vm) || c8_ended(&vm)) break;
-        if (c8_cycle(&vm) != 0) goto unknown_opcode;
+    while (!SDL_AtomicGet(&emu.quit)) {
+        if (handle_input_event(&emu)) SDL_AtomicSet(&emu.quit, 1);
 
-        c8_decrement_timers(&vm);
+        Uint32 now = SDL_GetTicks();
+        bool turbo = SDL_AtomicGet(&emu.turbo);
+        if (now - speed_time >= 1000) {
+            int frames = SDL_AtomicGet(&emu.frames);
+            double speed = (frames - speed_frames) * 1000.0 /
+                           ((now - speed_time) * GAME_LOOP_FREQ);
+            char title[64] = "CHIP-8";
+            if (turbo)
+                SDL_snprintf(title, sizeof(title), "CHIP-8 (%.1fx)", speed);
+            SDL_SetWindowTitle(ctx.window, title);
+            speed_time = now;
+            speed_frames = frames;
+        }
+
+        // In turbo, most frames are skipped: only one per refresh is shown
+        if (turbo && now - presented < 1000 / GAME_LOOP_FREQ) {
+            SDL_Delay(1);
+            continue;
+        }
 
-        if (c8_screen_updated(&vm)) {
-            // Convert monochrome pixels to RGBA pixels
-            mono_to_rgba(&vm, pixels, SCREEN_SIZE * 8);
-            gfx_update(&ctx, pixels, pitch);
+        Frame *frame = tb_acquire(&emu.screens);
+        if (!frame) {
+            SDL_Delay(1);
+            continue;
         }
+        if (input_time == 0) input_time = frame->input_time;
 
-        Uint64 end = SDL_GetPerformanceCounter();
-        double elapsed_time = ((end - start) * 1000) / performance_freq;
+        // Only convert and upload the span of rows that changed since the
+        // last frame shown, which may be several emulated frames ago
+        uint64_t dirty = frame->dirty_rows;
+        SDL_AtomicSet(&emu.shown, frame->number);
+        if (dirty == 0) continue;
+        int first = 0, last = SCREEN_HEIGHT - 1;
+        while (!(dirty >> first & 1))
+            first++;
+        while (!(dirty >> last & 1))
+            last--;
 
-        if (elapsed_time < GAME_LOOP_DELAY)
-            SDL_Delay((Uint32) (GAME_LOOP_DELAY - elapsed_time + 0.5));
+        for (int p = 0; p < C8_PLANES; p++)
+            SDL_memcpy(shown[p][first], frame->screen[p][first],
+                       (last - first + 1) * sizeof(shown[p][first]));
+        gfx_update(&ctx, shown, first, last);
+        presented = now;
+        if (input_time != 0) {
+            hist_add(&latency, SDL_GetTicks() - input_time);
+            input_time = 0;
+        }
     }
 
-    gfx_destroy(&ctx);
-    return 0;
+    SDL_WaitThread(thread, NULL);
+    beeper_close(&beeper);
+    if (capture_file) {
+        SDL_Log("Capture: %u frames", capture.frames);
+        SDL_RWclose(capture_file);
+    }
+
+    if (telemetry) {
+        hist_dump(&emu.pacer.frame_time);
+        hist_dump(&latency);
+        if (emu.beeper) hist_dump(&beeper.latency);
+    }
 
-unknown_opcode:
-    SDL_Log("Error: unknown opcode \"0x%x\"\n", c8_get_opcode(&vm));
+    if (record_path && movie_save(&movie, record_path) != 0)
+        SDL_Log("Error: couldn't save movie to %s", record_path);
+    movie_free(&movie);
+    SDL_free(rewind_buf);
     gfx_destroy(&ctx);
-    return 1;
+    return emu.status;
 }